@@ -177,6 +177,15 @@ extern "C" {
     // Applies all queued changes in one go.
     MH_STATUS WINAPI MH_ApplyQueued(VOID);
 
+    // Reserves one region near the target for the trampolines of `count`
+    // hooks, so creating them takes no search for free memory. Slots still
+    // available near the target are counted first.
+    // Parameters:
+    //   pOrigin [in] A pointer to a target function, e.g. the first one of a
+    //                batch of hooks.
+    //   count   [in] Number of hooks to be created.
+    MH_STATUS WINAPI MH_ReserveBuffer(LPVOID pOrigin, UINT count);
+
     // Translates the MH_STATUS to its name as a string.
     const char * WINAPI MH_StatusToString(MH_STATUS status);
 
@@ -35,6 +35,9 @@
 // Max range for seeking a memory block. (= 1024MB)
 #define MAX_MEMORY_RANGE 0x40000000
 
+// Max number of pre-reserved regions.
+#define MAX_MEMORY_POOLS 16
+
 // Memory protection flags to check the executable address.
 #define PAGE_EXECUTE_FLAGS \
     (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)
@@ -57,6 +60,15 @@ typedef struct _MEMORY_BLOCK
     UINT usedCount;
 } MEMORY_BLOCK, *PMEMORY_BLOCK;
 
+// Region reserved by ReserveBuffer(), carved into blocks in address order.
+// Modified by HTMonkeyG
+typedef struct _MEMORY_POOL
+{
+    LPBYTE pBase;
+    LPBYTE pNext;               // Next block to be carved.
+    LPBYTE pEnd;
+} MEMORY_POOL, *PMEMORY_POOL;
+
 //-------------------------------------------------------------------------
 // Global Variables:
 //-------------------------------------------------------------------------
@@ -64,24 +76,48 @@ typedef struct _MEMORY_BLOCK
 // First element of the memory block list.
 PMEMORY_BLOCK g_pMemoryBlocks;
 
+// Pre-reserved regions.
+MEMORY_POOL g_pools[MAX_MEMORY_POOLS];
+UINT g_poolCount;
+
 //-------------------------------------------------------------------------
 VOID InitializeBuffer(VOID)
 {
     // Nothing to do for now.
 }
 
+//-------------------------------------------------------------------------
+static BOOL IsPoolBlock(PMEMORY_BLOCK pBlock)
+{
+    UINT i;
+    for (i = 0; i < g_poolCount; ++i)
+    {
+        if ((LPBYTE)pBlock >= g_pools[i].pBase && (LPBYTE)pBlock < g_pools[i].pEnd)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
 //-------------------------------------------------------------------------
 VOID UninitializeBuffer(VOID)
 {
     PMEMORY_BLOCK pBlock = g_pMemoryBlocks;
+    UINT i;
     g_pMemoryBlocks = NULL;
 
     while (pBlock)
     {
         PMEMORY_BLOCK pNext = pBlock->pNext;
-        VirtualFree(pBlock, 0, MEM_RELEASE);
+        // Blocks carved from pools are released with their pools.
+        if (!IsPoolBlock(pBlock))
+            VirtualFree(pBlock, 0, MEM_RELEASE);
         pBlock = pNext;
     }
+
+    for (i = 0; i < g_poolCount; ++i)
+        VirtualFree(g_pools[i].pBase, 0, MEM_RELEASE);
+    g_poolCount = 0;
 }
 
 //-------------------------------------------------------------------------
@@ -148,9 +184,11 @@ static LPVOID FindNextFreeRegion(LPVOID pAddress, LPVOID pMaxAddr, DWORD dwAlloc
 #endif
 
 //-------------------------------------------------------------------------
-static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
+// Gets the range of addresses reachable from pOrigin, with room for size
+// bytes at the end.
+static VOID GetReachableRange(
+    LPVOID pOrigin, SIZE_T size, ULONG_PTR *pMinAddr, ULONG_PTR *pMaxAddr)
 {
-    PMEMORY_BLOCK pBlock;
 #if defined(_M_X64) || defined(__x86_64__)
     ULONG_PTR minAddr;
     ULONG_PTR maxAddr;
@@ -167,24 +205,30 @@ static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
     if (maxAddr > (ULONG_PTR)pOrigin + MAX_MEMORY_RANGE)
         maxAddr = (ULONG_PTR)pOrigin + MAX_MEMORY_RANGE;
 
-    // Make room for MEMORY_BLOCK_SIZE bytes.
-    maxAddr -= MEMORY_BLOCK_SIZE - 1;
-#endif
+    // Make room for size bytes.
+    maxAddr -= size - 1;
 
-    // Look the registered blocks for a reachable one.
-    for (pBlock = g_pMemoryBlocks; pBlock != NULL; pBlock = pBlock->pNext)
-    {
-#if defined(_M_X64) || defined(__x86_64__)
-        // Ignore the blocks too far.
-        if ((ULONG_PTR)pBlock < minAddr || (ULONG_PTR)pBlock >= maxAddr)
-            continue;
+    *pMinAddr = minAddr;
+    *pMaxAddr = maxAddr;
+#else
+    UNREFERENCED_PARAMETER(pOrigin);
+    UNREFERENCED_PARAMETER(size);
+
+    *pMinAddr = 0;
+    *pMaxAddr = (ULONG_PTR)-1;
 #endif
-        // The block has at least one unused slot.
-        if (pBlock->pFree != NULL)
-            return pBlock;
-    }
+}
 
+//-------------------------------------------------------------------------
+// Allocates size bytes in [minAddr, maxAddr], as close to pOrigin as
+// possible.
+static LPVOID AllocateNear(LPVOID pOrigin, SIZE_T size, ULONG_PTR minAddr, ULONG_PTR maxAddr)
+{
+    LPVOID pResult = NULL;
 #if defined(_M_X64) || defined(__x86_64__)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+
     // Alloc a new block above if not found.
     {
         LPVOID pAlloc = pOrigin;
@@ -194,15 +238,15 @@ static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
             if (pAlloc == NULL)
                 break;
 
-            pBlock = (PMEMORY_BLOCK)VirtualAlloc(
-                pAlloc, MEMORY_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-            if (pBlock != NULL)
+            pResult = VirtualAlloc(
+                pAlloc, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+            if (pResult != NULL)
                 break;
         }
     }
 
     // Alloc a new block below if not found.
-    if (pBlock == NULL)
+    if (pResult == NULL)
     {
         LPVOID pAlloc = pOrigin;
         while ((ULONG_PTR)pAlloc <= maxAddr)
@@ -211,18 +255,73 @@ static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
             if (pAlloc == NULL)
                 break;
 
-            pBlock = (PMEMORY_BLOCK)VirtualAlloc(
-                pAlloc, MEMORY_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-            if (pBlock != NULL)
+            pResult = VirtualAlloc(
+                pAlloc, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+            if (pResult != NULL)
                 break;
         }
     }
 #else
+    UNREFERENCED_PARAMETER(pOrigin);
+    UNREFERENCED_PARAMETER(minAddr);
+    UNREFERENCED_PARAMETER(maxAddr);
+
     // In x86 mode, a memory block can be placed anywhere.
-    pBlock = (PMEMORY_BLOCK)VirtualAlloc(
-        NULL, MEMORY_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+    pResult = VirtualAlloc(
+        NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
 #endif
 
+    return pResult;
+}
+
+//-------------------------------------------------------------------------
+// Carves the next block from a pool in [minAddr, maxAddr]. Pools are
+// committed at once, so this takes no system call.
+static PMEMORY_BLOCK CarvePoolBlock(ULONG_PTR minAddr, ULONG_PTR maxAddr)
+{
+    UINT i;
+    for (i = 0; i < g_poolCount; ++i)
+    {
+        PMEMORY_POOL pPool = &g_pools[i];
+        if (pPool->pNext < pPool->pEnd
+            && (ULONG_PTR)pPool->pNext >= minAddr
+            && (ULONG_PTR)pPool->pNext < maxAddr)
+        {
+            PMEMORY_BLOCK pBlock = (PMEMORY_BLOCK)pPool->pNext;
+            pPool->pNext += MEMORY_BLOCK_SIZE;
+            return pBlock;
+        }
+    }
+
+    return NULL;
+}
+
+//-------------------------------------------------------------------------
+static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
+{
+    PMEMORY_BLOCK pBlock;
+    ULONG_PTR minAddr;
+    ULONG_PTR maxAddr;
+
+    GetReachableRange(pOrigin, MEMORY_BLOCK_SIZE, &minAddr, &maxAddr);
+
+    // Look the registered blocks for a reachable one.
+    for (pBlock = g_pMemoryBlocks; pBlock != NULL; pBlock = pBlock->pNext)
+    {
+        // Ignore the blocks too far.
+        if ((ULONG_PTR)pBlock < minAddr || (ULONG_PTR)pBlock >= maxAddr)
+            continue;
+
+        // The block has at least one unused slot.
+        if (pBlock->pFree != NULL)
+            return pBlock;
+    }
+
+    // Carve from a pool before searching for free regions.
+    pBlock = CarvePoolBlock(minAddr, maxAddr);
+    if (pBlock == NULL)
+        pBlock = (PMEMORY_BLOCK)AllocateNear(pOrigin, MEMORY_BLOCK_SIZE, minAddr, maxAddr);
+
     if (pBlock != NULL)
     {
         // Build a linked list of all the slots.
@@ -243,6 +342,63 @@ static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
     return pBlock;
 }
 
+//-------------------------------------------------------------------------
+// Modified by HTMonkeyG
+BOOL ReserveBuffer(LPVOID pOrigin, UINT count)
+{
+    // Slots in a block, the first one holds the block header.
+    const UINT slotsPerBlock = MEMORY_BLOCK_SIZE / MEMORY_SLOT_SIZE - 1;
+    PMEMORY_BLOCK pBlock;
+    PMEMORY_POOL  pPool;
+    ULONG_PTR minAddr;
+    ULONG_PTR maxAddr;
+    SIZE_T    size;
+    UINT      available = 0;
+    UINT      i;
+    SYSTEM_INFO si;
+
+    GetReachableRange(pOrigin, MEMORY_BLOCK_SIZE, &minAddr, &maxAddr);
+
+    // Count the slots already reachable, so repeated reservations don't
+    // waste regions.
+    for (pBlock = g_pMemoryBlocks; pBlock != NULL; pBlock = pBlock->pNext)
+    {
+        PMEMORY_SLOT pSlot;
+        if ((ULONG_PTR)pBlock < minAddr || (ULONG_PTR)pBlock >= maxAddr)
+            continue;
+        for (pSlot = pBlock->pFree; pSlot != NULL; pSlot = pSlot->pNext)
+            available++;
+    }
+    for (i = 0; i < g_poolCount; ++i)
+    {
+        pPool = &g_pools[i];
+        if ((ULONG_PTR)pPool->pNext >= minAddr && (ULONG_PTR)pPool->pNext < maxAddr)
+            available += (UINT)((pPool->pEnd - pPool->pNext) / MEMORY_BLOCK_SIZE) * slotsPerBlock;
+    }
+    if (available >= count)
+        return TRUE;
+
+    if (g_poolCount == MAX_MEMORY_POOLS)
+        return FALSE;
+
+    // Whole allocation granules, the rest of one would be unusable anyway.
+    GetSystemInfo(&si);
+    size = (SIZE_T)(count - available + slotsPerBlock - 1) / slotsPerBlock * MEMORY_BLOCK_SIZE;
+    size = (size + si.dwAllocationGranularity - 1) / si.dwAllocationGranularity * si.dwAllocationGranularity;
+
+    GetReachableRange(pOrigin, size, &minAddr, &maxAddr);
+    pPool = &g_pools[g_poolCount];
+    pPool->pBase = (LPBYTE)AllocateNear(pOrigin, size, minAddr, maxAddr);
+    if (pPool->pBase == NULL)
+        return FALSE;
+
+    pPool->pNext = pPool->pBase;
+    pPool->pEnd  = pPool->pBase + size;
+    g_poolCount++;
+
+    return TRUE;
+}
+
 //-------------------------------------------------------------------------
 LPVOID AllocateBuffer(LPVOID pOrigin)
 {
@@ -283,8 +439,8 @@ VOID FreeBuffer(LPVOID pBuffer)
             pBlock->pFree = pSlot;
             pBlock->usedCount--;
 
-            // Free if unused.
-            if (pBlock->usedCount == 0)
+            // Free if unused. Pool blocks are kept for later hooks.
+            if (pBlock->usedCount == 0 && !IsPoolBlock(pBlock))
             {
                 if (pPrev)
                     pPrev->pNext = pBlock->pNext;
@@ -74,10 +74,13 @@ typedef struct _HOOK_ENTRY
     UINT8  newIPs[8];           // Instruction boundaries of the trampoline function.
 } HOOK_ENTRY, *PHOOK_ENTRY;
 
-// Suspended threads for Freeze()/Unfreeze().
+// Threads for Freeze()/Unfreeze(), kept between calls.
+// Modified by HTMonkeyG
 typedef struct _FROZEN_THREADS
 {
     LPDWORD pItems;         // Data heap
+    HANDLE *pHandles;       // Opened thread handles, NULL if not accessible
+    LPBYTE  pSuspended;     // Suspended by the current Freeze()
     UINT    capacity;       // Size of allocated data heap, items
     UINT    size;           // Actual number of data items
 } FROZEN_THREADS, *PFROZEN_THREADS;
@@ -92,6 +95,9 @@ volatile LONG g_isLocked = FALSE;
 // Private heap handle. If not NULL, this library is initialized.
 HANDLE g_hHeap = NULL;
 
+// Threads of the process.
+FROZEN_THREADS g_threads;
+
 // Hook entries.
 struct
 {
@@ -260,11 +266,73 @@ static VOID ProcessThreadIPs(HANDLE hThread, UINT pos, UINT action)
 }
 
 //-------------------------------------------------------------------------
-static BOOL EnumerateThreads(PFROZEN_THREADS pThreads)
+static VOID CloseThreads(VOID)
+{
+    UINT i;
+    for (i = 0; i < g_threads.size; ++i)
+    {
+        if (g_threads.pHandles[i] != NULL)
+            CloseHandle(g_threads.pHandles[i]);
+    }
+
+    g_threads.size = 0;
+}
+
+//-------------------------------------------------------------------------
+// The three arrays share one allocation, pItems is its base.
+static BOOL GrowThreads(VOID)
+{
+    UINT   capacity = g_threads.capacity ? g_threads.capacity * 2 : INITIAL_THREAD_CAPACITY;
+    LPBYTE p = (LPBYTE)HeapAlloc(
+        g_hHeap, 0, capacity * (sizeof(DWORD) + sizeof(HANDLE) + sizeof(BYTE)));
+    if (p == NULL)
+        return FALSE;
+
+    if (g_threads.pItems != NULL)
+    {
+        memcpy(p, g_threads.pItems, g_threads.size * sizeof(DWORD));
+        memcpy(p + capacity * sizeof(DWORD), g_threads.pHandles, g_threads.size * sizeof(HANDLE));
+        memcpy(p + capacity * (sizeof(DWORD) + sizeof(HANDLE)), g_threads.pSuspended, g_threads.size);
+        HeapFree(g_hHeap, 0, g_threads.pItems);
+    }
+
+    g_threads.pItems     = (LPDWORD)p;
+    g_threads.pHandles   = (HANDLE *)(p + capacity * sizeof(DWORD));
+    g_threads.pSuspended = (LPBYTE)(g_threads.pHandles + capacity);
+    g_threads.capacity   = capacity;
+
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+static VOID FreeThreads(VOID)
 {
-    BOOL succeeded = FALSE;
+    CloseThreads();
+
+    if (g_threads.pItems != NULL)
+        HeapFree(g_hHeap, 0, g_threads.pItems);
 
-    HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    memset(&g_threads, 0, sizeof(g_threads));
+}
+
+//-------------------------------------------------------------------------
+// Enumerates the threads of the process before every freeze, so threads
+// created without attach notifications are suspended too. Handles of
+// threads seen before are kept open and reused, an open handle keeps the
+// thread id from being reused. Handles of exited threads are closed.
+// Modified by HTMonkeyG
+static BOOL EnumerateThreads(VOID)
+{
+    BOOL   succeeded = FALSE;
+    UINT   known = g_threads.size;
+    UINT   i, n;
+    HANDLE hSnapshot;
+
+    // pSuspended marks the threads found in the snapshot meanwhile.
+    for (i = 0; i < known; ++i)
+        g_threads.pSuspended[i] = FALSE;
+
+    hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
     if (hSnapshot != INVALID_HANDLE_VALUE)
     {
         THREADENTRY32 te;
@@ -275,35 +343,34 @@ static BOOL EnumerateThreads(PFROZEN_THREADS pThreads)
             do
             {
                 if (te.dwSize >= (FIELD_OFFSET(THREADENTRY32, th32OwnerProcessID) + sizeof(DWORD))
-                    && te.th32OwnerProcessID == GetCurrentProcessId()
-                    && te.th32ThreadID != GetCurrentThreadId())
+                    && te.th32OwnerProcessID == GetCurrentProcessId())
                 {
-                    if (pThreads->pItems == NULL)
+                    for (i = 0; i < known; ++i)
                     {
-                        pThreads->capacity = INITIAL_THREAD_CAPACITY;
-                        pThreads->pItems
-                            = (LPDWORD)HeapAlloc(g_hHeap, 0, pThreads->capacity * sizeof(DWORD));
-                        if (pThreads->pItems == NULL)
-                        {
-                            succeeded = FALSE;
+                        if (g_threads.pItems[i] == te.th32ThreadID)
                             break;
-                        }
                     }
-                    else if (pThreads->size >= pThreads->capacity)
+
+                    if (i < known)
+                    {
+                        g_threads.pSuspended[i] = TRUE;
+                    }
+                    else
                     {
-                        LPDWORD p;
-                        pThreads->capacity *= 2;
-                        p = (LPDWORD)HeapReAlloc(
-                            g_hHeap, 0, pThreads->pItems, pThreads->capacity * sizeof(DWORD));
-                        if (p == NULL)
+                        if (g_threads.size >= g_threads.capacity && !GrowThreads())
                         {
                             succeeded = FALSE;
                             break;
                         }
 
-                        pThreads->pItems = p;
+                        // The calling thread is kept too, since the list is
+                        // shared by all threads calling MinHook.
+                        g_threads.pItems[g_threads.size] = te.th32ThreadID;
+                        g_threads.pHandles[g_threads.size]
+                            = OpenThread(THREAD_ACCESS, FALSE, te.th32ThreadID);
+                        g_threads.pSuspended[g_threads.size] = TRUE;
+                        g_threads.size++;
                     }
-                    pThreads->pItems[pThreads->size++] = te.th32ThreadID;
                 }
 
                 te.dwSize = sizeof(THREADENTRY32);
@@ -311,82 +378,142 @@ static BOOL EnumerateThreads(PFROZEN_THREADS pThreads)
 
             if (succeeded && GetLastError() != ERROR_NO_MORE_FILES)
                 succeeded = FALSE;
-
-            if (!succeeded && pThreads->pItems != NULL)
-            {
-                HeapFree(g_hHeap, 0, pThreads->pItems);
-                pThreads->pItems = NULL;
-            }
         }
         CloseHandle(hSnapshot);
     }
 
-    return succeeded;
+    if (!succeeded)
+    {
+        CloseThreads();
+        return FALSE;
+    }
+
+    // Drops the threads that have exited.
+    for (i = 0, n = 0; i < g_threads.size; ++i)
+    {
+        if (!g_threads.pSuspended[i])
+        {
+            if (g_threads.pHandles[i] != NULL)
+                CloseHandle(g_threads.pHandles[i]);
+            continue;
+        }
+
+        g_threads.pItems[n]     = g_threads.pItems[i];
+        g_threads.pHandles[n]   = g_threads.pHandles[i];
+        g_threads.pSuspended[n] = FALSE;
+        n++;
+    }
+    g_threads.size = n;
+
+    return TRUE;
 }
 
 //-------------------------------------------------------------------------
-static MH_STATUS Freeze(PFROZEN_THREADS pThreads, UINT pos, UINT action)
+static MH_STATUS Freeze(UINT pos, UINT action)
 {
-    MH_STATUS status = MH_OK;
+    DWORD threadId = GetCurrentThreadId();
+    UINT  i;
+
+    if (!EnumerateThreads())
+        return MH_ERROR_MEMORY_ALLOC;
 
-    pThreads->pItems   = NULL;
-    pThreads->capacity = 0;
-    pThreads->size     = 0;
-    if (!EnumerateThreads(pThreads))
+    for (i = 0; i < g_threads.size; ++i)
     {
-        status = MH_ERROR_MEMORY_ALLOC;
+        HANDLE hThread = g_threads.pHandles[i];
+
+        g_threads.pSuspended[i] = FALSE;
+        if (hThread == NULL || g_threads.pItems[i] == threadId)
+            continue;
+
+        if (SuspendThread(hThread) != 0xFFFFFFFF)
+        {
+            // Only threads stopped inside the patched bytes are moved.
+            g_threads.pSuspended[i] = TRUE;
+            ProcessThreadIPs(hThread, pos, action);
+        }
     }
-    else if (pThreads->pItems != NULL)
+
+    return MH_OK;
+}
+
+//-------------------------------------------------------------------------
+static VOID Unfreeze(VOID)
+{
+    UINT i;
+    for (i = 0; i < g_threads.size; ++i)
     {
-        UINT i;
-        for (i = 0; i < pThreads->size; ++i)
-        {
-            HANDLE hThread = OpenThread(THREAD_ACCESS, FALSE, pThreads->pItems[i]);
-            BOOL suspended = FALSE;
-            if (hThread != NULL)
-            {
-                DWORD result = SuspendThread(hThread);
-                if (result != 0xFFFFFFFF)
-                {
-                    suspended = TRUE;
-                    ProcessThreadIPs(hThread, pos, action);
-                }
-                CloseHandle(hThread);
-            }
+        if (g_threads.pSuspended[i])
+            ResumeThread(g_threads.pHandles[i]);
+    }
+}
 
-            if (!suspended)
-            {
-                // Mark thread as not suspended, so it's not resumed later on.
-                pThreads->pItems[i] = 0;
-            }
+//-------------------------------------------------------------------------
+// Checks if the jump of the hook can be written with one atomic store, so
+// no thread has to be suspended. The patched bytes must be inside an 8-byte
+// aligned block, and when enabling, no instruction may start inside them,
+// as a thread could be stopped there.
+// Modified by HTMonkeyG
+static BOOL IsAtomicPatch(PHOOK_ENTRY pHook, BOOL enable)
+{
+    UINT i;
+
+    if (pHook->patchAbove
+        || ((ULONG_PTR)pHook->pTarget & 7) > sizeof(UINT64) - sizeof(JMP_REL))
+        return FALSE;
+
+    if (enable)
+    {
+        for (i = 0; i < pHook->nIP; ++i)
+        {
+            if (pHook->oldIPs[i] > 0 && pHook->oldIPs[i] < sizeof(JMP_REL))
+                return FALSE;
         }
     }
 
-    return status;
+    return TRUE;
 }
 
 //-------------------------------------------------------------------------
-static VOID Unfreeze(PFROZEN_THREADS pThreads)
+// Checks if a freeze is needed to apply the hooks. ALL_HOOKS_POS checks the
+// hooks changed by the action.
+static BOOL NeedsFreeze(UINT pos, UINT action)
 {
-    if (pThreads->pItems != NULL)
+    UINT count;
+
+    if (pos == ALL_HOOKS_POS)
+    {
+        pos = 0;
+        count = g_hooks.size;
+    }
+    else
     {
-        UINT i;
-        for (i = 0; i < pThreads->size; ++i)
+        count = pos + 1;
+    }
+
+    for (; pos < count; ++pos)
+    {
+        PHOOK_ENTRY pHook = &g_hooks.pItems[pos];
+        BOOL enable;
+
+        switch (action)
         {
-            DWORD threadId = pThreads->pItems[i];
-            if (threadId != 0)
-            {
-                HANDLE hThread = OpenThread(THREAD_ACCESS, FALSE, threadId);
-                if (hThread != NULL)
-                {
-                    ResumeThread(hThread);
-                    CloseHandle(hThread);
-                }
-            }
-        }
+        case ACTION_DISABLE:
+            enable = FALSE;
+            break;
+
+        case ACTION_ENABLE:
+            enable = TRUE;
+            break;
 
-        HeapFree(g_hHeap, 0, pThreads->pItems);
+        default: // ACTION_APPLY_QUEUED
+            enable = pHook->queueEnable;
+            break;
+        }
+        if (pHook->isEnabled != enable && !IsAtomicPatch(pHook, enable))
+            return TRUE;
     }
+
+    return FALSE;
 }
 
 //-------------------------------------------------------------------------
@@ -409,9 +536,29 @@ static MH_STATUS EnableHookLL(UINT pos, BOOL enable)
     hProcess = OpenProcess(PROCESS_ALL_ACCESS, FALSE, GetCurrentProcessId());
 
     if (!VirtualProtectEx(hProcess, pPatchTarget, patchSize, PAGE_EXECUTE_READWRITE, &oldProtect))
+    {
+        CloseHandle(hProcess);
         return MH_ERROR_MEMORY_PROTECT;
+    }
 
-    if (enable)
+    if (IsAtomicPatch(pHook, enable))
+    {
+        // Running threads see either the old or the new bytes.
+        volatile LONG64 *pBlock = (volatile LONG64 *)((ULONG_PTR)pPatchTarget & ~(ULONG_PTR)7);
+        UINT   offset = (UINT)((ULONG_PTR)pPatchTarget & 7);
+        LONG64 oldBlock, newBlock;
+        JMP_REL jmp;
+
+        jmp.opcode = 0xE9;
+        jmp.operand = (UINT32)((LPBYTE)pHook->pDetour - (pPatchTarget + sizeof(JMP_REL)));
+        do
+        {
+            oldBlock = *pBlock;
+            newBlock = oldBlock;
+            memcpy((LPBYTE)&newBlock + offset, enable ? (LPVOID)&jmp : pHook->backup, sizeof(JMP_REL));
+        } while (InterlockedCompareExchange64(pBlock, newBlock, oldBlock) != oldBlock);
+    }
+    else if (enable)
     {
         PJMP_REL pJmp = (PJMP_REL)pPatchTarget;
         pJmp->opcode = 0xE9;
@@ -433,6 +580,7 @@ static MH_STATUS EnableHookLL(UINT pos, BOOL enable)
     }
 
     VirtualProtectEx(hProcess, pPatchTarget, patchSize, oldProtect, &oldProtect);
+    CloseHandle(hProcess);
 
     // Just-in-case measure.
     FlushInstructionCache(GetCurrentProcess(), pPatchTarget, patchSize);
@@ -460,8 +608,10 @@ static MH_STATUS EnableAllHooksLL(BOOL enable)
 
     if (first != INVALID_HOOK_POS)
     {
-        FROZEN_THREADS threads;
-        status = Freeze(&threads, ALL_HOOKS_POS, enable ? ACTION_ENABLE : ACTION_DISABLE);
+        UINT action = enable ? ACTION_ENABLE : ACTION_DISABLE;
+        BOOL freeze = NeedsFreeze(ALL_HOOKS_POS, action);
+        if (freeze)
+            status = Freeze(ALL_HOOKS_POS, action);
         if (status == MH_OK)
         {
             for (i = first; i < g_hooks.size; ++i)
@@ -474,7 +624,8 @@ static MH_STATUS EnableAllHooksLL(BOOL enable)
                 }
             }
 
-            Unfreeze(&threads);
+            if (freeze)
+                Unfreeze();
         }
     }
 
@@ -559,6 +710,7 @@ MH_STATUS WINAPI MH_Uninitialize(VOID)
             // memory leak without HeapFree.
 
             UninitializeBuffer();
+            FreeThreads();
 
             HeapFree(g_hHeap, 0, g_hooks.pItems);
             HeapDestroy(g_hHeap);
@@ -692,13 +844,15 @@ MH_STATUS WINAPI MH_RemoveHook(LPVOID pTarget)
         {
             if (g_hooks.pItems[pos].isEnabled)
             {
-                FROZEN_THREADS threads;
-                status = Freeze(&threads, pos, ACTION_DISABLE);
+                BOOL freeze = NeedsFreeze(pos, ACTION_DISABLE);
+                if (freeze)
+                    status = Freeze(pos, ACTION_DISABLE);
                 if (status == MH_OK)
                 {
                     status = EnableHookLL(pos, FALSE);
 
-                    Unfreeze(&threads);
+                    if (freeze)
+                        Unfreeze();
                 }
             }
 
@@ -743,13 +897,16 @@ static MH_STATUS EnableHook(LPVOID pTarget, BOOL enable)
             {
                 if (g_hooks.pItems[pos].isEnabled != enable)
                 {
-                    FROZEN_THREADS threads;
-                    status = Freeze(&threads, pos, ACTION_ENABLE);
+                    UINT action = enable ? ACTION_ENABLE : ACTION_DISABLE;
+                    BOOL freeze = NeedsFreeze(pos, action);
+                    if (freeze)
+                        status = Freeze(pos, action);
                     if (status == MH_OK)
                     {
                         status = EnableHookLL(pos, enable);
 
-                        Unfreeze(&threads);
+                        if (freeze)
+                            Unfreeze();
                     }
                 }
                 else
@@ -856,8 +1013,9 @@ MH_STATUS WINAPI MH_ApplyQueued(VOID)
 
         if (first != INVALID_HOOK_POS)
         {
-            FROZEN_THREADS threads;
-            status = Freeze(&threads, ALL_HOOKS_POS, ACTION_APPLY_QUEUED);
+            BOOL freeze = NeedsFreeze(ALL_HOOKS_POS, ACTION_APPLY_QUEUED);
+            if (freeze)
+                status = Freeze(ALL_HOOKS_POS, ACTION_APPLY_QUEUED);
             if (status == MH_OK)
             {
                 for (i = first; i < g_hooks.size; ++i)
@@ -871,7 +1029,8 @@ MH_STATUS WINAPI MH_ApplyQueued(VOID)
                     }
                 }
 
-                Unfreeze(&threads);
+                if (freeze)
+                    Unfreeze();
             }
         }
     }
@@ -885,6 +1044,28 @@ MH_STATUS WINAPI MH_ApplyQueued(VOID)
     return status;
 }
 
+//-------------------------------------------------------------------------
+MH_STATUS WINAPI MH_ReserveBuffer(LPVOID pOrigin, UINT count)
+{
+    MH_STATUS status = MH_OK;
+
+    EnterSpinLock();
+
+    if (g_hHeap != NULL)
+    {
+        if (!ReserveBuffer(pOrigin, count))
+            status = MH_ERROR_MEMORY_ALLOC;
+    }
+    else
+    {
+        status = MH_ERROR_NOT_INITIALIZED;
+    }
+
+    LeaveSpinLock();
+
+    return status;
+}
+
 //-------------------------------------------------------------------------
 MH_STATUS WINAPI MH_CreateHookApiEx(
     LPCWSTR pszModule, LPCSTR pszProcName, LPVOID pDetour,
@@ -1,58 +1,976 @@
 // ----------------------------------------------------------------------------
-// Inline hook APIs of HT's Mod Loader.
+// Hook APIs of HT's Mod Loader.
+//
+// Each target function is hooked with MinHook only once. Its detour is a
+// generated thunk that jumps to the first enabled mod detour, and the origin
+// handed to every mod is another thunk that jumps to the next enabled detour,
+// or to the trampoline at the end of the chain. Jump targets are stored in
+// aligned slots apart from the code, so a chain is relinked with atomic
+// stores while other threads are running through it.
+//
+// Mid-function hooks are links whose detour is a generated stub calling the
+// mod callback with the register context.
+//
+// Vtable and IAT hooks use the same chains, with the pointer slot itself in
+// place of the entry thunk, and the original function in place of the
+// trampoline.
 // ----------------------------------------------------------------------------
+#include <windows.h>
+#include <stdlib.h>
 #include <vector>
-#include <unordered_map>
 #include <mutex>
+#include <new>
 #include "MinHook.h"
 
 #include "htmodloader.h"
+#include "api/hookprof.h"
+#include "api/midhook.h"
+#include "api/scanmodule.h"
 
+// ----------------------------------------------------------------------------
+// [SECTION] Thunks.
+// ----------------------------------------------------------------------------
+
+// Size of a thunk page, the slot page follows it.
+#define THUNK_PAGE_SIZE 0x1000
+#define THUNK_SIZE 16
+#define THUNK_PER_PAGE (THUNK_PAGE_SIZE / THUNK_SIZE)
+
+// A `jmp [rip + disp32]` into its own slot.
+struct Thunk {
+  u08 *code;
+  void *volatile *slot;
+};
+
+// Current thunk page, thunks are never freed since a thread may still be
+// running through them.
+static u08 *gThunkPage = nullptr;
+static u32 gThunkNext = THUNK_PER_PAGE;
+
+/**
+ * Allocate a thunk jumping to `target`, the lock must be held.
+ */
+static bool allocThunk(void *target, Thunk *thunk) {
+  u08 *page, *code;
+  DWORD protect;
+  i32 disp;
+
+  if (gThunkNext == THUNK_PER_PAGE) {
+    // Code of all thunks is written once, then only the slots are changed.
+    page = (u08 *)VirtualAlloc(
+      nullptr,
+      THUNK_PAGE_SIZE * 2,
+      MEM_COMMIT | MEM_RESERVE,
+      PAGE_READWRITE);
+    if (!page)
+      return false;
+
+    for (u32 i = 0; i < THUNK_PER_PAGE; i++) {
+      code = page + i * THUNK_SIZE;
+      disp = (i32)(THUNK_PAGE_SIZE + i * sizeof(void *) - (i * THUNK_SIZE + 6));
+      code[0] = 0xFF;
+      code[1] = 0x25;
+      memcpy(code + 2, &disp, sizeof(disp));
+      memset(code + 6, 0xCC, THUNK_SIZE - 6);
+    }
+
+    if (!VirtualProtect(page, THUNK_PAGE_SIZE, PAGE_EXECUTE_READ, &protect)) {
+      VirtualFree(page, 0, MEM_RELEASE);
+      return false;
+    }
+    FlushInstructionCache(GetCurrentProcess(), page, THUNK_PAGE_SIZE);
+
+    gThunkPage = page;
+    gThunkNext = 0;
+  }
+
+  thunk->code = gThunkPage + gThunkNext * THUNK_SIZE;
+  thunk->slot = (void *volatile *)(gThunkPage + THUNK_PAGE_SIZE) + gThunkNext;
+  gThunkNext++;
+  InterlockedExchangePointer((PVOID volatile *)thunk->slot, target);
+
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Hook registry.
+// ----------------------------------------------------------------------------
+
+// Initial capacity of the target table.
+#define HOOK_TABLE_MIN 64
+
+// A mod detour in the chain of a target.
+struct HookLink {
+  void *detour;
+  // Module containing the detour.
+  HMODULE owner;
+  i32 priority;
+  volatile LONG enabled;
+  // Returned as the origin of the detour.
+  Thunk origin;
+  // Whether the detour is entered by a call and may be profiled.
+  bool profiled;
+  // Profiling wrapper of the detour, taken the first time profiling is
+  // enabled. NULL until then, or if there's no room for it.
+  void *wrapper;
+};
+
+// Links of a target in calling order, by descending priority, then by
+// install order. Immutable once published, installs publish a new copy.
+struct HookLinks {
+  u32 count;
+  HookLink *items[1];
+};
+
+// A hooked function.
+struct HookTarget {
+  void *fn;
+  void *trampoline;
+  // Detour of the MinHook hook. For vtable and IAT hooks, `code` is NULL and
+  // `slot` is the hooked pointer.
+  Thunk entry;
+  // Whether the function is patched. Never reset, as disabled chains jump to
+  // the trampoline directly, so toggling links never patches code again.
+  // Always set for vtable and IAT hooks, their slots are written on
+  // relinking.
+  volatile LONG patched;
+  // Protection of the page of a vtable or IAT slot, restored after every
+  // write. 0 if the page is writable already.
+  DWORD protect;
+  // Bumped on every change of the links, relinking is retried until no
+  // change is made during it.
+  volatile LONG version;
+  HookLinks *volatile links;
+};
+
+// Open addressing table of targets, read without locks. Replaced by a larger
+// copy when it's full, and slots are only filled once.
+struct HookTable {
+  u32 capacity;
+  u32 count;
+  HookTarget *volatile slots[1];
+};
+
+// A hook queued to be enabled or disabled.
+struct HookQueued {
+  void *fn;
+  // Selects the link with this detour, or NULL to select the links owned by
+  // `caller`.
+  void *detour;
+  HMODULE caller;
+  bool enable;
+  HTStatus *status;
+};
+
+struct HTHookTransaction {
+  std::vector<HookQueued> queue;
+};
+
+// A link toggled by applyQueued(), and its state before.
+struct HookToggle {
+  HookLink *link;
+  LONG enabled;
+};
+
+// Changes of a target in applyQueued().
+struct HookChange {
+  HookTarget *target;
+  HookLinks *links;
+  // Links actually toggled by the queue, undone on failure.
+  std::vector<HookToggle> toggled;
+  MH_STATUS status;
+};
+
+// Serializes installs and code patching only. Lookups and toggling links of
+// patched functions are lock-free.
 static std::mutex gMutex;
+static HookTable *volatile gTable = nullptr;
+// Serializes protection changes of the pages of hooked pointer slots, since
+// several slots may share a page.
+static SRWLOCK gSlotLock = SRWLOCK_INIT;
+
+/**
+ * Get the module containing the address.
+ */
+static HMODULE moduleOf(const void *address) {
+  HMODULE module;
+
+  if (
+    !GetModuleHandleExA(
+      GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS
+      | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+      (LPCSTR)address,
+      &module)
+  )
+    return nullptr;
+
+  return module;
+}
+
+static u32 hashAddress(const void *fn) {
+  u64 x = (u64)fn;
+
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCDULL;
+  x ^= x >> 33;
+  return (u32)x;
+}
+
+static HookTarget *findTarget(void *fn) {
+  HookTable *table = gTable;
+  HookTarget *target;
+  u32 i;
+
+  if (!table)
+    return nullptr;
+
+  i = hashAddress(fn) & (table->capacity - 1);
+  while ((target = table->slots[i])) {
+    if (target->fn == fn)
+      return target;
+    i = (i + 1) & (table->capacity - 1);
+  }
+
+  return nullptr;
+}
+
+static HookTable *allocTable(u32 capacity) {
+  HookTable *table;
+
+  table = (HookTable *)calloc(
+    1,
+    sizeof(HookTable) + (capacity - 1) * sizeof(HookTarget *));
+  if (table)
+    table->capacity = capacity;
+
+  return table;
+}
+
+static void putTarget(HookTable *table, HookTarget *target) {
+  u32 i = hashAddress(target->fn) & (table->capacity - 1);
+
+  while (table->slots[i])
+    i = (i + 1) & (table->capacity - 1);
+  InterlockedExchangePointer((PVOID volatile *)&table->slots[i], target);
+  table->count++;
+}
+
+/**
+ * Add a target to the table, the lock must be held. Readers either see the
+ * old table or the complete new one. Replaced tables are kept, since a
+ * reader may still be probing them.
+ */
+static bool insertTarget(HookTarget *target) {
+  HookTable *table = gTable, *grown;
+
+  if (!table || (table->count + 1) * 4 > table->capacity * 3) {
+    grown = allocTable(table ? table->capacity * 2 : HOOK_TABLE_MIN);
+    if (!grown)
+      return false;
+    if (table)
+      for (u32 i = 0; i < table->capacity; i++)
+        if (table->slots[i])
+          putTarget(grown, table->slots[i]);
+    InterlockedExchangePointer((PVOID volatile *)&gTable, grown);
+    table = grown;
+  }
+
+  putTarget(table, target);
+
+  return true;
+}
+
+/**
+ * Store a function pointer into the slot of a vtable or IAT hook. A page
+ * that isn't writable is only made writable during the store, keeping its
+ * execute bit, as it may contain code too.
+ */
+static void writeSlot(HookTarget *target, void *value) {
+  void *volatile *slot = target->entry.slot;
+  DWORD writable, old;
+
+  if (!target->protect) {
+    InterlockedExchangePointer((PVOID volatile *)slot, value);
+    return;
+  }
+
+  writable = target->protect & (
+    PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE
+    | PAGE_EXECUTE_WRITECOPY)
+    ? PAGE_EXECUTE_READWRITE
+    : PAGE_READWRITE;
+
+  AcquireSRWLockExclusive(&gSlotLock);
+  if (
+    *slot != value
+    && VirtualProtect((void *)slot, sizeof(void *), writable, &old)
+  ) {
+    InterlockedExchangePointer((PVOID volatile *)slot, value);
+    VirtualProtect((void *)slot, sizeof(void *), target->protect, &old);
+  }
+  ReleaseSRWLockExclusive(&gSlotLock);
+}
+
+static bool anyEnabled(const HookTarget *target) {
+  HookLinks *links = target->links;
+
+  for (u32 i = 0; i < links->count; i++)
+    if (links->items[i]->enabled)
+      return true;
+
+  return false;
+}
+
+/**
+ * Point every thunk of the chain to its next enabled detour. The tail is
+ * updated first, so threads entering the chain never see a half-built one.
+ * Can be called from any thread, a pass that raced with a change is redone.
+ */
+static void relink(HookTarget *target) {
+  HookLinks *links;
+  HookLink *link;
+  LONG version;
+  void *next;
+  bool profiling;
+
+  do {
+    version = target->version;
+    links = target->links;
+    profiling = hookProfIsEnabled();
+    next = target->trampoline;
+
+    for (u32 i = links->count; i-- > 0;) {
+      link = links->items[i];
+      // Disabled links still forward, a thread may be inside their detours.
+      InterlockedExchangePointer((PVOID volatile *)link->origin.slot, next);
+      if (link->enabled)
+        next = profiling && link->wrapper ? link->wrapper : link->detour;
+    }
+    if (target->entry.code)
+      InterlockedExchangePointer((PVOID volatile *)target->entry.slot, next);
+    else
+      writeSlot(target, next);
+  } while (InterlockedOr(&target->version, 0) != version);
+}
+
+/**
+ * Mark the target as changed, then relink it.
+ */
+static void touchTarget(HookTarget *target) {
+  InterlockedIncrement(&target->version);
+  relink(target);
+}
+
+/**
+ * Get the target of an inline hook on `fn`, the lock must be held.
+ */
+static HookTarget *inlineTarget(void *fn) {
+  HookTarget *target = findTarget(fn);
+
+  if (target)
+    return target->entry.code ? target : nullptr;
+
+  target = new (std::nothrow) HookTarget();
+  if (!target)
+    return nullptr;
+  target->fn = fn;
+  target->links = (HookLinks *)calloc(1, sizeof(HookLinks));
+  if (
+    !target->links
+    || !allocThunk(nullptr, &target->entry)
+    || MH_CreateHook(fn, target->entry.code, &target->trampoline) != MH_OK
+  ) {
+    free(target->links);
+    delete target;
+    return nullptr;
+  }
+  InterlockedExchangePointer(
+    (PVOID volatile *)target->entry.slot,
+    target->trampoline);
+  if (!insertTarget(target)) {
+    MH_RemoveHook(fn);
+    free(target->links);
+    delete target;
+    return nullptr;
+  }
+
+  return target;
+}
+
+/**
+ * Get the target of a hook on a function pointer slot, i.e. a vtable or IAT
+ * entry, the lock must be held. The protection of the page is kept, and
+ * only changed while the slot is written.
+ */
+static HookTarget *slotTarget(void **slot) {
+  HookTarget *target = findTarget(slot);
+  MEMORY_BASIC_INFORMATION mbi;
+  SIZE_T queried;
+
+  if (target)
+    return target->entry.code ? nullptr : target;
+
+  if ((u64)slot & (sizeof(void *) - 1))
+    return nullptr;
+  // Another slot on the page may be in the middle of a write.
+  AcquireSRWLockShared(&gSlotLock);
+  queried = VirtualQuery(slot, &mbi, sizeof(mbi));
+  ReleaseSRWLockShared(&gSlotLock);
+  if (
+    !queried
+    || mbi.State != MEM_COMMIT
+    || (mbi.Protect & (PAGE_GUARD | PAGE_NOACCESS))
+    || !*slot
+  )
+    return nullptr;
+
+  target = new (std::nothrow) HookTarget();
+  if (!target)
+    return nullptr;
+  target->fn = slot;
+  target->trampoline = *slot;
+  target->entry.slot = (void *volatile *)slot;
+  target->patched = 1;
+  target->protect = mbi.Protect & (
+    PAGE_READWRITE | PAGE_EXECUTE_READWRITE
+    | PAGE_WRITECOPY | PAGE_EXECUTE_WRITECOPY)
+    ? 0
+    : mbi.Protect;
+  target->links = (HookLinks *)calloc(1, sizeof(HookLinks));
+  if (!target->links || !insertTarget(target)) {
+    free(target->links);
+    delete target;
+    return nullptr;
+  }
+
+  return target;
+}
+
+/**
+ * Add a detour to the chain of the target, the lock must be held. `owner`
+ * selects the link for the enable and disable APIs. Detours that aren't
+ * entered by a call, i.e. mid-function hook stubs, must not be profiled.
+ */
+static HTStatus installLink(
+  HookTarget *target,
+  void *detour,
+  HMODULE owner,
+  i32 priority,
+  bool profiled,
+  void **origin
+) {
+  HookLinks *links, *old;
+  HookLink *link;
+  u32 pos;
+
+  old = target->links;
+  for (u32 i = 0; i < old->count; i++)
+    if (old->items[i]->detour == detour)
+      return HT_FAIL;
+
+  link = new (std::nothrow) HookLink();
+  links = (HookLinks *)malloc(
+    sizeof(HookLinks) + old->count * sizeof(HookLink *));
+  if (!link || !links || !allocThunk(target->trampoline, &link->origin)) {
+    delete link;
+    free(links);
+    return HT_FAIL;
+  }
+  link->detour = detour;
+  link->owner = owner;
+  link->priority = priority;
+  link->profiled = profiled;
+  link->wrapper = profiled && hookProfIsEnabled()
+    ? hookProfRegister(target->fn, detour, owner)
+    : nullptr;
+
+  // Behind all links of higher or equal priority.
+  for (pos = 0; pos < old->count; pos++)
+    if (old->items[pos]->priority < priority)
+      break;
+  links->count = old->count + 1;
+  memcpy(links->items, old->items, pos * sizeof(HookLink *));
+  links->items[pos] = link;
+  memcpy(
+    links->items + pos + 1,
+    old->items + pos,
+    (old->count - pos) * sizeof(HookLink *));
+
+  // The old copy is kept, a lock-free reader may still walk it.
+  InterlockedExchangePointer((PVOID volatile *)&target->links, links);
+  touchTarget(target);
+
+  *origin = link->origin.code;
+
+  return HT_SUCCESS;
+}
+
+/**
+ * Set the state of a selected link, and record it if it's changed.
+ */
+static void toggleLink(
+  HookLink *link,
+  bool enable,
+  std::vector<HookToggle> &toggled
+) {
+  LONG old = InterlockedExchange(&link->enabled, enable);
+
+  if (old != (LONG)enable)
+    toggled.push_back({link, old});
+}
+
+/**
+ * Set the state of the links selected by the queued hook. Returns false if
+ * no link is selected.
+ */
+static bool selectLinks(
+  HookLinks *links,
+  const HookQueued &queued,
+  std::vector<HookToggle> &toggled
+) {
+  bool selected = false;
+  HookLink *link;
+
+  for (u32 i = 0; i < links->count; i++) {
+    link = links->items[i];
+    if (
+      queued.detour
+        ? link->detour == queued.detour
+        : link->owner == queued.caller
+    ) {
+      toggleLink(link, queued.enable, toggled);
+      selected = true;
+    }
+  }
+
+  if (!selected && !queued.detour)
+    // The caller owns no detour of the target, so detours in generated code
+    // owned by no module are selected. Links of other mods are never
+    // touched.
+    for (u32 i = 0; i < links->count; i++) {
+      link = links->items[i];
+      if (link->owner)
+        continue;
+      toggleLink(link, queued.enable, toggled);
+      selected = true;
+    }
+
+  return selected;
+}
+
+/**
+ * Patch the changed targets that have enabled links but aren't patched yet,
+ * with one thread freeze.
+ */
+static void patchTargets(std::vector<HookChange> &changes) {
+  std::lock_guard<std::mutex> lock(gMutex);
+  std::vector<bool> queued(changes.size(), false);
+  MH_STATUS status;
+
+  // MinHook only keeps the queue state on hook entries, so it's only filled
+  // while the lock is held.
+  for (size_t i = 0; i < changes.size(); i++)
+    if (!changes[i].target->patched && anyEnabled(changes[i].target)) {
+      changes[i].status = MH_QueueEnableHook(changes[i].target->fn);
+      queued[i] = changes[i].status == MH_OK;
+    }
+
+  status = MH_ApplyQueued();
+
+  for (size_t i = 0; i < changes.size(); i++) {
+    if (!queued[i])
+      continue;
+    if (status != MH_OK) {
+      // Stopped at a failed hook, the rest are applied one by one so every
+      // hook gets its own status and no queue state is left behind.
+      changes[i].status = MH_EnableHook(changes[i].target->fn);
+      if (changes[i].status == MH_ERROR_ENABLED)
+        changes[i].status = MH_OK;
+    }
+    if (changes[i].status == MH_OK)
+      InterlockedExchange(&changes[i].target->patched, 1);
+  }
+}
+
+/**
+ * Apply the queued hooks. Links are toggled without locks, only functions
+ * not patched yet are patched together under one thread freeze.
+ */
+static HTStatus applyQueued(
+  const std::vector<HookQueued> &queue
+) {
+  HTStatus result = HT_SUCCESS;
+  std::vector<HookChange> changes;
+  std::vector<i32> index(queue.size(), -1);
+  HookTarget *target;
+  bool patch = false;
+  size_t c;
+
+  // Update the links, and record the toggled ones to roll back on failure.
+  for (size_t i = 0; i < queue.size(); i++) {
+    target = findTarget(queue[i].fn);
+    if (!target)
+      continue;
+    for (c = 0; c < changes.size(); c++)
+      if (changes[c].target == target)
+        break;
+    if (c == changes.size())
+      changes.push_back({target, target->links, {}, MH_OK});
+    if (selectLinks(changes[c].links, queue[i], changes[c].toggled))
+      index[i] = (i32)c;
+  }
+
+  // Chains are relinked before their functions are patched.
+  for (auto &change: changes) {
+    touchTarget(change.target);
+    if (!change.target->patched && anyEnabled(change.target))
+      patch = true;
+  }
+
+  if (patch) {
+    patchTargets(changes);
+    for (auto &change: changes) {
+      if (change.status == MH_OK)
+        continue;
+      // Undone in reverse order, and only if no other thread toggled the
+      // link since.
+      for (size_t k = change.toggled.size(); k-- > 0;)
+        InterlockedCompareExchange(
+          &change.toggled[k].link->enabled,
+          change.toggled[k].enabled,
+          !change.toggled[k].enabled);
+      touchTarget(change.target);
+    }
+  }
+
+  for (size_t i = 0; i < queue.size(); i++) {
+    if (index[i] < 0 || changes[index[i]].status != MH_OK)
+      result = HT_FAIL;
+    if (queue[i].status)
+      *queue[i].status = index[i] >= 0 && changes[index[i]].status == MH_OK
+        ? HT_SUCCESS
+        : HT_FAIL;
+  }
+
+  return result;
+}
+
+/**
+ * Enable or disable the hooks of a single function.
+ */
+static HTStatus applyOne(
+  void *fn,
+  void *detour,
+  HMODULE caller,
+  bool enable
+) {
+  try {
+    return applyQueued({{fn, detour, caller, enable, nullptr}});
+  } catch (...) {
+    return HT_FAIL;
+  }
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Hook APIs.
+// ----------------------------------------------------------------------------
 
 HTMLAPI HTStatus HTInstallHook(
   void *fn,
   void *detour,
   void **origin
+) {
+  return HTInstallHookPriority(fn, detour, origin, 0);
+}
+
+HTMLAPI HTStatus HTInstallHookPriority(
+  void *fn,
+  void *detour,
+  void **origin,
+  i32 priority
+) {
+  std::lock_guard<std::mutex> lock(gMutex);
+  HookTarget *target;
+
+  if (!fn || !detour || !origin)
+    return HT_FAIL;
+
+  try {
+    target = inlineTarget(fn);
+    if (!target)
+      return HT_FAIL;
+    return installLink(
+      target, detour, moduleOf(detour), priority, true, origin);
+  } catch (...) {
+    return HT_FAIL;
+  }
+}
+
+HTMLAPI HTStatus HTInstallVtableHook(
+  void **vtable,
+  u32 index,
+  void *detour,
+  void **origin
 ) {
   std::lock_guard<std::mutex> lock(gMutex);
-  if (MH_CreateHook(fn, detour, origin) == MH_OK)
-    return HT_SUCCESS;
-  return HT_FAIL;
+  HookTarget *target;
+
+  if (!vtable || !detour || !origin)
+    return HT_FAIL;
+
+  try {
+    target = slotTarget(vtable + index);
+    if (!target)
+      return HT_FAIL;
+    return installLink(
+      target, detour, moduleOf(detour), 0, true, origin);
+  } catch (...) {
+    return HT_FAIL;
+  }
+}
+
+HTMLAPI void **HTFindIatEntry(
+  HMODULE module,
+  const char *dll,
+  const char *symbol
+) {
+  return scanModuleFindImport(scanModuleGet(module), dll, symbol);
+}
+
+HTMLAPI HTStatus HTInstallIatHook(
+  HMODULE module,
+  const char *dll,
+  const char *symbol,
+  void *detour,
+  void **origin
+) {
+  void **entry = HTFindIatEntry(module, dll, symbol);
+  std::lock_guard<std::mutex> lock(gMutex);
+  HookTarget *target;
+
+  if (!entry || !detour || !origin)
+    return HT_FAIL;
+
+  try {
+    target = slotTarget(entry);
+    if (!target)
+      return HT_FAIL;
+    return installLink(
+      target, detour, moduleOf(detour), 0, true, origin);
+  } catch (...) {
+    return HT_FAIL;
+  }
+}
+
+HTMLAPI HTStatus HTInstallMidHook(
+  void *address,
+  PFN_HTMidHookCallback callback,
+  void *user
+) {
+  std::lock_guard<std::mutex> lock(gMutex);
+  HookTarget *target;
+  void *volatile *next;
+  void *stub = nullptr, *origin;
+
+  if (!address || !callback)
+    return HT_FAIL;
+
+  try {
+    target = inlineTarget(address);
+    if (!target)
+      return HT_FAIL;
+    stub = midHookCreate(callback, user, &next);
+    if (!stub)
+      return HT_FAIL;
+    if (
+      !installLink(
+        target, stub, moduleOf((void *)callback), 0, false, &origin)
+    ) {
+      midHookFree(stub);
+      return HT_FAIL;
+    }
+    // The link is disabled until enabled, so the stub isn't entered yet.
+    InterlockedExchangePointer((PVOID volatile *)next, origin);
+  } catch (...) {
+    // The stub isn't linked if installLink() threw.
+    midHookFree(stub);
+    return HT_FAIL;
+  }
+
+  return HT_SUCCESS;
 }
 
 HTMLAPI HTStatus HTEnableHook(
   void *fn
 ) {
-  std::lock_guard<std::mutex> lock(gMutex);
-  if (MH_EnableHook(fn) == MH_OK)
-    return HT_SUCCESS;
-  return HT_FAIL;
+  return applyOne(
+    fn, nullptr, moduleOf(__builtin_return_address(0)), true);
 }
 
 HTMLAPI HTStatus HTDisableHook(
   void *fn
 ) {
-  std::lock_guard<std::mutex> lock(gMutex);
-  if (MH_DisableHook(fn) == MH_OK)
-    return HT_SUCCESS;
-  return HT_FAIL;
+  return applyOne(
+    fn, nullptr, moduleOf(__builtin_return_address(0)), false);
 }
 
 HTMLAPI HTStatus HTInstallHookEx(
   HTHookFunction *func
 ) {
-  return HTInstallHook(func->fn, func->detour, &func->origin);
+  return HTInstallHookPriority(func->fn, func->detour, &func->origin, 0);
 }
 
 HTMLAPI HTStatus HTEnableHookEx(
   HTHookFunction *func
 ) {
-  return HTEnableHook(func->fn);
+  return applyOne(func->fn, func->detour, nullptr, true);
 }
 
 HTMLAPI HTStatus HTDisableHookEx(
   HTHookFunction *func
 ) {
-  return HTDisableHook(func->fn);
+  return applyOne(func->fn, func->detour, nullptr, false);
+}
+
+HTMLAPI HTHookTransaction *HTHookBegin() {
+  return new (std::nothrow) HTHookTransaction();
+}
+
+HTMLAPI HTStatus HTHookQueue(
+  HTHookTransaction *transaction,
+  void *fn,
+  i32 enable,
+  HTStatus *status
+) {
+  HMODULE caller = moduleOf(__builtin_return_address(0));
+
+  if (status)
+    *status = HT_FAIL;
+  if (!transaction || !fn)
+    return HT_FAIL;
+
+  try {
+    transaction->queue.push_back({fn, nullptr, caller, !!enable, status});
+  } catch (...) {
+    return HT_FAIL;
+  }
+
+  return HT_SUCCESS;
+}
+
+HTMLAPI HTStatus HTHookCommit(
+  HTHookTransaction *transaction
+) {
+  HTStatus result;
+
+  if (!transaction)
+    return HT_FAIL;
+
+  try {
+    result = applyQueued(transaction->queue);
+  } catch (...) {
+    result = HT_FAIL;
+  }
+  delete transaction;
+
+  return result;
+}
+
+HTMLAPI void HTHookAbort(
+  HTHookTransaction *transaction
+) {
+  delete transaction;
+}
+
+HTMLAPI HTStatus HTInstallHookBatch(
+  HTHookFunction **func,
+  u32 size,
+  HTStatus *status
+) {
+  std::vector<HookQueued> queue;
+  HTStatus result = HT_SUCCESS;
+
+  if (!func)
+    return HT_FAIL;
+
+  // Trampolines of the whole batch are carved from one region.
+  for (u32 i = 0; i < size; i++)
+    if (func[i] && func[i]->fn) {
+      MH_ReserveBuffer(func[i]->fn, size);
+      break;
+    }
+
+  try {
+    queue.reserve(size);
+
+    for (u32 i = 0; i < size; i++) {
+      if (status)
+        status[i] = HT_FAIL;
+      if (
+        !func[i]
+        || !HTInstallHookPriority(
+          func[i]->fn,
+          func[i]->detour,
+          &func[i]->origin,
+          0)
+      ) {
+        result = HT_FAIL;
+        continue;
+      }
+      queue.push_back({
+        func[i]->fn,
+        func[i]->detour,
+        nullptr,
+        true,
+        status ? &status[i] : nullptr
+      });
+    }
+
+    if (!applyQueued(queue))
+      result = HT_FAIL;
+  } catch (...) {
+    result = HT_FAIL;
+  }
+
+  return result;
+}
+
+/**
+ * Take wrappers for the profiled links that have none yet, the lock must be
+ * held.
+ */
+static void wrapLinks(HookTable *table) {
+  HookTarget *target;
+  HookLink *link;
+
+  for (u32 i = 0; i < table->capacity; i++) {
+    target = table->slots[i];
+    if (!target)
+      continue;
+    for (u32 j = 0; j < target->links->count; j++) {
+      link = target->links->items[j];
+      if (link->profiled && !link->wrapper)
+        link->wrapper = hookProfRegister(target->fn, link->detour, link->owner);
+    }
+  }
+}
+
+HTMLAPI HTStatus HTHookProfilerEnable(
+  i32 enable
+) {
+  std::lock_guard<std::mutex> lock(gMutex);
+  HookTable *table = gTable;
+
+  // Wrappers are taken before the flag is set, links installed later get
+  // theirs on install.
+  if (enable && table)
+    wrapLinks(table);
+  hookProfSetEnabled(enable);
+  if (table)
+    // Targets installed later are linked with the new state anyway.
+    for (u32 i = 0; i < table->capacity; i++)
+      if (table->slots[i])
+        touchTarget(table->slots[i]);
+
+  return HT_SUCCESS;
 }
@@ -0,0 +1,557 @@
+// ----------------------------------------------------------------------------
+// Hook profiler of HT's Mod Loader.
+//
+// Every detour gets a generated wrapper. It saves the argument registers,
+// replaces the return address with the exit stub and records rdtsc on a
+// per-thread shadow stack, then jumps to the detour. When the detour returns
+// into the exit stub, the elapsed cycles are added to the counters of the
+// thread, and it returns to the real caller. Counters are only written by
+// their own thread and summed up on query, so no lock is taken on calls.
+// Wrappers are only linked into hook chains while profiling is enabled.
+//
+// The real return addresses only live on the shadow stack, so an exception
+// couldn't be unwound past the exit stub. They are written back to the stack
+// before any exception is dispatched, and those calls return to their
+// callers directly. Frames skipped by longjmp are dropped by their stack
+// address. The generated code has unwind info for stack walks.
+// ----------------------------------------------------------------------------
+#include <windows.h>
+#include <x86intrin.h>
+
+#include "aliases.h"
+#include "htmodloader.h"
+#include "api/hookprof.h"
+
+// Size of each wrapper, the exit stub follows the last one.
+#define HOOKPROF_STUB_SIZE 128
+#define HOOKPROF_CODE_SIZE ((HOOKPROF_MAX_HOOKS + 1) * HOOKPROF_STUB_SIZE)
+// Data starts at the next page, protections are changed page by page.
+#define HOOKPROF_SLOT_OFFSET ((HOOKPROF_CODE_SIZE + 0xFFF) & ~0xFFF)
+// Marks the thread state being allocated, calls from the allocation itself
+// are passed through.
+#define HOOKPROF_THREAD_BUSY ((HookProfThread *)1)
+#define HOOKPROF_EXIT_STUB (gCode + HOOKPROF_MAX_HOOKS * HOOKPROF_STUB_SIZE)
+
+// Unwind codes used by the generated code.
+#define HOOKPROF_UWOP_PUSH_NONVOL 0
+#define HOOKPROF_UWOP_ALLOC_SMALL 2
+#define HOOKPROF_UNWIND_CODE(offset, op, info) \
+  ((u16)((offset) | ((op) | (info) << 4) << 8))
+
+// Exceptions raised for debuggers only, always continued.
+#ifndef DBG_PRINTEXCEPTION_C
+#define DBG_PRINTEXCEPTION_C 0x40010006
+#endif
+#ifndef DBG_PRINTEXCEPTION_WIDE_C
+#define DBG_PRINTEXCEPTION_WIDE_C 0x4001000A
+#endif
+#define HOOKPROF_EXCEPTION_THREAD_NAME 0x406D1388
+
+// A profiled detour.
+typedef struct {
+  void *fn;
+  void *detour;
+  HMODULE owner;
+  u32 id;
+} HookProfHook;
+
+typedef struct {
+  u64 calls;
+  u64 cycles;
+  u64 selfCycles;
+  u64 maxCycles;
+} HookProfCounter;
+
+// A call in progress on the shadow stack.
+typedef struct {
+  void *ret;
+  // Where the return address is on the stack.
+  void **slot;
+  u64 start;
+  // Cycles of nested profiled calls.
+  u64 child;
+  u32 id;
+} HookProfFrame;
+
+// Counters and shadow stack of a thread.
+typedef struct HookProfThread {
+  struct HookProfThread *next;
+  // Counters are cleared by the thread itself once it sees a new epoch.
+  LONG epoch;
+  u32 depth;
+  HookProfFrame frames[HOOKPROF_MAX_DEPTH];
+  HookProfCounter counters[HOOKPROF_MAX_HOOKS];
+} HookProfThread;
+
+// UNWIND_INFO of the generated code.
+typedef struct {
+  u08 version;
+  u08 prologSize;
+  u08 codeCount;
+  u08 frame;
+  u16 codes[6];
+} HookProfUnwind;
+
+// Data following the generated code. Unwind info is addressed relative to
+// the code, so it's kept in the same allocation.
+typedef struct {
+  HookProfHook *slots[HOOKPROF_MAX_HOOKS];
+  HookProfUnwind wrapperUnwind;
+  HookProfUnwind exitUnwind;
+  RUNTIME_FUNCTION functions[HOOKPROF_MAX_HOOKS + 1];
+} HookProfData;
+
+static INIT_ONCE gInitOnce = INIT_ONCE_STATIC_INIT;
+static DWORD gTlsIndex = TLS_OUT_OF_INDEXES;
+static volatile LONG gEnabled = 0;
+static volatile LONG gEpoch = 0;
+// Threads that have called a wrapper, never removed.
+static HookProfThread *volatile gThreads = NULL;
+static HookProfHook gHooks[HOOKPROF_MAX_HOOKS];
+static volatile LONG gHookCount = 0;
+// Wrappers and the exit stub, followed by their data.
+static u08 *gCode = NULL;
+static HookProfData *gData = NULL;
+// Reference of HTHookProfilerFrequency().
+static u64 gRefTsc = 0;
+static LARGE_INTEGER gRefCounter;
+
+// ----------------------------------------------------------------------------
+// [SECTION] Runtime.
+// ----------------------------------------------------------------------------
+
+/**
+ * Get the state of the calling thread, allocated on first call.
+ */
+static HookProfThread *getThread() {
+  HookProfThread *thread = (HookProfThread *)TlsGetValue(gTlsIndex);
+
+  if (thread)
+    return thread == HOOKPROF_THREAD_BUSY ? NULL : thread;
+
+  TlsSetValue(gTlsIndex, HOOKPROF_THREAD_BUSY);
+  // Not from the heap, which may be hooked itself.
+  thread = (HookProfThread *)VirtualAlloc(
+    NULL,
+    sizeof(HookProfThread),
+    MEM_COMMIT | MEM_RESERVE,
+    PAGE_READWRITE);
+  if (!thread)
+    // Stays busy, this thread is never profiled.
+    return NULL;
+
+  thread->epoch = gEpoch;
+  do
+    thread->next = gThreads;
+  while (
+    InterlockedCompareExchangePointer(
+      (PVOID volatile *)&gThreads,
+      thread,
+      thread->next) != thread->next
+  );
+  TlsSetValue(gTlsIndex, thread);
+
+  return thread;
+}
+
+/**
+ * Drop the frames at or below `slot`. Their calls were unwound without
+ * returning through the exit stub, e.g. by longjmp.
+ */
+static void dropFrames(HookProfThread *thread, void **slot) {
+  while (thread->depth && thread->frames[thread->depth - 1].slot <= slot)
+    thread->depth--;
+}
+
+/**
+ * Called by wrappers before the detour. Returns the detour to jump to.
+ */
+static void *profEnter(HookProfHook *hook, void **ret) {
+  HookProfThread *thread;
+  HookProfFrame *frame;
+  DWORD lastError = GetLastError();
+
+  thread = getThread();
+  SetLastError(lastError);
+  if (!thread)
+    return hook->detour;
+
+  if (thread->epoch != gEpoch) {
+    memset(thread->counters, 0, sizeof(thread->counters));
+    thread->epoch = gEpoch;
+  }
+
+  // Tail called by a profiled detour, whose frame times this call too.
+  if (*ret == HOOKPROF_EXIT_STUB) {
+    thread->counters[hook->id].calls++;
+    return hook->detour;
+  }
+
+  dropFrames(thread, ret);
+  if (thread->depth == HOOKPROF_MAX_DEPTH) {
+    thread->counters[hook->id].calls++;
+    return hook->detour;
+  }
+
+  frame = &thread->frames[thread->depth++];
+  frame->ret = *ret;
+  frame->slot = ret;
+  frame->child = 0;
+  frame->id = hook->id;
+  *ret = HOOKPROF_EXIT_STUB;
+  frame->start = __rdtsc();
+
+  return hook->detour;
+}
+
+/**
+ * Called by the exit stub after the detour. Writes the real return address
+ * to `ret`, the slot the exit stub returns through.
+ */
+static void profLeave(void **ret) {
+  u64 end = __rdtsc(), cycles;
+  HookProfThread *thread;
+  HookProfFrame *frame;
+  HookProfCounter *counter;
+  DWORD lastError = GetLastError();
+
+  // Always allocated, as the frame is pushed by profEnter().
+  thread = (HookProfThread *)TlsGetValue(gTlsIndex);
+
+  // Frames of deeper calls left by longjmp are still on top.
+  while (thread->depth > 1 && thread->frames[thread->depth - 1].slot < ret)
+    thread->depth--;
+  frame = &thread->frames[--thread->depth];
+  // Written first, so the exit stub can be unwound.
+  *ret = frame->ret;
+  SetLastError(lastError);
+
+  cycles = end - frame->start;
+  if (thread->depth)
+    thread->frames[thread->depth - 1].child += cycles;
+
+  counter = &thread->counters[frame->id];
+  counter->calls++;
+  counter->cycles += cycles;
+  counter->selfCycles += cycles - frame->child;
+  if (cycles > counter->maxCycles)
+    counter->maxCycles = cycles;
+}
+
+/**
+ * Write the real return addresses of the calls in progress back before an
+ * exception is dispatched, so it can be unwound past them. These calls
+ * return to their callers directly and are counted without timing.
+ */
+static LONG CALLBACK profOnException(PEXCEPTION_POINTERS info) {
+  DWORD code = info->ExceptionRecord->ExceptionCode;
+  HookProfThread *thread;
+  HookProfFrame *frame;
+  DWORD lastError;
+
+  if (
+    code == DBG_PRINTEXCEPTION_C
+    || code == DBG_PRINTEXCEPTION_WIDE_C
+    || code == HOOKPROF_EXCEPTION_THREAD_NAME
+  )
+    return EXCEPTION_CONTINUE_SEARCH;
+
+  lastError = GetLastError();
+  thread = (HookProfThread *)TlsGetValue(gTlsIndex);
+  SetLastError(lastError);
+  if (!thread || thread == HOOKPROF_THREAD_BUSY)
+    return EXCEPTION_CONTINUE_SEARCH;
+
+  while (thread->depth) {
+    frame = &thread->frames[--thread->depth];
+    // Frames below the stack pointer were left already.
+    if ((u64)frame->slot < info->ContextRecord->Rsp)
+      continue;
+    if (*frame->slot == HOOKPROF_EXIT_STUB)
+      *frame->slot = frame->ret;
+    thread->counters[frame->id].calls++;
+  }
+
+  return EXCEPTION_CONTINUE_SEARCH;
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Code generation.
+// ----------------------------------------------------------------------------
+
+static u08 *emit(u08 *p, const void *bytes, u32 len) {
+  memcpy(p, bytes, len);
+  return p + len;
+}
+
+static u08 *emitU64(u08 *p, u64 value) {
+  return emit(p, &value, sizeof(value));
+}
+
+/**
+ * Generate the wrapper reading its hook from `slot`.
+ *
+ * The return address is at [rsp] on entry. Argument registers and xmm0-3
+ * are saved around profEnter(), whose 32 bytes of shadow space and stack
+ * alignment are kept.
+ */
+static void emitWrapper(u08 *p, HookProfHook **slot) {
+  static const u08 save[] = {
+    0x51,                               // push rcx
+    0x52,                               // push rdx
+    0x41, 0x50,                         // push r8
+    0x41, 0x51,                         // push r9
+    0x48, 0x83, 0xEC, 0x68,             // sub rsp, 0x68
+    0xF3, 0x0F, 0x7F, 0x44, 0x24, 0x20, // movdqu [rsp + 0x20], xmm0
+    0xF3, 0x0F, 0x7F, 0x4C, 0x24, 0x30, // movdqu [rsp + 0x30], xmm1
+    0xF3, 0x0F, 0x7F, 0x54, 0x24, 0x40, // movdqu [rsp + 0x40], xmm2
+    0xF3, 0x0F, 0x7F, 0x5C, 0x24, 0x50, // movdqu [rsp + 0x50], xmm3
+  };
+  static const u08 restore[] = {
+    0xF3, 0x0F, 0x6F, 0x44, 0x24, 0x20, // movdqu xmm0, [rsp + 0x20]
+    0xF3, 0x0F, 0x6F, 0x4C, 0x24, 0x30, // movdqu xmm1, [rsp + 0x30]
+    0xF3, 0x0F, 0x6F, 0x54, 0x24, 0x40, // movdqu xmm2, [rsp + 0x40]
+    0xF3, 0x0F, 0x6F, 0x5C, 0x24, 0x50, // movdqu xmm3, [rsp + 0x50]
+    0x48, 0x83, 0xC4, 0x68,             // add rsp, 0x68
+    0x41, 0x59,                         // pop r9
+    0x41, 0x58,                         // pop r8
+    0x5A,                               // pop rdx
+    0x59,                               // pop rcx
+    0xFF, 0xE0                          // jmp rax
+  };
+  // lea rdx, [rsp + 0x88], the return address.
+  static const u08 leaRet[] = {0x48, 0x8D, 0x94, 0x24, 0x88, 0x00, 0x00, 0x00};
+  i32 disp;
+
+  p = emit(p, save, sizeof(save));
+  // mov rcx, [rip + disp32]
+  disp = (i32)((u08 *)slot - (p + 7));
+  p = emit(p, "\x48\x8B\x0D", 3);
+  p = emit(p, &disp, sizeof(disp));
+  p = emit(p, leaRet, sizeof(leaRet));
+  // mov rax, profEnter; call rax
+  p = emit(p, "\x48\xB8", 2);
+  p = emitU64(p, (u64)profEnter);
+  p = emit(p, "\xFF\xD0", 2);
+  emit(p, restore, sizeof(restore));
+}
+
+/**
+ * Generate the exit stub, entered by the return of detours. Return values
+ * in rax and xmm0 are kept.
+ *
+ * The slot of the consumed return address is reserved again and filled by
+ * profLeave(), so the stub unwinds and returns like a called function.
+ */
+static void emitExit(u08 *p) {
+  static const u08 save[] = {
+    0x48, 0x83, 0xEC, 0x08,             // sub rsp, 8
+    0x50,                               // push rax
+    0x48, 0x83, 0xEC, 0x30,             // sub rsp, 0x30
+    0xF3, 0x0F, 0x7F, 0x44, 0x24, 0x20, // movdqu [rsp + 0x20], xmm0
+    0x48, 0x8D, 0x4C, 0x24, 0x38        // lea rcx, [rsp + 0x38]
+  };
+  static const u08 restore[] = {
+    0xF3, 0x0F, 0x6F, 0x44, 0x24, 0x20, // movdqu xmm0, [rsp + 0x20]
+    0x48, 0x83, 0xC4, 0x30,             // add rsp, 0x30
+    0x58,                               // pop rax
+    0xC3                                // ret
+  };
+
+  p = emit(p, save, sizeof(save));
+  // mov rax, profLeave; call rax
+  p = emit(p, "\x48\xB8", 2);
+  p = emitU64(p, (u64)profLeave);
+  p = emit(p, "\xFF\xD0", 2);
+  emit(p, restore, sizeof(restore));
+}
+
+/**
+ * Describe the prologues of the generated code and register it, so stack
+ * walks can pass through it.
+ */
+static BOOL registerUnwind() {
+  static const HookProfUnwind wrapperUnwind = {1, 10, 5, 0, {
+    HOOKPROF_UNWIND_CODE(10, HOOKPROF_UWOP_ALLOC_SMALL, (0x68 - 8) / 8),
+    HOOKPROF_UNWIND_CODE(6, HOOKPROF_UWOP_PUSH_NONVOL, 9),
+    HOOKPROF_UNWIND_CODE(4, HOOKPROF_UWOP_PUSH_NONVOL, 8),
+    HOOKPROF_UNWIND_CODE(2, HOOKPROF_UWOP_PUSH_NONVOL, 2),
+    HOOKPROF_UNWIND_CODE(1, HOOKPROF_UWOP_PUSH_NONVOL, 1)
+  }};
+  // Entered with the return address slot reserved by `sub rsp, 8`.
+  static const HookProfUnwind exitUnwind = {1, 9, 2, 0, {
+    HOOKPROF_UNWIND_CODE(9, HOOKPROF_UWOP_ALLOC_SMALL, (0x30 - 8) / 8),
+    HOOKPROF_UNWIND_CODE(5, HOOKPROF_UWOP_PUSH_NONVOL, 0)
+  }};
+  RUNTIME_FUNCTION *function;
+
+  gData->wrapperUnwind = wrapperUnwind;
+  gData->exitUnwind = exitUnwind;
+  for (u32 i = 0; i <= HOOKPROF_MAX_HOOKS; i++) {
+    function = &gData->functions[i];
+    function->BeginAddress = i * HOOKPROF_STUB_SIZE;
+    function->EndAddress = (i + 1) * HOOKPROF_STUB_SIZE;
+    function->UnwindData = (DWORD)((u08 *)(
+      i < HOOKPROF_MAX_HOOKS ? &gData->wrapperUnwind : &gData->exitUnwind
+    ) - gCode);
+  }
+
+  return RtlAddFunctionTable(
+    gData->functions,
+    HOOKPROF_MAX_HOOKS + 1,
+    (DWORD64)gCode);
+}
+
+/**
+ * Generate all wrappers at once, so the code is never written again while
+ * other threads are running it.
+ */
+static BOOL CALLBACK initProfiler(
+  PINIT_ONCE initOnce,
+  PVOID parameter,
+  PVOID *context
+) {
+  DWORD protect;
+
+  (void)initOnce;
+  (void)parameter;
+  (void)context;
+
+  gTlsIndex = TlsAlloc();
+  if (gTlsIndex == TLS_OUT_OF_INDEXES)
+    return FALSE;
+
+  gCode = (u08 *)VirtualAlloc(
+    NULL,
+    HOOKPROF_SLOT_OFFSET + sizeof(HookProfData),
+    MEM_COMMIT | MEM_RESERVE,
+    PAGE_READWRITE);
+  if (!gCode)
+    return FALSE;
+  gData = (HookProfData *)(gCode + HOOKPROF_SLOT_OFFSET);
+
+  memset(gCode, 0xCC, HOOKPROF_SLOT_OFFSET);
+  for (u32 i = 0; i < HOOKPROF_MAX_HOOKS; i++)
+    emitWrapper(gCode + i * HOOKPROF_STUB_SIZE, &gData->slots[i]);
+  emitExit(HOOKPROF_EXIT_STUB);
+
+  if (
+    !VirtualProtect(gCode, HOOKPROF_SLOT_OFFSET, PAGE_EXECUTE_READ, &protect)
+    || !registerUnwind()
+  ) {
+    VirtualFree(gCode, 0, MEM_RELEASE);
+    gCode = NULL;
+    return FALSE;
+  }
+  FlushInstructionCache(GetCurrentProcess(), gCode, HOOKPROF_CODE_SIZE);
+
+  // Kept as long as the generated code, which is never freed.
+  if (!AddVectoredExceptionHandler(1, profOnException)) {
+    RtlDeleteFunctionTable(gData->functions);
+    VirtualFree(gCode, 0, MEM_RELEASE);
+    gCode = NULL;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Profiler APIs.
+// ----------------------------------------------------------------------------
+
+void *hookProfRegister(void *fn, void *detour, HMODULE owner) {
+  HookProfHook *hook;
+  u32 id;
+
+  if (!InitOnceExecuteOnce(&gInitOnce, initProfiler, NULL, NULL))
+    return NULL;
+
+  id = (u32)gHookCount;
+  if (id == HOOKPROF_MAX_HOOKS)
+    return NULL;
+
+  hook = &gHooks[id];
+  hook->fn = fn;
+  hook->detour = detour;
+  hook->owner = owner;
+  hook->id = id;
+  gData->slots[id] = hook;
+  // Published after the hook is filled.
+  InterlockedIncrement(&gHookCount);
+
+  return gCode + id * HOOKPROF_STUB_SIZE;
+}
+
+void hookProfSetEnabled(i32 enable) {
+  if (enable && !InterlockedOr(&gEnabled, 0)) {
+    gRefTsc = __rdtsc();
+    QueryPerformanceCounter(&gRefCounter);
+  }
+  InterlockedExchange(&gEnabled, !!enable);
+}
+
+i32 hookProfIsEnabled() {
+  return InterlockedOr(&gEnabled, 0);
+}
+
+HTMLAPI u32 HTHookProfilerQuery(
+  HTHookProfile *profiles,
+  u32 maxCount
+) {
+  HookProfThread *thread;
+  HookProfCounter *counter;
+  LONG epoch = InterlockedOr(&gEpoch, 0);
+  u32 count = (u32)InterlockedOr(&gHookCount, 0);
+
+  if (!profiles)
+    return count;
+  if (count > maxCount)
+    count = maxCount;
+
+  for (u32 i = 0; i < count; i++) {
+    memset(&profiles[i], 0, sizeof(HTHookProfile));
+    profiles[i].fn = gHooks[i].fn;
+    profiles[i].detour = gHooks[i].detour;
+    profiles[i].owner = gHooks[i].owner;
+  }
+
+  // Counters may be updated while summed up, each of them is still read
+  // atomically.
+  for (thread = gThreads; thread; thread = thread->next) {
+    if (thread->epoch != epoch)
+      continue;
+    for (u32 i = 0; i < count; i++) {
+      counter = &thread->counters[i];
+      profiles[i].calls += counter->calls;
+      profiles[i].cycles += counter->cycles;
+      profiles[i].selfCycles += counter->selfCycles;
+      if (counter->maxCycles > profiles[i].maxCycles)
+        profiles[i].maxCycles = counter->maxCycles;
+    }
+  }
+
+  return count;
+}
+
+HTMLAPI void HTHookProfilerReset() {
+  InterlockedIncrement(&gEpoch);
+}
+
+HTMLAPI u64 HTHookProfilerFrequency() {
+  LARGE_INTEGER counter, frequency;
+  u64 tsc = __rdtsc();
+
+  if (!gRefTsc)
+    return 0;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  // Too short to be accurate.
+  if (counter.QuadPart - gRefCounter.QuadPart < frequency.QuadPart / 100)
+    return 0;
+
+  return (u64)(
+    (f64)(tsc - gRefTsc)
+    * frequency.QuadPart
+    / (counter.QuadPart - gRefCounter.QuadPart));
+}
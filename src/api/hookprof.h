@@ -0,0 +1,42 @@
+#ifndef __HOOKPROF_H__
+#define __HOOKPROF_H__
+
+#include <windows.h>
+#include "aliases.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Max number of profiled detours.
+#define HOOKPROF_MAX_HOOKS 1024
+// Max nesting of profiled detours on a thread, deeper calls are counted
+// without timing.
+#define HOOKPROF_MAX_DEPTH 64
+
+/**
+ * Generate the profiling wrapper of a detour. The wrapper measures the
+ * detour and jumps to it with all argument registers intact. Returns NULL
+ * if there's no room for more wrappers. Calls must be serialized, wrappers
+ * are only taken once profiling is enabled as they're never released.
+ */
+void *hookProfRegister(
+  void *fn, void *detour, HMODULE owner);
+
+/**
+ * Set whether wrappers are linked into hook chains. Only the flag is kept
+ * here, chains are relinked by the caller.
+ */
+void hookProfSetEnabled(
+  i32 enable);
+
+/**
+ * Check if wrappers are linked into hook chains.
+ */
+i32 hookProfIsEnabled();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
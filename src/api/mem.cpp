@@ -1,18 +1,360 @@
 // ----------------------------------------------------------------------------
 // Memory manager APIs of HT's Mod Loader.
+//
+// Small blocks are carved from 64KB slabs of fixed size classes. Each thread
+// allocates from its own slabs without locks, and blocks freed by other
+// threads are pushed onto a lock-free stack of the slab, taken back at once
+// by its owner. Slabs are aligned to their size and registered in a page
+// map, so HTMemFree() validates a pointer with a map lookup and the
+// allocation bitmap of its slab. Large blocks are allocated from gHeap.
 // ----------------------------------------------------------------------------
+#include <windows.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unordered_set>
 #include <mutex>
 #include "aliases.h"
 #include "globals.h"
 #include "htmodloader.h"
+#include "api/mem.h"
+
+// Slabs are aligned to their size, the allocation granularity of Windows.
+#define MEM_SLAB_SIZE 0x10000
+#define MEM_SLAB_SHIFT 16
+// Blocks larger than this are allocated from gHeap.
+#define MEM_SMALL_MAX 4096
+#define MEM_CLASS_COUNT 28
+#define MEM_MIN_BLOCK 16
+#define MEM_MAX_BLOCKS (MEM_SLAB_SIZE / MEM_MIN_BLOCK)
+// Address space reserved for each frame scratch buffer of a thread.
+#define MEM_FRAME_RESERVE (16ULL << 20)
+// The page map covers the 47-bit user space, bits [32, 47) select the first
+// level and bits [16, 32) the second.
+#define MEM_MAP_L1_SIZE (1 << 15)
+#define MEM_MAP_L2_SIZE (1 << 16)
+
+struct MemCache;
+
+// Header of a slab, blocks follow it.
+struct MemSlab {
+  // Thread cache allocating from the slab, NULL while orphaned.
+  MemCache *volatile owner;
+  MemSlab *next;
+  u32 sizeClass;
+  u32 blockSize;
+  u32 capacity;
+  u08 *data;
+  // Blocks from here on are never allocated yet.
+  u08 *bump;
+  u08 *end;
+  // Blocks freed by the owner.
+  void *freeList;
+  // Blocks freed by other threads. Only pushed with CAS and taken as a
+  // whole by the owner, so no ABA problem arises.
+  void *volatile remoteFree;
+  // Bits of allocated blocks, rejects invalid and double frees.
+  volatile LONG used[MEM_MAX_BLOCKS / 32];
+};
+
+// Slabs of a thread.
+struct MemCache {
+  // Slabs of each size class, the one allocated from first at the head.
+  MemSlab *slabs[MEM_CLASS_COUNT];
+  // Frame scratch region of the thread, buffers are placed in a row.
+  u08 *scratch;
+  // Frame each buffer is last allocated in.
+  u64 scratchFrames[HT_FRAME_BUFFERS];
+  // Allocated and committed bytes of each buffer.
+  u64 scratchTop[HT_FRAME_BUFFERS];
+  u64 scratchCommitted[HT_FRAME_BUFFERS];
+};
+
+static const u32 gClassSizes[MEM_CLASS_COUNT] = {
+  16, 32, 48, 64, 80, 96, 112, 128,
+  160, 192, 224, 256,
+  320, 384, 448, 512,
+  640, 768, 896, 1024,
+  1280, 1536, 1792, 2048,
+  2560, 3072, 3584, 4096
+};
+
+static INIT_ONCE gInitOnce = INIT_ONCE_STATIC_INIT;
+static DWORD gTlsIndex = TLS_OUT_OF_INDEXES;
+// Size class of every 16 bytes of size up to MEM_SMALL_MAX.
+static u08 gClassOf[MEM_SMALL_MAX / MEM_MIN_BLOCK + 1];
+
+// Guards new second level maps and the orphan lists.
+static SRWLOCK gSlabLock = SRWLOCK_INIT;
+static MemSlab **volatile gPageMap[MEM_MAP_L1_SIZE];
+// Slabs of exited threads, adopted by threads needing a new slab.
+static MemSlab *gOrphans[MEM_CLASS_COUNT];
+
+// Number of frames presented.
+static volatile LONG64 gFrameIndex;
 
 static std::mutex gMutex;
-// Stores pointers to all allocated mem blocks.
+// Stores pointers to all allocated large blocks.
 static std::unordered_set<void *> gAllocated;
 
-void *HTMemAlloc(u64 size) {
+static BOOL CALLBACK initMem(
+  PINIT_ONCE initOnce,
+  PVOID parameter,
+  PVOID *context
+) {
+  u32 sizeClass = 0;
+
+  (void)initOnce;
+  (void)parameter;
+  (void)context;
+
+  gTlsIndex = TlsAlloc();
+  if (gTlsIndex == TLS_OUT_OF_INDEXES)
+    return FALSE;
+
+  for (u32 i = 0; i <= MEM_SMALL_MAX / MEM_MIN_BLOCK; i++) {
+    while (gClassSizes[sizeClass] < i * MEM_MIN_BLOCK)
+      sizeClass++;
+    gClassOf[i] = (u08)sizeClass;
+  }
+
+  return TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Page map.
+// ----------------------------------------------------------------------------
+
+static MemSlab *findSlab(const void *pointer) {
+  u64 address = (u64)pointer;
+  MemSlab **level2;
+
+  if ((address >> 32) >= MEM_MAP_L1_SIZE)
+    return nullptr;
+  level2 = gPageMap[address >> 32];
+  if (!level2)
+    return nullptr;
+
+  return level2[(address >> MEM_SLAB_SHIFT) & (MEM_MAP_L2_SIZE - 1)];
+}
+
+/**
+ * Register the slab in the page map, the lock must be held.
+ */
+static bool mapSlab(MemSlab *slab) {
+  u64 address = (u64)slab;
+  MemSlab **level2;
+
+  if ((address >> 32) >= MEM_MAP_L1_SIZE)
+    return false;
+
+  level2 = gPageMap[address >> 32];
+  if (!level2) {
+    // Pages of the map are only committed by the system once touched.
+    level2 = (MemSlab **)VirtualAlloc(
+      nullptr,
+      MEM_MAP_L2_SIZE * sizeof(MemSlab *),
+      MEM_COMMIT | MEM_RESERVE,
+      PAGE_READWRITE);
+    if (!level2)
+      return false;
+    InterlockedExchangePointer((PVOID volatile *)&gPageMap[address >> 32], level2);
+  }
+
+  InterlockedExchangePointer(
+    (PVOID volatile *)&level2[(address >> MEM_SLAB_SHIFT) & (MEM_MAP_L2_SIZE - 1)],
+    slab);
+
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Slabs.
+// ----------------------------------------------------------------------------
+
+/**
+ * Get the cache of the calling thread, allocated on first call.
+ */
+static MemCache *getCache() {
+  MemCache *cache = (MemCache *)TlsGetValue(gTlsIndex);
+
+  if (cache)
+    return cache;
+
+  cache = (MemCache *)HeapAlloc(gHeap, HEAP_ZERO_MEMORY, sizeof(MemCache));
+  if (cache)
+    TlsSetValue(gTlsIndex, cache);
+
+  return cache;
+}
+
+/**
+ * Get a slab of the size class for the cache, either adopted from an exited
+ * thread or newly allocated.
+ */
+static MemSlab *newSlab(MemCache *cache, u32 sizeClass) {
+  MemSlab *slab;
+  u64 dataOffset;
+
+  AcquireSRWLockExclusive(&gSlabLock);
+  slab = gOrphans[sizeClass];
+  if (slab)
+    gOrphans[sizeClass] = slab->next;
+  ReleaseSRWLockExclusive(&gSlabLock);
+
+  if (!slab) {
+    slab = (MemSlab *)VirtualAlloc(
+      nullptr,
+      MEM_SLAB_SIZE,
+      MEM_COMMIT | MEM_RESERVE,
+      PAGE_READWRITE);
+    if (!slab)
+      return nullptr;
+    if ((u64)slab & (MEM_SLAB_SIZE - 1)) {
+      VirtualFree(slab, 0, MEM_RELEASE);
+      return nullptr;
+    }
+
+    dataOffset = (sizeof(MemSlab) + MEM_MIN_BLOCK - 1) & ~(u64)(MEM_MIN_BLOCK - 1);
+    slab->sizeClass = sizeClass;
+    slab->blockSize = gClassSizes[sizeClass];
+    slab->capacity = (u32)((MEM_SLAB_SIZE - dataOffset) / slab->blockSize);
+    slab->data = (u08 *)slab + dataOffset;
+    slab->bump = slab->data;
+    slab->end = slab->data + (u64)slab->capacity * slab->blockSize;
+
+    AcquireSRWLockExclusive(&gSlabLock);
+    if (!mapSlab(slab)) {
+      ReleaseSRWLockExclusive(&gSlabLock);
+      VirtualFree(slab, 0, MEM_RELEASE);
+      return nullptr;
+    }
+    ReleaseSRWLockExclusive(&gSlabLock);
+  }
+
+  slab->owner = cache;
+  slab->next = cache->slabs[sizeClass];
+  cache->slabs[sizeClass] = slab;
+
+  return slab;
+}
+
+/**
+ * Allocate a block from the slab, only called by its owner.
+ */
+static void *slabAlloc(MemSlab *slab) {
+  void *block = slab->freeList;
+  u32 index;
+
+  if (!block && slab->remoteFree)
+    block = InterlockedExchangePointer((PVOID volatile *)&slab->remoteFree, nullptr);
+
+  if (block)
+    slab->freeList = *(void **)block;
+  else if (slab->bump < slab->end) {
+    block = slab->bump;
+    slab->bump += slab->blockSize;
+  } else
+    return nullptr;
+
+  index = (u32)(((u08 *)block - slab->data) / slab->blockSize);
+  InterlockedBitTestAndSet(&slab->used[index >> 5], index & 31);
+
+  return block;
+}
+
+static void *allocSmall(u64 size) {
+  u32 sizeClass = gClassOf[(size + MEM_MIN_BLOCK - 1) / MEM_MIN_BLOCK];
+  MemCache *cache = getCache();
+  MemSlab *slab, **link;
+  void *block;
+
+  if (!cache)
+    return nullptr;
+
+  // Slabs behind the head are only checked once the head is full, and the
+  // first one with free blocks is moved to the head.
+  for (link = &cache->slabs[sizeClass]; (slab = *link); link = &slab->next) {
+    block = slabAlloc(slab);
+    if (!block)
+      continue;
+    if (slab != cache->slabs[sizeClass]) {
+      *link = slab->next;
+      slab->next = cache->slabs[sizeClass];
+      cache->slabs[sizeClass] = slab;
+    }
+    return block;
+  }
+
+  slab = newSlab(cache, sizeClass);
+  return slab ? slabAlloc(slab) : nullptr;
+}
+
+static HTStatus freeSmall(MemSlab *slab, void *pointer) {
+  u64 offset;
+  u32 index;
+  void *head;
+
+  if ((u08 *)pointer < slab->data || (u08 *)pointer >= slab->end)
+    return HT_FAIL;
+  offset = (u64)((u08 *)pointer - slab->data);
+  if (offset % slab->blockSize)
+    return HT_FAIL;
+
+  index = (u32)(offset / slab->blockSize);
+  if (!InterlockedBitTestAndReset(&slab->used[index >> 5], index & 31))
+    return HT_FAIL;
+
+  // Only the owner itself can see its own cache here.
+  if (slab->owner && slab->owner == TlsGetValue(gTlsIndex)) {
+    *(void **)pointer = slab->freeList;
+    slab->freeList = pointer;
+  } else
+    do {
+      head = slab->remoteFree;
+      *(void **)pointer = head;
+    } while (
+      InterlockedCompareExchangePointer(
+        (PVOID volatile *)&slab->remoteFree,
+        pointer,
+        head) != head
+    );
+
+  return HT_SUCCESS;
+}
+
+void memThreadDetach() {
+  MemCache *cache;
+  MemSlab *slab, *next;
+
+  if (gTlsIndex == TLS_OUT_OF_INDEXES)
+    return;
+  cache = (MemCache *)TlsGetValue(gTlsIndex);
+  if (!cache)
+    return;
+
+  // Blocks still allocated from the slabs can be freed by any thread, and
+  // their free blocks are reused by the thread adopting them.
+  AcquireSRWLockExclusive(&gSlabLock);
+  for (u32 i = 0; i < MEM_CLASS_COUNT; i++)
+    for (slab = cache->slabs[i]; slab; slab = next) {
+      next = slab->next;
+      slab->owner = nullptr;
+      slab->next = gOrphans[i];
+      gOrphans[i] = slab;
+    }
+  ReleaseSRWLockExclusive(&gSlabLock);
+
+  if (cache->scratch)
+    VirtualFree(cache->scratch, 0, MEM_RELEASE);
+  TlsSetValue(gTlsIndex, nullptr);
+  HeapFree(gHeap, 0, cache);
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Memory APIs.
+// ----------------------------------------------------------------------------
+
+static void *allocLarge(u64 size) {
   std::lock_guard<std::mutex> lock(gMutex);
   void *result = HeapAlloc(gHeap, 0, size);
   if (result)
@@ -20,23 +362,395 @@ void *HTMemAlloc(u64 size) {
   return result;
 }
 
+void *HTMemAlloc(u64 size) {
+  void *result;
+
+  if (
+    size <= MEM_SMALL_MAX
+    && InitOnceExecuteOnce(&gInitOnce, initMem, nullptr, nullptr)
+  ) {
+    result = allocSmall(size);
+    if (result)
+      return result;
+  }
+
+  try {
+    return allocLarge(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
 void *HTMemNew(u64 count, u64 size) {
-  std::lock_guard<std::mutex> lock(gMutex);
-  void *result = HeapAlloc(gHeap, 0, count * size);
-  if (result)
-    gAllocated.insert(result);
-  return result;
+  if (size && count > (u64)-1 / size)
+    return nullptr;
+
+  return HTMemAlloc(count * size);
 }
 
 HTStatus HTMemFree(void *pointer) {
+  MemSlab *slab = findSlab(pointer);
+
+  if (slab)
+    return freeSmall(slab, pointer);
+
   std::lock_guard<std::mutex> lock(gMutex);
   auto it = gAllocated.find(pointer);
 
   if (it == gAllocated.end())
     return HT_FAIL;
 
-  gAllocated.erase(pointer);
+  gAllocated.erase(it);
   HeapFree(gHeap, 0, pointer);
 
   return HT_SUCCESS;
 }
+
+// ----------------------------------------------------------------------------
+// [SECTION] Arena APIs.
+// ----------------------------------------------------------------------------
+
+#define ARENA_MAGIC 0x414E5241
+#define ARENA_DEFAULT_RESERVE (64ULL << 20)
+// Pages are committed in chunks of this size.
+#define ARENA_COMMIT_SIZE 0x10000
+
+// Header of an arena. Headers are allocated apart from their regions and
+// never freed, so a destroyed handle is still safe to check.
+struct HTArena {
+  u32 magic;
+  HMODULE owner;
+  HTArena *prev;
+  HTArena *next;
+  // Held shared by allocations, and exclusively to reset or destroy.
+  SRWLOCK lock;
+  // Reserved region and its blocks.
+  u08 *region;
+  u08 *end;
+  // Next block to allocate.
+  u08 *volatile top;
+  // End of the committed pages.
+  u08 *volatile committed;
+  volatile LONG64 liveBytes;
+  volatile LONG64 peakBytes;
+  volatile LONG64 allocCount;
+  volatile LONG64 totalAllocs;
+};
+
+static SRWLOCK gArenaLock = SRWLOCK_INIT;
+// All living arenas.
+static HTArena *gArenas;
+
+/**
+ * Check if the arena is living, the lock must be held.
+ */
+static bool findArena(HTArena *arena) {
+  for (HTArena *it = gArenas; it; it = it->next)
+    if (it == arena)
+      return true;
+  return false;
+}
+
+/**
+ * Commit the pages up to `top`, which is already taken by the caller.
+ */
+static bool commitArena(HTArena *arena, u08 *top) {
+  u08 *committed = arena->committed, *target, *old;
+
+  if (top <= committed)
+    return true;
+
+  target = (u08 *)(
+    ((u64)top + ARENA_COMMIT_SIZE - 1) & ~(u64)(ARENA_COMMIT_SIZE - 1));
+  if (target > arena->end)
+    target = arena->end;
+  // Pages committed by a racing thread are simply committed again.
+  if (!VirtualAlloc(committed, target - committed, MEM_COMMIT, PAGE_READWRITE))
+    return false;
+
+  while ((old = arena->committed) < target)
+    if (
+      InterlockedCompareExchangePointer(
+        (PVOID volatile *)&arena->committed,
+        target,
+        old) == old
+    )
+      break;
+
+  return true;
+}
+
+HTMLAPI HTArena *HTArenaCreate(
+  HMODULE hModule,
+  u64 reserveSize
+) {
+  HTArena *arena;
+  u08 *region;
+
+  if (!hModule)
+    return nullptr;
+  if (!reserveSize)
+    reserveSize = ARENA_DEFAULT_RESERVE;
+  if (reserveSize > (u64)-1 / 2)
+    return nullptr;
+  reserveSize = (reserveSize + MEM_SLAB_SIZE - 1) & ~(u64)(MEM_SLAB_SIZE - 1);
+
+  arena = (HTArena *)HeapAlloc(gHeap, HEAP_ZERO_MEMORY, sizeof(HTArena));
+  if (!arena)
+    return nullptr;
+  region = (u08 *)VirtualAlloc(
+    nullptr,
+    reserveSize,
+    MEM_RESERVE,
+    PAGE_NOACCESS);
+  if (!region) {
+    HeapFree(gHeap, 0, arena);
+    return nullptr;
+  }
+
+  arena->magic = ARENA_MAGIC;
+  arena->owner = hModule;
+  InitializeSRWLock(&arena->lock);
+  arena->region = region;
+  arena->end = region + reserveSize;
+  arena->top = region;
+  arena->committed = region;
+
+  AcquireSRWLockExclusive(&gArenaLock);
+  arena->next = gArenas;
+  if (gArenas)
+    gArenas->prev = arena;
+  gArenas = arena;
+  ReleaseSRWLockExclusive(&gArenaLock);
+
+  return arena;
+}
+
+HTMLAPI void *HTArenaAlloc(
+  HTArena *arena,
+  u64 size
+) {
+  u08 *top, *newTop;
+  LONG64 live, peak;
+
+  if (!arena)
+    return nullptr;
+
+  AcquireSRWLockShared(&arena->lock);
+  if (
+    arena->magic != ARENA_MAGIC
+    || size > (u64)(arena->end - arena->region)
+  ) {
+    ReleaseSRWLockShared(&arena->lock);
+    return nullptr;
+  }
+  size = (size + 15) & ~15ULL;
+
+  do {
+    top = arena->top;
+    if ((u64)(arena->end - top) < size) {
+      ReleaseSRWLockShared(&arena->lock);
+      return nullptr;
+    }
+    newTop = top + size;
+  } while (
+    InterlockedCompareExchangePointer(
+      (PVOID volatile *)&arena->top,
+      newTop,
+      top) != top
+  );
+
+  if (!commitArena(arena, newTop)) {
+    // Give the space back unless later blocks are allocated.
+    InterlockedCompareExchangePointer(
+      (PVOID volatile *)&arena->top,
+      top,
+      newTop);
+    ReleaseSRWLockShared(&arena->lock);
+    return nullptr;
+  }
+
+  live = InterlockedAdd64(&arena->liveBytes, (LONG64)size);
+  while ((peak = arena->peakBytes) < live)
+    if (InterlockedCompareExchange64(&arena->peakBytes, live, peak) == peak)
+      break;
+  InterlockedIncrement64(&arena->allocCount);
+  InterlockedIncrement64(&arena->totalAllocs);
+  ReleaseSRWLockShared(&arena->lock);
+
+  return top;
+}
+
+HTMLAPI HTStatus HTArenaReset(
+  HTArena *arena
+) {
+  AcquireSRWLockShared(&gArenaLock);
+  if (!findArena(arena)) {
+    ReleaseSRWLockShared(&gArenaLock);
+    return HT_FAIL;
+  }
+
+  // Waits for allocations in progress.
+  AcquireSRWLockExclusive(&arena->lock);
+  arena->top = arena->region;
+  arena->liveBytes = 0;
+  arena->allocCount = 0;
+  ReleaseSRWLockExclusive(&arena->lock);
+  ReleaseSRWLockShared(&gArenaLock);
+
+  return HT_SUCCESS;
+}
+
+HTMLAPI HTStatus HTArenaDestroy(
+  HTArena *arena
+) {
+  AcquireSRWLockExclusive(&gArenaLock);
+  if (!findArena(arena)) {
+    ReleaseSRWLockExclusive(&gArenaLock);
+    return HT_FAIL;
+  }
+
+  if (arena->prev)
+    arena->prev->next = arena->next;
+  else
+    gArenas = arena->next;
+  if (arena->next)
+    arena->next->prev = arena->prev;
+  ReleaseSRWLockExclusive(&gArenaLock);
+
+  // The header is kept so that later calls with the handle fail safely.
+  AcquireSRWLockExclusive(&arena->lock);
+  arena->magic = 0;
+  VirtualFree(arena->region, 0, MEM_RELEASE);
+  arena->region = arena->end = arena->top = arena->committed = nullptr;
+  arena->prev = arena->next = nullptr;
+  ReleaseSRWLockExclusive(&arena->lock);
+
+  return HT_SUCCESS;
+}
+
+/**
+ * Copy the usage of the arena, the lock must be held.
+ */
+static void getArenaStats(HTArena *arena, HTArenaStats *stats) {
+  stats->owner = arena->owner;
+  stats->reserved = (u64)(arena->end - arena->region);
+  stats->committed = (u64)(arena->committed - arena->region);
+  stats->liveBytes = (u64)arena->liveBytes;
+  stats->peakBytes = (u64)arena->peakBytes;
+  stats->allocCount = (u64)arena->allocCount;
+  stats->totalAllocs = (u64)arena->totalAllocs;
+}
+
+HTMLAPI HTStatus HTArenaGetStats(
+  HTArena *arena,
+  HTArenaStats *stats
+) {
+  if (!stats)
+    return HT_FAIL;
+
+  AcquireSRWLockShared(&gArenaLock);
+  if (!findArena(arena)) {
+    ReleaseSRWLockShared(&gArenaLock);
+    return HT_FAIL;
+  }
+  getArenaStats(arena, stats);
+  ReleaseSRWLockShared(&gArenaLock);
+
+  return HT_SUCCESS;
+}
+
+u32 memArenaUsage(HMODULE module, HTArenaStats *total) {
+  HTArenaStats stats;
+  u32 count = 0;
+
+  memset(total, 0, sizeof(HTArenaStats));
+  total->owner = module;
+
+  AcquireSRWLockShared(&gArenaLock);
+  for (HTArena *it = gArenas; it; it = it->next) {
+    if (it->owner != module)
+      continue;
+    getArenaStats(it, &stats);
+    total->reserved += stats.reserved;
+    total->committed += stats.committed;
+    total->liveBytes += stats.liveBytes;
+    total->peakBytes += stats.peakBytes;
+    total->allocCount += stats.allocCount;
+    total->totalAllocs += stats.totalAllocs;
+    count++;
+  }
+  ReleaseSRWLockShared(&gArenaLock);
+
+  return count;
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Frame scratch APIs.
+// ----------------------------------------------------------------------------
+
+void memFrameAdvance() {
+  // Buffers are rewound by their threads on the next allocation.
+  InterlockedIncrement64(&gFrameIndex);
+}
+
+HTMLAPI void *HTFrameAlloc(
+  u64 size
+) {
+  MemCache *cache;
+  u64 frame, slot, top, committed;
+  u08 *buffer;
+
+  if (
+    size > MEM_FRAME_RESERVE
+    || !InitOnceExecuteOnce(&gInitOnce, initMem, nullptr, nullptr)
+  )
+    return nullptr;
+  cache = getCache();
+  if (!cache)
+    return nullptr;
+  if (!cache->scratch) {
+    cache->scratch = (u08 *)VirtualAlloc(
+      nullptr,
+      MEM_FRAME_RESERVE * HT_FRAME_BUFFERS,
+      MEM_RESERVE,
+      PAGE_NOACCESS);
+    if (!cache->scratch)
+      return nullptr;
+  }
+
+  frame = (u64)gFrameIndex;
+  slot = frame % HT_FRAME_BUFFERS;
+  if (cache->scratchFrames[slot] != frame) {
+    cache->scratchFrames[slot] = frame;
+    cache->scratchTop[slot] = 0;
+  }
+
+  size = (size + 15) & ~15ULL;
+  top = cache->scratchTop[slot];
+  if (size > MEM_FRAME_RESERVE - top)
+    return nullptr;
+
+  buffer = cache->scratch + slot * MEM_FRAME_RESERVE;
+  if (top + size > cache->scratchCommitted[slot]) {
+    committed = (top + size + MEM_SLAB_SIZE - 1) & ~(u64)(MEM_SLAB_SIZE - 1);
+    if (
+      !VirtualAlloc(
+        buffer + cache->scratchCommitted[slot],
+        committed - cache->scratchCommitted[slot],
+        MEM_COMMIT,
+        PAGE_READWRITE)
+    )
+      return nullptr;
+    cache->scratchCommitted[slot] = committed;
+  }
+  cache->scratchTop[slot] = top + size;
+
+  return buffer + top;
+}
+
+HTMLAPI u64 HTFrameGetIndex(
+  void
+) {
+  return (u64)gFrameIndex;
+}
@@ -0,0 +1,35 @@
+#ifndef __MEM_H__
+#define __MEM_H__
+
+#include <windows.h>
+#include "aliases.h"
+#include "htmodloader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Hand the slabs of the exiting thread over to other threads and release
+ * its frame scratch buffers. Called on DLL_THREAD_DETACH.
+ */
+void memThreadDetach();
+
+/**
+ * Sum up the usage of arenas owned by the module into `total`. Returns the
+ * number of the arenas.
+ */
+u32 memArenaUsage(
+  HMODULE module, HTArenaStats *total);
+
+/**
+ * Move frame scratch allocations to the next buffer, called once per
+ * present after the frame's fence has signaled.
+ */
+void memFrameAdvance();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,219 @@
+// ----------------------------------------------------------------------------
+// Mid-function hook stubs of HT's Mod Loader.
+//
+// A mid-function hook is an ordinary link in the hook chain of its address,
+// whose detour is a generated stub. MinHook relocates the overwritten
+// instructions into the trampoline with hde64, so the stub only has to save
+// the register context, call the mod callback and jump to the next link
+// with the context restored. Stubs are allocated in pages like thunks, with
+// their code written once and their data kept on the page after.
+// ----------------------------------------------------------------------------
+#include <windows.h>
+
+#include "aliases.h"
+#include "htmodloader.h"
+#include "api/midhook.h"
+
+#define MIDHOOK_PAGE_SIZE 0x1000
+#define MIDHOOK_STUB_SIZE 256
+#define MIDHOOK_PER_PAGE (MIDHOOK_PAGE_SIZE / MIDHOOK_STUB_SIZE)
+
+// Data of a stub, read with rip-relative operands.
+typedef struct {
+  PFN_HTMidHookCallback callback;
+  void *user;
+  void *volatile next;
+} MidHookData;
+
+// Current stub page, linked stubs are never freed since a thread may still
+// be running through them.
+static u08 *gStubPage = NULL;
+static u32 gStubNext = MIDHOOK_PER_PAGE;
+// Stubs released before being linked, chained by their `user` field.
+static MidHookData *gStubFree = NULL;
+
+static u08 *emit(u08 *p, const void *bytes, u32 len) {
+  memcpy(p, bytes, len);
+  return p + len;
+}
+
+/**
+ * Emit an instruction with a rip-relative operand to `target`, whose disp32
+ * is the last 4 bytes.
+ */
+static u08 *emitRel(u08 *p, const void *op, u32 len, const void *target) {
+  i32 disp = (i32)((const u08 *)target - (p + len + 4));
+
+  p = emit(p, op, len);
+  return emit(p, &disp, sizeof(disp));
+}
+
+/**
+ * Generate the stub reading its data from `data`.
+ *
+ * The context is built on the stack below the hooked code's rsp, since x64
+ * code on Windows has no red zone. Its layout matches HTRegisterContext:
+ * the general purpose registers are pushed in reverse order, then xmm0-5
+ * are stored below them. The callback gets 32 bytes of shadow space on a
+ * 16-byte aligned stack.
+ */
+static void emitStub(u08 *p, MidHookData *data) {
+  static const u08 save[] = {
+    0x9C,                               // pushfq
+    0x41, 0x57,                         // push r15
+    0x41, 0x56,                         // push r14
+    0x41, 0x55,                         // push r13
+    0x41, 0x54,                         // push r12
+    0x41, 0x53,                         // push r11
+    0x41, 0x52,                         // push r10
+    0x41, 0x51,                         // push r9
+    0x41, 0x50,                         // push r8
+    0x57,                               // push rdi
+    0x56,                               // push rsi
+    0x55,                               // push rbp
+    0x54,                               // push rsp, replaced below
+    0x53,                               // push rbx
+    0x52,                               // push rdx
+    0x51,                               // push rcx
+    0x50,                               // push rax
+    0x48, 0x83, 0xEC, 0x60,             // sub rsp, 0x60
+    0xF3, 0x0F, 0x7F, 0x04, 0x24,       // movdqu [rsp], xmm0
+    0xF3, 0x0F, 0x7F, 0x4C, 0x24, 0x10, // movdqu [rsp + 0x10], xmm1
+    0xF3, 0x0F, 0x7F, 0x54, 0x24, 0x20, // movdqu [rsp + 0x20], xmm2
+    0xF3, 0x0F, 0x7F, 0x5C, 0x24, 0x30, // movdqu [rsp + 0x30], xmm3
+    0xF3, 0x0F, 0x7F, 0x64, 0x24, 0x40, // movdqu [rsp + 0x40], xmm4
+    0xF3, 0x0F, 0x7F, 0x6C, 0x24, 0x50, // movdqu [rsp + 0x50], xmm5
+    // lea rax, [rsp + 0xE8], rsp of the hooked code.
+    0x48, 0x8D, 0x84, 0x24, 0xE8, 0x00, 0x00, 0x00,
+    // mov [rsp + 0x80], rax
+    0x48, 0x89, 0x84, 0x24, 0x80, 0x00, 0x00, 0x00,
+    0x48, 0x89, 0xE3,                   // mov rbx, rsp
+    0x48, 0x83, 0xE4, 0xF0,             // and rsp, -16
+    0x48, 0x83, 0xEC, 0x20,             // sub rsp, 0x20
+    0x48, 0x89, 0xD9,                   // mov rcx, rbx
+    0xFC,                               // cld
+  };
+  static const u08 restore[] = {
+    0x48, 0x89, 0xDC,                   // mov rsp, rbx
+    0xF3, 0x0F, 0x6F, 0x04, 0x24,       // movdqu xmm0, [rsp]
+    0xF3, 0x0F, 0x6F, 0x4C, 0x24, 0x10, // movdqu xmm1, [rsp + 0x10]
+    0xF3, 0x0F, 0x6F, 0x54, 0x24, 0x20, // movdqu xmm2, [rsp + 0x20]
+    0xF3, 0x0F, 0x6F, 0x5C, 0x24, 0x30, // movdqu xmm3, [rsp + 0x30]
+    0xF3, 0x0F, 0x6F, 0x64, 0x24, 0x40, // movdqu xmm4, [rsp + 0x40]
+    0xF3, 0x0F, 0x6F, 0x6C, 0x24, 0x50, // movdqu xmm5, [rsp + 0x50]
+    0x48, 0x83, 0xC4, 0x60,             // add rsp, 0x60
+    0x58,                               // pop rax
+    0x59,                               // pop rcx
+    0x5A,                               // pop rdx
+    0x5B,                               // pop rbx
+    0x48, 0x8D, 0x64, 0x24, 0x08,       // lea rsp, [rsp + 8]
+    0x5D,                               // pop rbp
+    0x5E,                               // pop rsi
+    0x5F,                               // pop rdi
+    0x41, 0x58,                         // pop r8
+    0x41, 0x59,                         // pop r9
+    0x41, 0x5A,                         // pop r10
+    0x41, 0x5B,                         // pop r11
+    0x41, 0x5C,                         // pop r12
+    0x41, 0x5D,                         // pop r13
+    0x41, 0x5E,                         // pop r14
+    0x41, 0x5F,                         // pop r15
+    0x9D,                               // popfq
+  };
+
+  p = emit(p, save, sizeof(save));
+  // mov rdx, [rip + user]
+  p = emitRel(p, "\x48\x8B\x15", 3, &data->user);
+  // call [rip + callback]
+  p = emitRel(p, "\xFF\x15", 2, &data->callback);
+  p = emit(p, restore, sizeof(restore));
+  // jmp [rip + next]
+  emitRel(p, "\xFF\x25", 2, (const void *)&data->next);
+}
+
+/**
+ * Get the data of a stub, the data page follows the code page.
+ */
+static MidHookData *stubData(void *stub) {
+  u64 offset = (u64)stub & (MIDHOOK_PAGE_SIZE - 1);
+  u08 *page = (u08 *)stub - offset;
+
+  return (MidHookData *)(page + MIDHOOK_PAGE_SIZE)
+    + offset / MIDHOOK_STUB_SIZE;
+}
+
+/**
+ * Get the stub of its data.
+ */
+static void *dataStub(MidHookData *data) {
+  u64 offset = (u64)data & (MIDHOOK_PAGE_SIZE - 1);
+  u08 *page = (u08 *)data - offset - MIDHOOK_PAGE_SIZE;
+
+  return page + offset / sizeof(MidHookData) * MIDHOOK_STUB_SIZE;
+}
+
+void *midHookCreate(
+  PFN_HTMidHookCallback callback,
+  void *user,
+  void *volatile **next
+) {
+  MidHookData *data;
+  DWORD protect;
+  u08 *page;
+
+  if (gStubFree) {
+    // Reuse a stub that never got linked.
+    data = gStubFree;
+    gStubFree = (MidHookData *)data->user;
+    data->callback = callback;
+    data->user = user;
+    data->next = NULL;
+    *next = &data->next;
+    return dataStub(data);
+  }
+
+  if (gStubNext == MIDHOOK_PER_PAGE) {
+    page = (u08 *)VirtualAlloc(
+      NULL,
+      MIDHOOK_PAGE_SIZE * 2,
+      MEM_COMMIT | MEM_RESERVE,
+      PAGE_READWRITE);
+    if (!page)
+      return NULL;
+
+    memset(page, 0xCC, MIDHOOK_PAGE_SIZE);
+    for (u32 i = 0; i < MIDHOOK_PER_PAGE; i++)
+      emitStub(
+        page + i * MIDHOOK_STUB_SIZE,
+        (MidHookData *)(page + MIDHOOK_PAGE_SIZE) + i);
+
+    if (!VirtualProtect(page, MIDHOOK_PAGE_SIZE, PAGE_EXECUTE_READ, &protect)) {
+      VirtualFree(page, 0, MEM_RELEASE);
+      return NULL;
+    }
+    FlushInstructionCache(GetCurrentProcess(), page, MIDHOOK_PAGE_SIZE);
+
+    gStubPage = page;
+    gStubNext = 0;
+  }
+
+  data = (MidHookData *)(gStubPage + MIDHOOK_PAGE_SIZE) + gStubNext;
+  data->callback = callback;
+  data->user = user;
+  *next = &data->next;
+
+  return gStubPage + gStubNext++ * MIDHOOK_STUB_SIZE;
+}
+
+void midHookFree(void *stub) {
+  MidHookData *data;
+
+  if (!stub)
+    return;
+
+  data = stubData(stub);
+  data->callback = NULL;
+  data->next = NULL;
+  data->user = gStubFree;
+  gStubFree = data;
+}
@@ -0,0 +1,31 @@
+#ifndef __MIDHOOK_H__
+#define __MIDHOOK_H__
+
+#include "aliases.h"
+#include "htmodloader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Generate the stub of a mid-function hook. The stub saves the registers,
+ * calls `callback` with them, restores them and jumps to `*next`, which is
+ * set by the caller once the stub is linked. The hook lock must be held.
+ * Returns NULL if out of memory.
+ */
+void *midHookCreate(
+  PFN_HTMidHookCallback callback, void *user, void *volatile **next);
+
+/**
+ * Release a stub that failed to be linked, so it can be reused. Linked stubs
+ * must never be released. The hook lock must be held.
+ */
+void midHookFree(
+  void *stub);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
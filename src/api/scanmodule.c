@@ -0,0 +1,462 @@
+// ----------------------------------------------------------------------------
+// Module layout cache of HT's Mod Loader.
+//
+// The section table, memory protections and imports of a module are only
+// queried once, then scanners select their ranges from the cached layout.
+// Layouts of modules other than Sky.exe are checked against the loaded image
+// on every lookup, since they may be unloaded and another module loaded at
+// the same base.
+// ----------------------------------------------------------------------------
+#include <windows.h>
+
+#include "aliases.h"
+#include "htmodloader.h"
+#include "api/scanmodule.h"
+
+/**
+ * Get the next committed and readable memory region in [*cursor, end), and
+ * move the cursor behind it.
+ */
+static i32 nextScanRegion(
+  u08 **cursor,
+  u08 *end,
+  u08 **regionBegin,
+  u08 **regionEnd
+) {
+  MEMORY_BASIC_INFORMATION mbi;
+  u08 *blockEnd;
+
+  while (*cursor < end) {
+    if (!VirtualQuery(*cursor, &mbi, sizeof(mbi)))
+      return 0;
+
+    blockEnd = (u08 *)mbi.BaseAddress + mbi.RegionSize;
+    if (blockEnd > end)
+      blockEnd = end;
+    *cursor = blockEnd;
+
+    if (
+      mbi.State == MEM_COMMIT
+      && (mbi.Protect & (
+        PAGE_READONLY
+        | PAGE_READWRITE
+        | PAGE_EXECUTE_READ
+        | PAGE_EXECUTE_READWRITE
+      ))
+    ) {
+      *regionBegin = (u08 *)mbi.BaseAddress;
+      *regionEnd = blockEnd;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static SRWLOCK gModuleLock = SRWLOCK_INIT;
+// Layout of Sky.exe, parsed on first scan.
+static ScanModule *gSkyModule = NULL;
+// Layouts of other modules, newest first. Outdated layouts are kept in the
+// list, as scanners may still be using them.
+static ScanModule *gModules = NULL;
+
+/**
+ * Append readable regions of [begin, end) to the range list of the module.
+ */
+static i32 addModuleRanges(
+  ScanModule *module,
+  u08 *begin,
+  u08 *end,
+  i32 section,
+  u32 *capacity
+) {
+  u08 *cursor = begin, *regionBegin, *regionEnd;
+  ScanRange *p;
+
+  while (nextScanRegion(&cursor, end, &regionBegin, &regionEnd)) {
+    if (regionBegin < begin)
+      regionBegin = begin;
+    if (module->rangeCount == *capacity) {
+      *capacity = *capacity ? *capacity * 2 : 32;
+      p = (ScanRange *)realloc(module->ranges, *capacity * sizeof(ScanRange));
+      if (!p)
+        return 0;
+      module->ranges = p;
+    }
+    module->ranges[module->rangeCount].begin = regionBegin;
+    module->ranges[module->rangeCount].end = regionEnd;
+    module->ranges[module->rangeCount].section = section;
+    module->rangeCount++;
+  }
+
+  return 1;
+}
+
+/**
+ * Collect the imports of the module from its import directory. Descriptors
+ * without a lookup table are skipped, since their names are overwritten by
+ * the bound addresses.
+ */
+static i32 addModuleImports(
+  ScanModule *module,
+  PIMAGE_NT_HEADERS ntHeaders
+) {
+  PIMAGE_DATA_DIRECTORY directory;
+  PIMAGE_IMPORT_DESCRIPTOR descriptor;
+  PIMAGE_THUNK_DATA lookup;
+  PIMAGE_IMPORT_BY_NAME byName;
+  ScanImport *p, *import;
+  void **entry;
+  u32 capacity = 0;
+
+  directory = &ntHeaders->OptionalHeader.DataDirectory[
+    IMAGE_DIRECTORY_ENTRY_IMPORT];
+  if (!directory->VirtualAddress || !directory->Size)
+    return 1;
+
+  descriptor = (PIMAGE_IMPORT_DESCRIPTOR)(
+    module->begin + directory->VirtualAddress);
+  for (; descriptor->Name; descriptor++) {
+    if (!descriptor->OriginalFirstThunk || !descriptor->FirstThunk)
+      continue;
+
+    lookup = (PIMAGE_THUNK_DATA)(
+      module->begin + descriptor->OriginalFirstThunk);
+    entry = (void **)(module->begin + descriptor->FirstThunk);
+    for (; lookup->u1.AddressOfData; lookup++, entry++) {
+      if (module->importCount == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        p = (ScanImport *)realloc(
+          module->imports,
+          capacity * sizeof(ScanImport));
+        if (!p)
+          return 0;
+        module->imports = p;
+      }
+
+      import = &module->imports[module->importCount++];
+      import->dll = (const char *)module->begin + descriptor->Name;
+      import->entry = entry;
+      if (IMAGE_SNAP_BY_ORDINAL(lookup->u1.Ordinal)) {
+        import->name = NULL;
+        import->ordinal = (u32)IMAGE_ORDINAL(lookup->u1.Ordinal);
+      } else {
+        byName = (PIMAGE_IMPORT_BY_NAME)(
+          module->begin + lookup->u1.AddressOfData);
+        import->name = (const char *)byName->Name;
+        import->ordinal = 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Parse the section table of the module, and collect the readable ranges of
+ * every section. Memory protections are only queried once here.
+ */
+static ScanModule *loadScanModule(HMODULE handle) {
+  PIMAGE_DOS_HEADER dosHeader;
+  PIMAGE_NT_HEADERS ntHeaders;
+  PIMAGE_SECTION_HEADER sectionHeader;
+  ScanModule *module;
+  u08 *begin, *end;
+  u32 capacity = 0
+    , alignment
+    , size;
+
+  if (!handle)
+    return NULL;
+
+  module = (ScanModule *)calloc(1, sizeof(ScanModule));
+  if (!module)
+    return NULL;
+
+  dosHeader = (PIMAGE_DOS_HEADER)handle;
+  ntHeaders = (PIMAGE_NT_HEADERS)((u08 *)handle + dosHeader->e_lfanew);
+  sectionHeader = IMAGE_FIRST_SECTION(ntHeaders);
+  alignment = ntHeaders->OptionalHeader.SectionAlignment;
+  if (!alignment)
+    alignment = 0x1000;
+
+  module->handle = handle;
+  module->timestamp = ntHeaders->FileHeader.TimeDateStamp;
+  module->begin = (u08 *)handle;
+  module->end = module->begin + ntHeaders->OptionalHeader.SizeOfImage;
+  module->sectionCount = ntHeaders->FileHeader.NumberOfSections;
+  module->sections = (ScanSection *)calloc(
+    module->sectionCount + 1, sizeof(ScanSection));
+  if (!module->sections)
+    goto FAIL;
+
+  // PE headers.
+  end = module->begin + ntHeaders->OptionalHeader.SizeOfHeaders;
+  if (!addModuleRanges(module, module->begin, end, -1, &capacity))
+    goto FAIL;
+
+  for (u32 i = 0; i < module->sectionCount; i++) {
+    memcpy(
+      module->sections[i].name,
+      sectionHeader[i].Name,
+      IMAGE_SIZEOF_SHORT_NAME);
+    module->sections[i].characteristics = sectionHeader[i].Characteristics;
+
+    // Sections are contiguous in memory once aligned.
+    size = sectionHeader[i].Misc.VirtualSize;
+    if (size < sectionHeader[i].SizeOfRawData)
+      size = sectionHeader[i].SizeOfRawData;
+    size = (size + alignment - 1) / alignment * alignment;
+    begin = module->begin + sectionHeader[i].VirtualAddress;
+    end = begin + size;
+    if (end > module->end)
+      end = module->end;
+    if (begin >= end)
+      continue;
+
+    if (!addModuleRanges(module, begin, end, (i32)i, &capacity))
+      goto FAIL;
+  }
+
+  if (!addModuleImports(module, ntHeaders))
+    goto FAIL;
+
+  return module;
+
+FAIL:
+  free(module->sections);
+  free(module->ranges);
+  free(module->imports);
+  free(module);
+  return NULL;
+}
+
+ScanModule *scanModuleGetSky() {
+  ScanModule *module;
+
+  AcquireSRWLockShared(&gModuleLock);
+  module = gSkyModule;
+  ReleaseSRWLockShared(&gModuleLock);
+  if (module)
+    return module;
+
+  AcquireSRWLockExclusive(&gModuleLock);
+  if (!gSkyModule)
+    gSkyModule = loadScanModule(GetModuleHandleA("Sky.exe"));
+  module = gSkyModule;
+  ReleaseSRWLockExclusive(&gModuleLock);
+
+  return module;
+}
+
+/**
+ * Check if `handle` is the base of a loaded module.
+ */
+static i32 isModuleLoaded(HMODULE handle) {
+  HMODULE owner;
+
+  return GetModuleHandleExA(
+      GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS
+      | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+      (LPCSTR)handle,
+      &owner)
+    && owner == handle;
+}
+
+/**
+ * Check if the cached layout still describes the module loaded at its base.
+ */
+static i32 isModuleCurrent(const ScanModule *module) {
+  PIMAGE_DOS_HEADER dosHeader;
+  PIMAGE_NT_HEADERS ntHeaders;
+  HMODULE handle = module->handle;
+
+  if (!isModuleLoaded(handle))
+    return 0;
+
+  dosHeader = (PIMAGE_DOS_HEADER)handle;
+  ntHeaders = (PIMAGE_NT_HEADERS)((u08 *)handle + dosHeader->e_lfanew);
+  return ntHeaders->FileHeader.TimeDateStamp == module->timestamp
+    && module->begin + ntHeaders->OptionalHeader.SizeOfImage == module->end;
+}
+
+/**
+ * Find the current layout of the module in the list, the lock must be held.
+ */
+static ScanModule *findModule(HMODULE handle) {
+  for (ScanModule *module = gModules; module; module = module->next)
+    if (module->handle == handle)
+      // Only the newest layout of a base can be current.
+      return module->outdated ? NULL : module;
+
+  return NULL;
+}
+
+ScanModule *scanModuleGet(HMODULE handle) {
+  ScanModule *module, *sky;
+
+  if (!handle)
+    return scanModuleGetSky();
+  sky = scanModuleGetSky();
+  if (sky && sky->handle == handle)
+    return sky;
+
+  AcquireSRWLockShared(&gModuleLock);
+  module = findModule(handle);
+  ReleaseSRWLockShared(&gModuleLock);
+  if (module && isModuleCurrent(module))
+    return module;
+
+  AcquireSRWLockExclusive(&gModuleLock);
+  module = findModule(handle);
+  if (module && !isModuleCurrent(module)) {
+    module->outdated = 1;
+    module = NULL;
+  }
+  if (!module && isModuleLoaded(handle)) {
+    module = loadScanModule(handle);
+    if (module) {
+      module->next = gModules;
+      gModules = module;
+    }
+  }
+  ReleaseSRWLockExclusive(&gModuleLock);
+
+  return module;
+}
+
+/**
+ * Compare DLL names case-insensitively, `name` may omit the extension.
+ */
+static i32 isDllName(const char *imported, const char *name) {
+  size_t len = strlen(name);
+
+  return !_strnicmp(imported, name, len)
+    && (!imported[len] || !_stricmp(imported + len, ".dll"));
+}
+
+void **scanModuleFindImport(
+  const ScanModule *module,
+  const char *dll,
+  const char *symbol
+) {
+  const ScanImport *import;
+
+  if (!module || !dll || !symbol)
+    return NULL;
+
+  for (u32 i = 0; i < module->importCount; i++) {
+    import = &module->imports[i];
+    if (!isDllName(import->dll, dll))
+      continue;
+    if (
+      IS_INTRESOURCE(symbol)
+        ? !import->name && import->ordinal == (u32)(u64)symbol
+        : import->name && !strcmp(import->name, symbol)
+    )
+      return import->entry;
+  }
+
+  return NULL;
+}
+
+/**
+ * Check if the section is selected by the section filter. NULL selects
+ * executable sections, and HT_SECTION_ANY selects everything.
+ */
+static i32 isSectionSelected(
+  const ScanModule *module,
+  i32 section,
+  const char *filter
+) {
+  if (filter && !strcmp(filter, HT_SECTION_ANY))
+    return 1;
+  if (section < 0)
+    return 0;
+  if (!filter)
+    return !!(module->sections[section].characteristics & IMAGE_SCN_MEM_EXECUTE);
+  return !strcmp(module->sections[section].name, filter);
+}
+
+i32 scanModuleSelect(
+  const ScanModule *module,
+  const char *filter,
+  ScanTarget *target
+) {
+  ScanRange *last = NULL;
+
+  target->base = module->begin;
+  target->count = 0;
+  target->ranges = (ScanRange *)malloc(
+    (module->rangeCount + 1) * sizeof(ScanRange));
+  if (!target->ranges)
+    return 0;
+
+  for (u32 i = 0; i < module->rangeCount; i++) {
+    if (!isSectionSelected(module, module->ranges[i].section, filter))
+      continue;
+    if (last && last->end == module->ranges[i].begin) {
+      // Merged, so signatures crossing section borders can still be found.
+      last->end = module->ranges[i].end;
+      continue;
+    }
+    last = &target->ranges[target->count++];
+    *last = module->ranges[i];
+  }
+
+  return target->count > 0;
+}
+
+i32 scanTargetContains(const ScanTarget *target, const u08 *ptr, u64 size) {
+  for (u32 i = 0; i < target->count; i++)
+    if (
+      ptr >= target->ranges[i].begin
+      && ptr < target->ranges[i].end
+    )
+      return size <= (u64)(target->ranges[i].end - ptr);
+
+  return 0;
+}
+
+i32 scanTargetFromRange(
+  const void *begin,
+  const void *end,
+  ScanTarget *target
+) {
+  u08 *cursor = (u08 *)begin, *regionBegin, *regionEnd;
+  u32 capacity = 0;
+  ScanRange *p, *last = NULL;
+
+  target->base = (u08 *)begin;
+  target->ranges = NULL;
+  target->count = 0;
+  if (!begin || end <= begin)
+    return 0;
+
+  while (nextScanRegion(&cursor, (u08 *)end, &regionBegin, &regionEnd)) {
+    if (regionBegin < (u08 *)begin)
+      regionBegin = (u08 *)begin;
+    if (last && last->end == regionBegin) {
+      // Adjacent regions with different protections.
+      last->end = regionEnd;
+      continue;
+    }
+    if (target->count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      p = (ScanRange *)realloc(target->ranges, capacity * sizeof(ScanRange));
+      if (!p) {
+        free(target->ranges);
+        target->ranges = NULL;
+        target->count = 0;
+        return 0;
+      }
+      target->ranges = p;
+    }
+    last = &target->ranges[target->count++];
+    last->begin = regionBegin;
+    last->end = regionEnd;
+    last->section = -1;
+  }
+
+  return target->count > 0;
+}
@@ -0,0 +1,109 @@
+#ifndef __SCANMODULE_H__
+#define __SCANMODULE_H__
+
+#include <windows.h>
+#include "aliases.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Readable memory range of a module.
+typedef struct {
+  u08 *begin;
+  u08 *end;
+  // Index of the section containing the range, -1 for the PE headers.
+  i32 section;
+} ScanRange;
+
+// PE section of a module.
+typedef struct {
+  char name[IMAGE_SIZEOF_SHORT_NAME + 1];
+  u32 characteristics;
+} ScanSection;
+
+// Import of a module.
+typedef struct {
+  // Name of the imported DLL, in the import directory of the module.
+  const char *dll;
+  // Imported name, NULL if imported by ordinal.
+  const char *name;
+  u32 ordinal;
+  // Entry in the import address table.
+  void **entry;
+} ScanImport;
+
+// Cached layout of a module.
+typedef struct ScanModule {
+  HMODULE handle;
+  // Timestamp in the PE header, to tell modules loaded at the same base.
+  u32 timestamp;
+  // Set once the module is unloaded or replaced.
+  i32 outdated;
+  struct ScanModule *next;
+  u08 *begin;
+  u08 *end;
+  ScanSection *sections;
+  u32 sectionCount;
+  // Readable ranges of all sections in address order.
+  ScanRange *ranges;
+  u32 rangeCount;
+  // Imports in the order of the import directory, delay-loaded imports are
+  // not included.
+  ScanImport *imports;
+  u32 importCount;
+} ScanModule;
+
+// Ranges selected for a scan.
+typedef struct {
+  u08 *base;
+  ScanRange *ranges;
+  u32 count;
+} ScanTarget;
+
+/**
+ * Get the cached layout of Sky.exe, it's parsed on first call.
+ */
+ScanModule *scanModuleGetSky();
+
+/**
+ * Get the cached layout of a loaded module, parsed on first call or when the
+ * module is reloaded. NULL gets Sky.exe. Returns NULL if it's not a module.
+ */
+ScanModule *scanModuleGet(
+  HMODULE handle);
+
+/**
+ * Find the import address table entry of `symbol` from `dll`. The DLL name
+ * is case-insensitive and ".dll" may be omitted. `symbol` may be an ordinal
+ * like in GetProcAddress(). Returns NULL if the module doesn't import it.
+ */
+void **scanModuleFindImport(
+  const ScanModule *module, const char *dll, const char *symbol);
+
+/**
+ * Select the ranges of the module to be scanned with the section filter.
+ * NULL selects executable sections, and HT_SECTION_ANY selects everything.
+ * Adjacent ranges are merged. `target->ranges` must be freed by the caller.
+ */
+i32 scanModuleSelect(
+  const ScanModule *module, const char *filter, ScanTarget *target);
+
+/**
+ * Select the readable regions in [begin, end), e.g. JIT code or heap blocks.
+ * `target->ranges` must be freed by the caller.
+ */
+i32 scanTargetFromRange(
+  const void *begin, const void *end, ScanTarget *target);
+
+/**
+ * Check if [ptr, ptr + size) is inside the selected ranges.
+ */
+i32 scanTargetContains(
+  const ScanTarget *target, const u08 *ptr, u64 size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,480 @@
+// ----------------------------------------------------------------------------
+// Persistent signature scan result cache of HT's Mod Loader.
+//
+// Scan results of Sky.exe are saved as RVAs in `htmods\sigcache.bin`. The
+// file is keyed by a fingerprint of the PE headers, so RVAs are discarded
+// once the game is updated. Snapshots of matched bytes are kept across
+// updates, they're used to find the signatures broken by the update.
+// ----------------------------------------------------------------------------
+#include <windows.h>
+#include <stdio.h>
+
+#include "aliases.h"
+#include "globals.h"
+#include "htmodloader.h"
+#include "api/sigcache.h"
+
+#define SIGCACHE_MAGIC 0x43535448
+#define SIGCACHE_VERSION 4
+#define SIGCACHE_FILE L"\\sigcache.bin"
+
+// Header of the cache file.
+typedef struct {
+  u32 magic;
+  u32 version;
+  // Fingerprint of the executable.
+  u64 fingerprint;
+  // Number of entries followed.
+  u32 count;
+  // Number of snapshots followed behind the entries.
+  u32 snapshots;
+} SigCacheHeader;
+
+// Cache entry, also the on-disk format.
+typedef struct {
+  // Hash of the signature, 0 for empty slots.
+  u64 key;
+  // RVA of the signature match.
+  u32 rva;
+  u32 reserved;
+} SigCacheEntry;
+
+// Bytes at the match of a signature, also the on-disk format.
+typedef struct {
+  u64 key;
+  u32 len;
+  u32 reserved;
+  u08 bytes[SIGCACHE_SNAPSHOT_LEN];
+} SigCacheSnapshot;
+
+// Open addressing hash table, keyed by the first u64 of every entry and 0
+// marks empty slots.
+typedef struct {
+  u08 *entries;
+  u32 stride;
+  u32 capacity;
+  u32 count;
+} SigCacheTable;
+
+static SRWLOCK gLock = SRWLOCK_INIT;
+static i32 gLoaded = 0
+  , gDirty = 0;
+static u64 gFingerprint = 0;
+static SigCacheTable gEntries = {NULL, sizeof(SigCacheEntry), 0, 0}
+  , gSnapshots = {NULL, sizeof(SigCacheSnapshot), 0, 0};
+
+/**
+ * FNV-1a hash.
+ */
+static u64 fnv1a(u64 hash, const void *data, u64 size) {
+  const u08 *p = (const u08 *)data;
+  for (u64 i = 0; i < size; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+/**
+ * Calculate the fingerprint of Sky.exe with its timestamp, checksum, image
+ * size and section table. The rest of the headers is skipped, the loader
+ * rewrites ImageBase there when the image is relocated.
+ */
+static u64 getFingerprint() {
+  HMODULE handle = GetModuleHandleA("Sky.exe");
+  PIMAGE_DOS_HEADER dosHeader;
+  PIMAGE_NT_HEADERS ntHeaders;
+  u64 hash = 0xCBF29CE484222325ULL;
+
+  if (!handle)
+    return 0;
+
+  dosHeader = (PIMAGE_DOS_HEADER)handle;
+  ntHeaders = (PIMAGE_NT_HEADERS)((u08 *)handle + dosHeader->e_lfanew);
+
+  hash = fnv1a(
+    hash,
+    &ntHeaders->FileHeader.TimeDateStamp,
+    sizeof(ntHeaders->FileHeader.TimeDateStamp));
+  hash = fnv1a(
+    hash,
+    &ntHeaders->OptionalHeader.CheckSum,
+    sizeof(ntHeaders->OptionalHeader.CheckSum));
+  hash = fnv1a(
+    hash,
+    &ntHeaders->OptionalHeader.SizeOfImage,
+    sizeof(ntHeaders->OptionalHeader.SizeOfImage));
+  hash = fnv1a(
+    hash,
+    IMAGE_FIRST_SECTION(ntHeaders),
+    ntHeaders->FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER));
+
+  return hash;
+}
+
+static u64 *slotKey(const SigCacheTable *table, u32 i) {
+  return (u64 *)(table->entries + (u64)i * table->stride);
+}
+
+/**
+ * Insert or replace an entry, the lock must be held.
+ */
+static i32 insertEntry(SigCacheTable *table, const void *entry) {
+  u64 key = *(const u64 *)entry;
+  u08 *entries, *old = table->entries;
+  u32 capacity, i;
+
+  if ((table->count + 1) * 4 >= table->capacity * 3) {
+    // Grow the table.
+    capacity = table->capacity ? table->capacity * 2 : 256;
+    entries = (u08 *)calloc(capacity, table->stride);
+    if (!entries)
+      return 0;
+    for (u32 j = 0; j < table->capacity; j++) {
+      u64 k = *slotKey(table, j);
+      if (!k)
+        continue;
+      i = (u32)k & (capacity - 1);
+      while (*(u64 *)(entries + (u64)i * table->stride))
+        i = (i + 1) & (capacity - 1);
+      memcpy(
+        entries + (u64)i * table->stride,
+        old + (u64)j * table->stride,
+        table->stride);
+    }
+    free(old);
+    table->entries = entries;
+    table->capacity = capacity;
+  }
+
+  i = (u32)key & (table->capacity - 1);
+  while (*slotKey(table, i) && *slotKey(table, i) != key)
+    i = (i + 1) & (table->capacity - 1);
+  if (!*slotKey(table, i))
+    table->count++;
+  memcpy(slotKey(table, i), entry, table->stride);
+
+  return 1;
+}
+
+/**
+ * Find an entry, the lock must be held.
+ */
+static void *findEntry(const SigCacheTable *table, u64 key) {
+  u32 i;
+
+  if (!table->capacity)
+    return NULL;
+
+  i = (u32)key & (table->capacity - 1);
+  while (*slotKey(table, i)) {
+    if (*slotKey(table, i) == key)
+      return slotKey(table, i);
+    i = (i + 1) & (table->capacity - 1);
+  }
+
+  return NULL;
+}
+
+/**
+ * Remove an entry, the lock must be held. Returns 1 if removed.
+ */
+static i32 removeEntry(SigCacheTable *table, u64 key) {
+  u64 *entry = (u64 *)findEntry(table, key);
+  u32 mask = table->capacity - 1
+    , i, j, k;
+
+  if (!entry)
+    return 0;
+
+  // Backward shift deletion, keeps probe sequences intact.
+  i = (u32)(((u08 *)entry - table->entries) / table->stride);
+  *entry = 0;
+  j = i;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (!*slotKey(table, j))
+      break;
+    k = (u32)*slotKey(table, j) & mask;
+    if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+      memcpy(slotKey(table, i), slotKey(table, j), table->stride);
+      *slotKey(table, j) = 0;
+      i = j;
+    }
+  }
+  table->count--;
+
+  return 1;
+}
+
+/**
+ * Write all entries of the table.
+ */
+static i32 writeTable(const SigCacheTable *table, FILE *fd) {
+  for (u32 i = 0; i < table->capacity; i++)
+    if (
+      *slotKey(table, i)
+      && fwrite(slotKey(table, i), table->stride, 1, fd) != 1
+    )
+      return 0;
+  return 1;
+}
+
+/**
+ * Check a snapshot read from the file, its length is used to copy the bytes
+ * into fixed size buffers.
+ */
+static i32 checkSnapshot(const void *entry) {
+  const SigCacheSnapshot *snapshot = (const SigCacheSnapshot *)entry;
+  return snapshot->len && snapshot->len <= SIGCACHE_SNAPSHOT_LEN;
+}
+
+/**
+ * Read `count` entries into the table, entries rejected by `check` are
+ * dropped. Returns 0 if any entry is dropped or the file is truncated.
+ */
+static i32 readTable(
+  SigCacheTable *table,
+  u32 count,
+  i32 (*check)(const void *),
+  FILE *fd
+) {
+  u08 entry[sizeof(SigCacheSnapshot)];
+  i32 result = 1;
+
+  for (u32 i = 0; i < count; i++) {
+    if (fread(entry, table->stride, 1, fd) != 1)
+      return 0;
+    if (!*(u64 *)entry || (check && !check(entry))) {
+      result = 0;
+      continue;
+    }
+    insertEntry(table, entry);
+  }
+
+  return result;
+}
+
+/**
+ * Get path to the cache file.
+ */
+static void getCachePath(wchar_t *path, const wchar_t *suffix) {
+  wcscpy(path, gPathModsWide);
+  wcscat(path, SIGCACHE_FILE);
+  if (suffix)
+    wcscat(path, suffix);
+}
+
+/**
+ * Read the cache file, the exclusive lock must be held.
+ */
+static void loadCache() {
+  wchar_t path[MAX_PATH + 32];
+  SigCacheHeader header;
+  FILE *fd;
+
+  gLoaded = 1;
+  gFingerprint = getFingerprint();
+  if (!gFingerprint || !gPathModsWide[0])
+    return;
+
+  getCachePath(path, NULL);
+  fd = _wfopen(path, L"rb");
+  if (!fd)
+    return;
+
+  if (
+    fread(&header, sizeof(header), 1, fd) != 1
+    || header.magic != SIGCACHE_MAGIC
+    || header.version != SIGCACHE_VERSION
+  ) {
+    // Unknown format, drop the whole cache.
+    fclose(fd);
+    gDirty = 1;
+    return;
+  }
+
+  if (header.fingerprint == gFingerprint) {
+    if (!readTable(&gEntries, header.count, NULL, fd))
+      gDirty = 1;
+  } else {
+    // The game is updated, only snapshots are kept.
+    fseek(fd, (long)(header.count * sizeof(SigCacheEntry)), SEEK_CUR);
+    gDirty = 1;
+  }
+  if (!readTable(&gSnapshots, header.snapshots, checkSnapshot, fd))
+    // Rewrite the file without the broken records.
+    gDirty = 1;
+  fclose(fd);
+}
+
+/**
+ * Load the cache file on first access.
+ */
+static void ensureLoaded() {
+  AcquireSRWLockShared(&gLock);
+  i32 loaded = gLoaded;
+  ReleaseSRWLockShared(&gLock);
+  if (loaded)
+    return;
+
+  AcquireSRWLockExclusive(&gLock);
+  if (!gLoaded)
+    loadCache();
+  ReleaseSRWLockExclusive(&gLock);
+}
+
+u64 sigCacheKey(
+  const HTSignature *signature,
+  const char *section,
+  u32 nth
+) {
+  u64 hash = 0xCBF29CE484222325ULL;
+  i32 type = signature->indirect;
+
+  hash = fnv1a(hash, signature->sig, strlen(signature->sig));
+  hash = fnv1a(hash, &type, sizeof(type));
+  hash = fnv1a(hash, &signature->offset, sizeof(signature->offset));
+  if (section)
+    // Include the terminator to separate it from the signature.
+    hash = fnv1a(hash, section, strlen(section) + 1);
+  if (nth)
+    // Keys of first matches are kept unchanged.
+    hash = fnv1a(hash, &nth, sizeof(nth));
+
+  // 0 marks empty slots.
+  return hash ? hash : 1;
+}
+
+i32 sigCacheLookup(u64 key, u32 *rva) {
+  SigCacheEntry *entry;
+  i32 result = 0;
+
+  ensureLoaded();
+
+  AcquireSRWLockShared(&gLock);
+  entry = (SigCacheEntry *)findEntry(&gEntries, key);
+  if (entry) {
+    *rva = entry->rva;
+    result = 1;
+  }
+  ReleaseSRWLockShared(&gLock);
+
+  return result;
+}
+
+void sigCacheStore(u64 key, u32 rva) {
+  SigCacheEntry *entry
+    , newEntry = {key, rva, 0};
+
+  ensureLoaded();
+
+  AcquireSRWLockExclusive(&gLock);
+  entry = (SigCacheEntry *)findEntry(&gEntries, key);
+  if (!entry || entry->rva != rva)
+    gDirty |= insertEntry(&gEntries, &newEntry);
+  ReleaseSRWLockExclusive(&gLock);
+}
+
+void sigCacheDrop(u64 key) {
+  AcquireSRWLockExclusive(&gLock);
+  gDirty |= removeEntry(&gEntries, key);
+  ReleaseSRWLockExclusive(&gLock);
+}
+
+u32 sigCacheLookupSnapshot(u64 key, u08 *bytes) {
+  SigCacheSnapshot *snapshot;
+  u32 len = 0;
+
+  ensureLoaded();
+
+  AcquireSRWLockShared(&gLock);
+  snapshot = (SigCacheSnapshot *)findEntry(&gSnapshots, key);
+  if (snapshot) {
+    len = snapshot->len;
+    if (len > SIGCACHE_SNAPSHOT_LEN)
+      len = SIGCACHE_SNAPSHOT_LEN;
+    memcpy(bytes, snapshot->bytes, len);
+  }
+  ReleaseSRWLockShared(&gLock);
+
+  return len;
+}
+
+void sigCacheStoreSnapshot(u64 key, const u08 *bytes, u32 len) {
+  SigCacheSnapshot *snapshot
+    , newSnapshot = {0};
+
+  if (len > SIGCACHE_SNAPSHOT_LEN)
+    len = SIGCACHE_SNAPSHOT_LEN;
+
+  ensureLoaded();
+
+  // Mostly unchanged, check with the shared lock first.
+  AcquireSRWLockShared(&gLock);
+  snapshot = (SigCacheSnapshot *)findEntry(&gSnapshots, key);
+  if (snapshot && snapshot->len == len && !memcmp(snapshot->bytes, bytes, len)) {
+    ReleaseSRWLockShared(&gLock);
+    return;
+  }
+  ReleaseSRWLockShared(&gLock);
+
+  newSnapshot.key = key;
+  newSnapshot.len = len;
+  memcpy(newSnapshot.bytes, bytes, len);
+
+  AcquireSRWLockExclusive(&gLock);
+  gDirty |= insertEntry(&gSnapshots, &newSnapshot);
+  ReleaseSRWLockExclusive(&gLock);
+}
+
+/**
+ * Write the cache file if there's any change, the lock must be held.
+ */
+static void writeCache() {
+  wchar_t path[MAX_PATH + 32]
+    , tempPath[MAX_PATH + 32];
+  SigCacheHeader header = {0};
+  FILE *fd;
+  i32 ok;
+
+  if (!gLoaded || !gDirty || !gFingerprint)
+    return;
+
+  // Write into a temporary file first, then replace the old one.
+  getCachePath(path, NULL);
+  getCachePath(tempPath, L".tmp");
+  fd = _wfopen(tempPath, L"wb");
+  if (!fd)
+    return;
+
+  header.magic = SIGCACHE_MAGIC;
+  header.version = SIGCACHE_VERSION;
+  header.fingerprint = gFingerprint;
+  header.count = gEntries.count;
+  header.snapshots = gSnapshots.count;
+  ok = fwrite(&header, sizeof(header), 1, fd) == 1
+    && writeTable(&gEntries, fd)
+    && writeTable(&gSnapshots, fd);
+  fclose(fd);
+
+  if (ok && MoveFileExW(tempPath, path, MOVEFILE_REPLACE_EXISTING))
+    gDirty = 0;
+  else
+    DeleteFileW(tempPath);
+}
+
+void sigCacheFlush() {
+  AcquireSRWLockExclusive(&gLock);
+  writeCache();
+  ReleaseSRWLockExclusive(&gLock);
+}
+
+void sigCacheFlushOnExit() {
+  // Other threads may have been terminated while holding the lock, and the
+  // tables are possibly half written then.
+  if (!TryAcquireSRWLockExclusive(&gLock))
+    return;
+  writeCache();
+  ReleaseSRWLockExclusive(&gLock);
+}
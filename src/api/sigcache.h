@@ -0,0 +1,69 @@
+#ifndef __SIGCACHE_H__
+#define __SIGCACHE_H__
+
+#include "aliases.h"
+#include "htmodloader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Max number of bytes recorded at the match of a signature.
+#define SIGCACHE_SNAPSHOT_LEN 128
+
+/**
+ * Calculate the cache key of the `nth` match of a signature scanned in given
+ * section.
+ */
+u64 sigCacheKey(
+  const HTSignature *signature, const char *section, u32 nth);
+
+/**
+ * Get the cached RVA of the signature match. Returns 0 on cache miss.
+ */
+i32 sigCacheLookup(
+  u64 key, u32 *rva);
+
+/**
+ * Save the RVA of the signature match into the cache.
+ */
+void sigCacheStore(
+  u64 key, u32 rva);
+
+/**
+ * Remove an outdated entry from the cache.
+ */
+void sigCacheDrop(
+  u64 key);
+
+/**
+ * Get the bytes recorded at the last known match of the signature. Returns
+ * the number of bytes copied into `bytes`, or 0 if not recorded. Snapshots
+ * are kept after game updates.
+ */
+u32 sigCacheLookupSnapshot(
+  u64 key, u08 *bytes);
+
+/**
+ * Record the bytes at the match of the signature, at most
+ * SIGCACHE_SNAPSHOT_LEN bytes are saved.
+ */
+void sigCacheStoreSnapshot(
+  u64 key, const u08 *bytes, u32 len);
+
+/**
+ * Write the cache file if there's any change.
+ */
+void sigCacheFlush();
+
+/**
+ * Write the cache file on process detach, so results of scans made after
+ * loading mods are kept. Skipped if the cache is in use.
+ */
+void sigCacheFlushOnExit();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,843 @@
+// ----------------------------------------------------------------------------
+// Signature pattern matching engine of HT's Mod Loader.
+//
+// This file is platform independent and contains no Windows APIs, the
+// scanner APIs in sigscan.c feed readable memory ranges into it.
+// ----------------------------------------------------------------------------
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "aliases.h"
+#include "api/sigengine.h"
+
+// Number of slices searched at once by the skip table searcher, and the
+// number of candidates of each slice.
+#define SIGPATTERN_SKIP_SLICES 4
+#define SIGPATTERN_SKIP_SLICE_LEN 4096
+
+// Approximate occurrence weight of every byte value in x86-64 machine code,
+// higher means more common. Unlisted bytes are considered rare.
+static const u08 gByteWeight[256] = {
+  [0x00] = 255, [0xFF] = 200, [0xCC] = 190, [0x48] = 180, [0x8B] = 170,
+  [0x89] = 160, [0x4C] = 150, [0x24] = 145, [0x0F] = 140, [0xE8] = 135,
+  [0x44] = 130, [0x8D] = 125, [0x85] = 120, [0x83] = 118, [0x01] = 115,
+  [0xC0] = 112, [0x49] = 110, [0x45] = 108, [0x41] = 106, [0x4D] = 104,
+  [0x74] = 100, [0x75] = 98, [0x10] = 96, [0x20] = 94, [0x08] = 92,
+  [0x33] = 90, [0xC3] = 88, [0x40] = 86, [0x90] = 84, [0xEB] = 82,
+  [0x84] = 80, [0x28] = 78, [0x30] = 76, [0x38] = 74, [0x18] = 72,
+  [0xC7] = 70, [0xC1] = 68, [0x50] = 66, [0x5C] = 64, [0x54] = 62,
+  [0x02] = 60, [0x04] = 58, [0x03] = 56, [0xE9] = 54, [0x80] = 52,
+  [0xF8] = 50, [0x0D] = 48, [0x05] = 46, [0x15] = 44, [0x8E] = 42,
+  [0x4E] = 40, [0x11] = 38, [0x3B] = 36, [0x2B] = 34, [0xD8] = 32,
+  [0x78] = 30, [0x70] = 28, [0x60] = 26, [0xB6] = 24, [0x7C] = 22
+};
+
+/**
+ * Pick the rarest fixed bytes of the pattern as candidate anchors.
+ */
+static void selectAnchors(SigPattern *pattern) {
+  u64 best = 0, second = 0;
+  i32 bestWeight = 256, secondWeight = 256, w;
+
+  for (u64 i = 0; i < pattern->len; i++) {
+    if (!pattern->mask[i])
+      continue;
+    w = gByteWeight[pattern->bytes[i]];
+    if (w < bestWeight) {
+      second = best;
+      secondWeight = bestWeight;
+      best = i;
+      bestWeight = w;
+    } else if (w < secondWeight) {
+      second = i;
+      secondWeight = w;
+    }
+  }
+
+  if (secondWeight == 256)
+    // Only one fixed byte.
+    second = best;
+
+  pattern->anchor[0] = best;
+  pattern->anchor[1] = second;
+}
+
+/**
+ * Find the longest wildcard-free run, and build the Horspool skip table over
+ * it if it's long enough.
+ */
+static void selectRun(SigPattern *pattern) {
+  u64 runStart = 0, runLen = 0, bestStart = 0, bestLen = 0
+    , i;
+
+  for (i = 0; i <= pattern->len; i++) {
+    if (i < pattern->len && pattern->mask[i]) {
+      if (!runLen)
+        runStart = i;
+      runLen++;
+      continue;
+    }
+    if (runLen > bestLen) {
+      bestStart = runStart;
+      bestLen = runLen;
+    }
+    runLen = 0;
+  }
+
+  pattern->runOffset = bestStart;
+  pattern->runLen = bestLen;
+  if (bestLen < SIGPATTERN_SKIP_MIN_RUN)
+    return;
+
+  if (bestLen > SIGPATTERN_SKIP_MAX_RUN) {
+    // Shifts must fit in a byte, keep the tail of the run.
+    pattern->runOffset += bestLen - SIGPATTERN_SKIP_MAX_RUN;
+    pattern->runLen = bestLen = SIGPATTERN_SKIP_MAX_RUN;
+  }
+
+  memset(pattern->skip, (i32)bestLen, sizeof(pattern->skip));
+  for (i = 0; i + 1 < bestLen; i++)
+    pattern->skip[pattern->bytes[pattern->runOffset + i]] = (u08)(bestLen - 1 - i);
+}
+
+i32 sigPatternParse(const char *sig, SigPattern *pattern) {
+  u64 l, i;
+  const char *p;
+  char *q;
+
+  if (!sig || !pattern)
+    return 0;
+
+  memset(pattern, 0, sizeof(SigPattern));
+  l = strlen(sig);
+  if (l <= 1)
+    return 0;
+
+  // We can ensure that l is larger than the actual signature array.
+  pattern->bytes = (u08 *)malloc(l * 2);
+  if (!pattern->bytes)
+    return 0;
+  pattern->mask = pattern->bytes + l;
+  p = sig;
+
+  for (i = 0; p < (sig + l); p++) {
+    if (*p == '?') {
+      // Wildcard characters.
+      p++;
+      if (*p == '?')
+        p++;
+      pattern->bytes[i] = 0;
+      pattern->mask[i] = 0;
+      i++;
+    } else if (*p == ' ')
+      continue;
+    else {
+      pattern->bytes[i] = (u08)strtoul(p, &q, 16);
+      pattern->mask[i] = 0xFF;
+      pattern->fixed++;
+      p = q;
+      i++;
+    }
+  }
+
+  pattern->len = i;
+  if (!i) {
+    sigPatternFree(pattern);
+    return 0;
+  }
+  selectAnchors(pattern);
+  selectRun(pattern);
+
+  return 1;
+}
+
+void sigPatternFree(SigPattern *pattern) {
+  if (!pattern)
+    return;
+  free(pattern->bytes);
+  memset(pattern, 0, sizeof(SigPattern));
+}
+
+i32 sigPatternMatch(const SigPattern *pattern, const u08 *ptr) {
+  const u08 *bytes = pattern->bytes
+    , *mask = pattern->mask;
+  u64 i = 0, a, b, m;
+
+  for (; i + 8 <= pattern->len; i += 8) {
+    memcpy(&a, ptr + i, 8);
+    memcpy(&b, bytes + i, 8);
+    memcpy(&m, mask + i, 8);
+    if ((a ^ b) & m)
+      return 0;
+  }
+  for (; i < pattern->len; i++)
+    if ((ptr[i] ^ bytes[i]) & mask[i])
+      return 0;
+
+  return 1;
+}
+
+const u08 *sigPatternFindScalar(
+  const SigPattern *pattern,
+  const u08 *begin,
+  const u08 *end
+) {
+  u64 len = pattern->len
+    , j;
+  u08 found;
+
+  if (begin >= end || (u64)(end - begin) < len)
+    return NULL;
+
+  for (const u08 *ptr = begin; ptr <= end - len; ptr++) {
+    found = 1;
+    for (j = 0; j < len; j++) {
+      if (pattern->mask[j] && ptr[j] != pattern->bytes[j]) {
+        found = 0;
+        break;
+      }
+    }
+    if (found)
+      return ptr;
+  }
+
+  return NULL;
+}
+
+/**
+ * SSE2 searcher, compares 16 candidates at once with the two anchor bytes.
+ */
+static const u08 *findSse2(
+  const SigPattern *pattern,
+  const u08 *begin,
+  const u08 *end
+) {
+  const u08 *ptr = begin;
+  u64 a0 = pattern->anchor[0]
+    , a1 = pattern->anchor[1]
+    , count;
+  u32 bits, k;
+  __m128i v0, v1, c0, c1;
+
+  if (begin >= end || (u64)(end - begin) < pattern->len)
+    return NULL;
+  if (!pattern->fixed)
+    // Pattern consists of wildcards only.
+    return begin;
+
+  // Number of candidate positions.
+  count = (u64)(end - begin) - pattern->len + 1;
+  v0 = _mm_set1_epi8((char)pattern->bytes[a0]);
+  v1 = _mm_set1_epi8((char)pattern->bytes[a1]);
+
+  for (; count >= 16; ptr += 16, count -= 16) {
+    c0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(ptr + a0)), v0);
+    c1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(ptr + a1)), v1);
+    bits = (u32)_mm_movemask_epi8(_mm_and_si128(c0, c1));
+    while (bits) {
+      k = __builtin_ctz(bits);
+      if (sigPatternMatch(pattern, ptr + k))
+        return ptr + k;
+      bits &= bits - 1;
+    }
+  }
+
+  return sigPatternFindScalar(pattern, ptr, end);
+}
+
+/**
+ * AVX2 searcher, compares 32 candidates at once with the two anchor bytes.
+ */
+__attribute__((target("avx2")))
+static const u08 *findAvx2(
+  const SigPattern *pattern,
+  const u08 *begin,
+  const u08 *end
+) {
+  const u08 *ptr = begin;
+  u64 a0 = pattern->anchor[0]
+    , a1 = pattern->anchor[1]
+    , count;
+  u32 bits, k;
+  __m256i v0, v1, c0, c1;
+
+  if (begin >= end || (u64)(end - begin) < pattern->len)
+    return NULL;
+  if (!pattern->fixed)
+    return begin;
+
+  count = (u64)(end - begin) - pattern->len + 1;
+  v0 = _mm256_set1_epi8((char)pattern->bytes[a0]);
+  v1 = _mm256_set1_epi8((char)pattern->bytes[a1]);
+
+  for (; count >= 32; ptr += 32, count -= 32) {
+    c0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(ptr + a0)), v0);
+    c1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(ptr + a1)), v1);
+    bits = (u32)_mm256_movemask_epi8(_mm256_and_si256(c0, c1));
+    while (bits) {
+      k = __builtin_ctz(bits);
+      if (sigPatternMatch(pattern, ptr + k))
+        return ptr + k;
+      bits &= bits - 1;
+    }
+  }
+
+  // Let the SSE2 searcher handle the rest.
+  return findSse2(pattern, ptr, end);
+}
+
+/**
+ * Horspool searcher over the longest wildcard-free run, skips up to the run
+ * length on every mismatch. Every shift waits for the byte it's read from,
+ * so consecutive slices of the candidates are searched in an interleaved
+ * way. Slices behind a match are dropped, and the next slices are only
+ * taken once all of them are done, so the first full match is still the
+ * lowest one.
+ */
+static const u08 *findSkip(
+  const SigPattern *pattern,
+  const u08 *begin,
+  const u08 *end
+) {
+  const u08 *run = pattern->bytes + pattern->runOffset
+    , *tail, *found;
+  u64 runLen = pattern->runLen
+    , count, base
+    , pos[SIGPATTERN_SKIP_SLICES], limit[SIGPATTERN_SKIP_SLICES];
+  u32 slices, s;
+  u08 last = run[runLen - 1], c;
+
+  if (begin >= end || (u64)(end - begin) < pattern->len)
+    return NULL;
+
+  // Number of candidate positions of the pattern.
+  count = (u64)(end - begin) - pattern->len + 1;
+  // Last byte of the run at each candidate.
+  tail = begin + pattern->runOffset + runLen - 1;
+
+  for (base = 0; base < count; ) {
+    for (s = 0; s < SIGPATTERN_SKIP_SLICES; s++) {
+      pos[s] = base < count ? base : count;
+      base += SIGPATTERN_SKIP_SLICE_LEN;
+      limit[s] = base < count ? base : count;
+    }
+    // Shifts are irregular, so help the hardware prefetcher.
+    __builtin_prefetch(tail + base);
+    slices = SIGPATTERN_SKIP_SLICES;
+    found = NULL;
+
+    for (;;) {
+      for (s = 0; s < slices; s++) {
+        if (pos[s] >= limit[s])
+          continue;
+        c = tail[pos[s]];
+        if (
+          c == last
+          && !memcmp(tail + pos[s] - (runLen - 1), run, runLen - 1)
+          && sigPatternMatch(pattern, begin + pos[s])
+        ) {
+          found = begin + pos[s];
+          slices = s;
+          break;
+        }
+        pos[s] += pattern->skip[c];
+      }
+
+      for (s = 0; s < slices && pos[s] >= limit[s]; s++)
+        ;
+      if (s == slices)
+        break;
+    }
+    if (found)
+      return found;
+  }
+
+  return NULL;
+}
+
+/**
+ * Select searcher according to the cpu features.
+ */
+static PFN_SigPatternFind selectFinder() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return findAvx2;
+  // SSE2 is always available on x86-64.
+  return findSse2;
+}
+
+const u08 *sigPatternFind(
+  const SigPattern *pattern,
+  const u08 *begin,
+  const u08 *end
+) {
+  // Racing on this is harmless, every thread selects the same searcher.
+  static PFN_SigPatternFind finder = NULL;
+
+  if (!finder)
+    finder = selectFinder();
+
+  if (
+    pattern->runLen >= (finder == findAvx2
+      ? SIGPATTERN_SKIP_MIN_RUN_AVX2
+      : SIGPATTERN_SKIP_MIN_RUN)
+  )
+    return findSkip(pattern, begin, end);
+
+  return finder(pattern, begin, end);
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Multi-pattern matcher.
+// ----------------------------------------------------------------------------
+
+// Max length of the anchor run of each pattern used as automaton key.
+#define SIGMATCHER_MAX_KEY 8
+// Marks the end of output lists.
+#define SIGMATCHER_NONE ((u32)-1)
+// Length of the fingerprint of each pattern checked by the bucket searcher.
+#define SIGMATCHER_FP_LEN 4
+// Number of buckets, one bit of the fingerprint masks each.
+#define SIGMATCHER_BUCKETS 8
+// Max number of patterns matched by buckets. Buckets of more patterns let
+// too many candidates through, and the automaton is faster then.
+#define SIGMATCHER_MAX_BUCKETED 96
+// Without AVX2, fewer patterns than this are searched one by one, which is
+// faster than a byte-at-a-time sweep of the automaton.
+#define SIGMATCHER_MIN_AUTOMATON 32
+
+// Searcher used by the matcher.
+typedef enum {
+  SIGMATCHER_MODE_AUTOMATON = 0,
+  SIGMATCHER_MODE_BUCKETS,
+  SIGMATCHER_MODE_EACH
+} SigMatcherMode;
+
+struct SigMatcher {
+  const SigPattern *patterns;
+  u32 count;
+  SigMatcherMode mode;
+
+  // Bucket searcher. Fingerprint bytes are looked up by their low and high
+  // nibbles, the bits of both masks give the buckets that may match. Masks
+  // are repeated for both lanes of AVX2 shuffles.
+  u08 fpLow[SIGMATCHER_FP_LEN][32];
+  u08 fpHigh[SIGMATCHER_FP_LEN][32];
+  // Offset of the fingerprint in its pattern.
+  u64 *fpOffset;
+  // Patterns of every bucket, those of bucket `b` are in
+  // [bucketStart[b], bucketStart[b + 1]).
+  u32 bucketStart[SIGMATCHER_BUCKETS + 1];
+  u32 *bucketItems;
+
+  // Automaton.
+  // Number of automaton states.
+  u32 states;
+  // Full transition table, 256 entries per state.
+  u32 *next;
+  // First key ending at the state, or SIGMATCHER_NONE.
+  u32 *out;
+  // Nearest suffix state which has outputs, 0 if none.
+  u32 *dict;
+  // Next key in the same output list.
+  u32 *outNext;
+  // Offset of the key in its pattern.
+  u64 *keyOffset;
+  // Length of the key.
+  u64 *keyLen;
+};
+
+/**
+ * Select the rarest window of at most `maxLen` bytes inside the longest
+ * wildcard-free run of the pattern.
+ */
+static void selectKey(
+  const SigPattern *pattern,
+  u64 maxLen,
+  u64 *offset,
+  u64 *len
+) {
+  u64 bestStart = pattern->runOffset
+    , bestLen = pattern->runLen
+    , i, j, w, bestW;
+
+  if (bestLen <= maxLen) {
+    *offset = bestStart;
+    *len = bestLen;
+    return;
+  }
+
+  // Slide a fixed size window over the run and keep the rarest one.
+  *offset = bestStart;
+  *len = maxLen;
+  bestW = (u64)-1;
+  for (i = bestStart; i + maxLen <= bestStart + bestLen; i++) {
+    for (w = 0, j = 0; j < maxLen; j++)
+      w += gByteWeight[pattern->bytes[i + j]];
+    if (w < bestW) {
+      bestW = w;
+      *offset = i;
+    }
+  }
+}
+
+/**
+ * Compare the fingerprints of two patterns.
+ */
+static i32 compareFingerprints(const SigMatcher *m, u32 a, u32 b) {
+  const SigPattern *pa = &m->patterns[a]
+    , *pb = &m->patterns[b];
+  u64 la = pa->runLen < SIGMATCHER_FP_LEN ? pa->runLen : SIGMATCHER_FP_LEN
+    , lb = pb->runLen < SIGMATCHER_FP_LEN ? pb->runLen : SIGMATCHER_FP_LEN;
+
+  for (u64 k = 0; k < la && k < lb; k++) {
+    if (pa->bytes[m->fpOffset[a] + k] != pb->bytes[m->fpOffset[b] + k])
+      return pa->bytes[m->fpOffset[a] + k] - pb->bytes[m->fpOffset[b] + k];
+  }
+
+  return (i32)la - (i32)lb;
+}
+
+/**
+ * Split the patterns into buckets and fill the fingerprint masks. Patterns
+ * are ordered by fingerprint first, so similar ones share a bucket and set
+ * fewer mask bits.
+ */
+static i32 buildBuckets(SigMatcher *m) {
+  const SigPattern *pattern;
+  u32 n = 0, per, b, k, t;
+  u64 len;
+  u08 c;
+
+  m->fpOffset = (u64 *)malloc(m->count * sizeof(u64));
+  m->bucketItems = (u32 *)malloc(m->count * sizeof(u32));
+  if (!m->fpOffset || !m->bucketItems)
+    return 0;
+
+  for (u32 i = 0; i < m->count; i++) {
+    selectKey(&m->patterns[i], SIGMATCHER_FP_LEN, &m->fpOffset[i], &len);
+    if (!len)
+      // Wildcard-only pattern, handled by sigMatcherFind() directly.
+      continue;
+    // Insertion sort, there are at most SIGMATCHER_MAX_BUCKETED patterns.
+    for (k = n++; k; k--) {
+      if (compareFingerprints(m, m->bucketItems[k - 1], i) <= 0)
+        break;
+      m->bucketItems[k] = m->bucketItems[k - 1];
+    }
+    m->bucketItems[k] = i;
+  }
+
+  per = (n + SIGMATCHER_BUCKETS - 1) / SIGMATCHER_BUCKETS;
+  for (b = 0; b <= SIGMATCHER_BUCKETS; b++)
+    m->bucketStart[b] = b * per < n ? b * per : n;
+
+  for (b = 0; b < SIGMATCHER_BUCKETS; b++) {
+    for (u32 i = m->bucketStart[b]; i < m->bucketStart[b + 1]; i++) {
+      t = m->bucketItems[i];
+      pattern = &m->patterns[t];
+      for (k = 0; k < SIGMATCHER_FP_LEN; k++) {
+        if (k >= pattern->runLen) {
+          // Shorter fingerprints accept any byte at the rest.
+          for (u32 j = 0; j < 16; j++) {
+            m->fpLow[k][j] |= 1 << b;
+            m->fpHigh[k][j] |= 1 << b;
+          }
+          continue;
+        }
+        c = pattern->bytes[m->fpOffset[t] + k];
+        m->fpLow[k][c & 0x0F] |= 1 << b;
+        m->fpHigh[k][c >> 4] |= 1 << b;
+      }
+    }
+  }
+  for (k = 0; k < SIGMATCHER_FP_LEN; k++) {
+    memcpy(m->fpLow[k] + 16, m->fpLow[k], 16);
+    memcpy(m->fpHigh[k] + 16, m->fpHigh[k], 16);
+  }
+
+  return 1;
+}
+
+SigMatcher *sigMatcherCreate(const SigPattern *patterns, u32 count) {
+  SigMatcher *m;
+  u64 maxStates = 1;
+  u32 *queue = NULL
+    , *fail = NULL
+    , head = 0, tail = 0
+    , s, t, f, c;
+  const u08 *key;
+
+  if (!patterns || !count)
+    return NULL;
+
+  m = (SigMatcher *)calloc(1, sizeof(SigMatcher));
+  if (!m)
+    return NULL;
+  m->patterns = patterns;
+  m->count = count;
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && count <= SIGMATCHER_MAX_BUCKETED) {
+    m->mode = SIGMATCHER_MODE_BUCKETS;
+    if (!buildBuckets(m))
+      goto FAIL;
+    return m;
+  }
+  if (!__builtin_cpu_supports("avx2") && count < SIGMATCHER_MIN_AUTOMATON) {
+    m->mode = SIGMATCHER_MODE_EACH;
+    return m;
+  }
+
+  m->outNext = (u32 *)malloc(count * sizeof(u32));
+  m->keyOffset = (u64 *)malloc(count * sizeof(u64));
+  m->keyLen = (u64 *)malloc(count * sizeof(u64));
+  if (!m->outNext || !m->keyOffset || !m->keyLen)
+    goto FAIL;
+
+  for (u32 i = 0; i < count; i++) {
+    selectKey(
+      &patterns[i], SIGMATCHER_MAX_KEY, &m->keyOffset[i], &m->keyLen[i]);
+    maxStates += m->keyLen[i];
+  }
+
+  m->next = (u32 *)calloc(maxStates * 256, sizeof(u32));
+  m->out = (u32 *)malloc(maxStates * sizeof(u32));
+  m->dict = (u32 *)calloc(maxStates, sizeof(u32));
+  queue = (u32 *)malloc(maxStates * sizeof(u32));
+  if (!m->next || !m->out || !m->dict || !queue)
+    goto FAIL;
+  memset(m->out, 0xFF, maxStates * sizeof(u32));
+
+  // Build the trie, state 0 is the root and is never a child.
+  m->states = 1;
+  for (u32 i = 0; i < count; i++) {
+    m->outNext[i] = SIGMATCHER_NONE;
+    if (!m->keyLen[i])
+      // Wildcard-only pattern, handled by sigMatcherFind() directly.
+      continue;
+    key = patterns[i].bytes + m->keyOffset[i];
+    s = 0;
+    for (u64 j = 0; j < m->keyLen[i]; j++) {
+      t = m->next[s * 256 + key[j]];
+      if (!t) {
+        t = m->states++;
+        m->next[s * 256 + key[j]] = t;
+      }
+      s = t;
+    }
+    m->outNext[i] = m->out[s];
+    m->out[s] = i;
+  }
+
+  // Compute failure links breadth-first and turn the trie into a full DFA.
+  fail = (u32 *)calloc(m->states, sizeof(u32));
+  if (!fail)
+    goto FAIL;
+  for (c = 0; c < 256; c++) {
+    t = m->next[c];
+    if (t)
+      queue[tail++] = t;
+  }
+  while (head < tail) {
+    s = queue[head++];
+    for (c = 0; c < 256; c++) {
+      t = m->next[s * 256 + c];
+      f = m->next[fail[s] * 256 + c];
+      if (!t) {
+        m->next[s * 256 + c] = f;
+        continue;
+      }
+      fail[t] = f;
+      m->dict[t] = m->out[f] != SIGMATCHER_NONE ? f : m->dict[f];
+      queue[tail++] = t;
+    }
+  }
+  free(fail);
+  free(queue);
+
+  return m;
+
+FAIL:
+  free(fail);
+  free(queue);
+  sigMatcherFree(m);
+  return NULL;
+}
+
+void sigMatcherFree(SigMatcher *matcher) {
+  if (!matcher)
+    return;
+  free(matcher->next);
+  free(matcher->out);
+  free(matcher->dict);
+  free(matcher->outNext);
+  free(matcher->keyOffset);
+  free(matcher->keyLen);
+  free(matcher->fpOffset);
+  free(matcher->bucketItems);
+  free(matcher);
+}
+
+/**
+ * Check the patterns of the buckets whose fingerprint may start at `pos`.
+ * Returns the number of patterns that remain unresolved.
+ */
+static u32 checkBuckets(
+  const SigMatcher *matcher,
+  const u08 *begin,
+  u64 size,
+  u64 pos,
+  u32 buckets,
+  const u08 **results,
+  u32 remaining
+) {
+  const SigPattern *pattern;
+  u64 start;
+  u32 b, i, k;
+
+  for (; buckets; buckets &= buckets - 1) {
+    b = __builtin_ctz(buckets);
+    for (i = matcher->bucketStart[b]; i < matcher->bucketStart[b + 1]; i++) {
+      k = matcher->bucketItems[i];
+      if (results[k] || pos < matcher->fpOffset[k])
+        continue;
+      pattern = &matcher->patterns[k];
+      start = pos - matcher->fpOffset[k];
+      if (start + pattern->len > size)
+        continue;
+      if (sigPatternMatch(pattern, begin + start)) {
+        results[k] = begin + start;
+        remaining--;
+      }
+    }
+  }
+
+  return remaining;
+}
+
+/**
+ * Bucket searcher, finds the fingerprints of 32 positions at once with
+ * nibble lookups. Positions are visited in address order, so the first match
+ * of every pattern is the lowest one.
+ */
+__attribute__((target("avx2")))
+static u32 findBucketsAvx2(
+  const SigMatcher *matcher,
+  const u08 *begin,
+  u64 size,
+  const u08 **results,
+  u32 remaining
+) {
+  __m256i low[SIGMATCHER_FP_LEN], high[SIGMATCHER_FP_LEN]
+    , nibble = _mm256_set1_epi8(0x0F)
+    , v, r;
+  u08 buckets[32];
+  u64 pos = 0;
+  u32 bits, j, k;
+
+  for (k = 0; k < SIGMATCHER_FP_LEN; k++) {
+    low[k] = _mm256_loadu_si256((const __m256i *)matcher->fpLow[k]);
+    high[k] = _mm256_loadu_si256((const __m256i *)matcher->fpHigh[k]);
+  }
+
+  for (; remaining && pos + 32 + SIGMATCHER_FP_LEN - 1 <= size; pos += 32) {
+    r = _mm256_set1_epi8(-1);
+    for (k = 0; k < SIGMATCHER_FP_LEN; k++) {
+      v = _mm256_loadu_si256((const __m256i *)(begin + pos + k));
+      r = _mm256_and_si256(r, _mm256_and_si256(
+        _mm256_shuffle_epi8(low[k], _mm256_and_si256(v, nibble)),
+        _mm256_shuffle_epi8(
+          high[k], _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble))));
+    }
+    bits = ~(u32)_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(r, _mm256_setzero_si256()));
+    if (!bits)
+      continue;
+    _mm256_storeu_si256((__m256i *)buckets, r);
+    for (; bits && remaining; bits &= bits - 1) {
+      j = __builtin_ctz(bits);
+      remaining = checkBuckets(
+        matcher, begin, size, pos + j, buckets[j], results, remaining);
+    }
+  }
+
+  // Bytes past the end don't restrict the last positions, patterns there
+  // are rejected by their length anyway.
+  for (; remaining && pos < size; pos++) {
+    j = 0xFF;
+    for (k = 0; k < SIGMATCHER_FP_LEN && pos + k < size; k++)
+      j &= matcher->fpLow[k][begin[pos + k] & 0x0F]
+        & matcher->fpHigh[k][begin[pos + k] >> 4];
+    if (j)
+      remaining = checkBuckets(
+        matcher, begin, size, pos, j, results, remaining);
+  }
+
+  return remaining;
+}
+
+u32 sigMatcherFind(
+  const SigMatcher *matcher,
+  const u08 *begin,
+  const u08 *end,
+  const u08 **results
+) {
+  const SigPattern *pattern;
+  u64 size, pos, start;
+  u32 remaining = 0
+    , state = 0
+    , s, k;
+
+  if (!matcher || !results)
+    return 0;
+  size = begin < end ? (u64)(end - begin) : 0;
+
+  for (k = 0; k < matcher->count; k++) {
+    if (results[k])
+      continue;
+    if (!matcher->patterns[k].fixed && matcher->patterns[k].len <= size)
+      // Wildcard-only pattern matches at the very beginning.
+      results[k] = begin;
+    else
+      remaining++;
+  }
+
+  if (matcher->mode == SIGMATCHER_MODE_BUCKETS)
+    return findBucketsAvx2(matcher, begin, size, results, remaining);
+  if (matcher->mode == SIGMATCHER_MODE_EACH) {
+    for (k = 0; remaining && k < matcher->count; k++) {
+      if (results[k])
+        continue;
+      results[k] = sigPatternFind(&matcher->patterns[k], begin, end);
+      if (results[k])
+        remaining--;
+    }
+    return remaining;
+  }
+
+  for (pos = 0; remaining && pos < size; pos++) {
+    state = matcher->next[state * 256 + begin[pos]];
+    s = matcher->out[state] != SIGMATCHER_NONE ? state : matcher->dict[state];
+    for (; s; s = matcher->dict[s]) {
+      for (k = matcher->out[s]; k != SIGMATCHER_NONE; k = matcher->outNext[k]) {
+        if (results[k])
+          continue;
+        pattern = &matcher->patterns[k];
+        // Key ends at pos, locate the start of the whole pattern.
+        if (pos + 1 < matcher->keyLen[k] + matcher->keyOffset[k])
+          continue;
+        start = pos + 1 - matcher->keyLen[k] - matcher->keyOffset[k];
+        if (start + pattern->len > size)
+          continue;
+        if (sigPatternMatch(pattern, begin + start)) {
+          results[k] = begin + start;
+          remaining--;
+        }
+      }
+    }
+  }
+
+  return remaining;
+}
@@ -0,0 +1,108 @@
+#ifndef __SIGENGINE_H__
+#define __SIGENGINE_H__
+
+#include "aliases.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Min length of the wildcard-free run to use the skip table searcher,
+// shorter patterns use the vectorized anchor searchers instead. Below this
+// the average shift is too short to beat streaming through the anchors,
+// measured with tools/sigbench.c. The AVX2 searcher is only beaten by much
+// longer runs.
+#define SIGPATTERN_SKIP_MIN_RUN 64
+#define SIGPATTERN_SKIP_MIN_RUN_AVX2 160
+// Max length of the run covered by the skip table.
+#define SIGPATTERN_SKIP_MAX_RUN 255
+
+// Parsed byte pattern of a signature string.
+typedef struct {
+  // Pattern bytes, wildcard positions are stored as 0.
+  u08 *bytes;
+  // Compare mask, 0xFF for fixed bytes and 0x00 for wildcards.
+  u08 *mask;
+  // Length of the pattern in bytes.
+  u64 len;
+  // Number of non-wildcard bytes.
+  u64 fixed;
+  // Positions of the two rarest fixed bytes, used for candidate filtering.
+  u64 anchor[2];
+  // Offset and length of the longest wildcard-free run.
+  u64 runOffset;
+  u64 runLen;
+  // Horspool shift of every byte value over the tail of the run, only valid
+  // when `runLen` reaches SIGPATTERN_SKIP_MIN_RUN.
+  u08 skip[256];
+} SigPattern;
+
+// Multi-pattern matcher compiled from several patterns.
+typedef struct SigMatcher SigMatcher;
+
+// Prototype of a pattern searcher.
+typedef const u08 *(*PFN_SigPatternFind)(
+  const SigPattern *pattern, const u08 *begin, const u08 *end);
+
+/**
+ * Parse signature string into a byte pattern. Returns 0 if the signature is
+ * empty or invalid.
+ */
+i32 sigPatternParse(
+  const char *sig, SigPattern *pattern);
+
+/**
+ * Free the buffers held by the pattern.
+ */
+void sigPatternFree(
+  SigPattern *pattern);
+
+/**
+ * Check if the pattern matches the bytes starting at `ptr`. The caller must
+ * ensure there's at least `pattern->len` readable bytes.
+ */
+i32 sigPatternMatch(
+  const SigPattern *pattern, const u08 *ptr);
+
+/**
+ * Find the first occurrence of the pattern in [begin, end). Uses the fastest
+ * searcher supported by the cpu.
+ */
+const u08 *sigPatternFind(
+  const SigPattern *pattern, const u08 *begin, const u08 *end);
+
+/**
+ * Reference searcher which compares the pattern at every offset.
+ */
+const u08 *sigPatternFindScalar(
+  const SigPattern *pattern, const u08 *begin, const u08 *end);
+
+/**
+ * Prepare a searcher for a set of patterns. Small sets are filtered by AVX2
+ * fingerprint buckets, or searched one by one without AVX2; larger sets are
+ * compiled into an Aho-Corasick automaton over their anchor runs. The
+ * patterns must outlive the matcher.
+ */
+SigMatcher *sigMatcherCreate(
+  const SigPattern *patterns, u32 count);
+
+/**
+ * Free the matcher.
+ */
+void sigMatcherFree(
+  SigMatcher *matcher);
+
+/**
+ * Find the first occurrence of every unresolved pattern in [begin, end) with
+ * one sweep. `results[i]` is filled for pattern i if it's still NULL and a
+ * match is found. Returns the number of patterns that remain unresolved.
+ */
+u32 sigMatcherFind(
+  const SigMatcher *matcher, const u08 *begin, const u08 *end,
+  const u08 **results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
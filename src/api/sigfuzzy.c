@@ -0,0 +1,425 @@
+// ----------------------------------------------------------------------------
+// Fuzzy signature matching of HT's Mod Loader.
+//
+// Finds the code most similar to the bytes recorded at the last known match
+// of a signature, used after game updates when the signature no longer
+// matches. Candidates are ranked by masked Hamming similarity first, then
+// the instructions of the best ones are aligned with the recorded ones, so
+// inserted or removed instructions only cost their own bytes.
+//
+// Unlike sigengine.c, this file isn't platform independent, as instructions
+// are decoded with hde64 of MinHook, whose headers include windows.h.
+// ----------------------------------------------------------------------------
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <emmintrin.h>
+
+#include "aliases.h"
+#include "hde/hde64.h"
+#include "api/sigfuzzy.h"
+
+// Max length of an x86-64 instruction.
+#define SIGFUZZY_MAX_INSN 15
+
+/**
+ * Decode the instruction at `ptr` and clear the mask of its bytes that
+ * differ between builds: relative displacements and branches, and 32 or
+ * 64-bit immediates. The buffer must be readable for 15 bytes. Returns the
+ * length of the instruction.
+ */
+static u32 maskVolatile(const u08 *ptr, u08 *mask, u32 avail) {
+  u32 immSize = 0, dispSize = 0, immStart, dispStart;
+  hde64s hs;
+
+  hde64_disasm(ptr, &hs);
+  if ((hs.flags & F_ERROR) || !hs.len)
+    return 1;
+
+  if (hs.flags & F_IMM8)
+    immSize += 1;
+  if (hs.flags & F_IMM16)
+    immSize += 2;
+  if (hs.flags & F_IMM32)
+    immSize += 4;
+  if (hs.flags & F_IMM64)
+    immSize += 8;
+  if (hs.flags & F_DISP8)
+    dispSize = 1;
+  else if (hs.flags & F_DISP16)
+    dispSize = 2;
+  else if (hs.flags & F_DISP32)
+    dispSize = 4;
+
+  // Displacement and immediate are always the last bytes.
+  immStart = hs.len - immSize;
+  dispStart = immStart - dispSize;
+  if ((hs.flags & F_RELATIVE) || (hs.flags & (F_IMM32 | F_IMM64)))
+    // Branch targets, addresses and large constants.
+    for (u32 i = immStart; i < hs.len && i < avail; i++)
+      mask[i] = 0;
+  if ((hs.flags & F_MODRM) && hs.modrm_mod == 0 && hs.modrm_rm == 5)
+    // [rip + disp32].
+    for (u32 i = dispStart; i < immStart && i < avail; i++)
+      mask[i] = 0;
+
+  return hs.len;
+}
+
+/**
+ * Copy `len` bytes into a zero padded buffer, so the decoder never reads
+ * past the end.
+ */
+static void copyPadded(u08 *buffer, const u08 *ptr, u32 len) {
+  memcpy(buffer, ptr, len);
+  memset(buffer + len, 0, SIGFUZZY_MAX_INSN + 1);
+}
+
+/**
+ * Split the bytes into instructions, `len` is at most SIGFUZZY_MAX_LEN +
+ * SIGFUZZY_SLACK. Returns the number of instructions.
+ */
+static u32 splitInsns(const u08 *buffer, u32 len, u08 *offsets, u08 *lengths) {
+  u08 mask[SIGFUZZY_MAX_LEN + SIGFUZZY_SLACK + SIGFUZZY_MAX_INSN + 1];
+  u32 count = 0, pos = 0, l;
+
+  while (pos < len) {
+    l = maskVolatile(buffer + pos, mask + pos, len - pos);
+    if (pos + l > len)
+      l = len - pos;
+    offsets[count] = (u08)pos;
+    lengths[count] = (u08)l;
+    count++;
+    pos += l;
+  }
+
+  return count;
+}
+
+i32 sigFuzzyInit(
+  SigFuzzy *fuzzy,
+  const u08 *snapshot,
+  u32 len,
+  const u08 *patternMask,
+  u32 patternLen
+) {
+  u08 buffer[SIGFUZZY_MAX_LEN + SIGFUZZY_MAX_INSN + 1];
+  u32 pos = 0, l;
+
+  memset(fuzzy, 0, sizeof(SigFuzzy));
+  if (len > SIGFUZZY_MAX_LEN)
+    len = SIGFUZZY_MAX_LEN;
+  if (!len)
+    return 0;
+
+  copyPadded(buffer, snapshot, len);
+  memcpy(fuzzy->bytes, snapshot, len);
+  memset(fuzzy->mask, 0xFF, len);
+  while (pos < len) {
+    l = maskVolatile(buffer + pos, fuzzy->mask + pos, len - pos);
+    if (pos + l > len)
+      break;
+    pos += l;
+  }
+
+  // Drop the truncated instruction at the end, otherwise it matches the
+  // truncated ones of candidates by accident.
+  if (pos) {
+    memset(fuzzy->bytes + pos, 0, len - pos);
+    memset(fuzzy->mask + pos, 0, len - pos);
+    len = pos;
+  }
+
+  for (u32 i = 0; i < len; i++) {
+    if (patternMask && i < patternLen && !patternMask[i])
+      fuzzy->mask[i] = 0;
+    if (fuzzy->mask[i])
+      fuzzy->stable++;
+  }
+  fuzzy->len = len;
+
+  return fuzzy->stable > 0;
+}
+
+/**
+ * Keep the candidate if it's among the best ones of the list.
+ */
+static void addCandidate(
+  SigFuzzyCandidate *list,
+  u32 *count,
+  const u08 *ptr,
+  const u08 *begin,
+  const u08 *end,
+  u32 score
+) {
+  u32 i;
+
+  if (*count == SIGFUZZY_CANDIDATES && score <= list[*count - 1].score)
+    return;
+
+  i = *count < SIGFUZZY_CANDIDATES ? (*count)++ : SIGFUZZY_CANDIDATES - 1;
+  for (; i > 0 && list[i - 1].score < score; i--)
+    list[i] = list[i - 1];
+  list[i].ptr = ptr;
+  list[i].begin = begin;
+  list[i].end = end;
+  list[i].score = score;
+}
+
+/**
+ * Get the min score to enter the list.
+ */
+static u32 minScore(const SigFuzzyCandidate *list, u32 count) {
+  return count == SIGFUZZY_CANDIDATES ? list[count - 1].score : 0;
+}
+
+void sigFuzzyFeed(SigFuzzy *fuzzy, const u08 *begin, const u08 *end) {
+  __m128i bytes[SIGFUZZY_MAX_LEN / 16];
+  u32 masks[SIGFUZZY_MAX_LEN / 16];
+  u32 chunks, half, head, tail;
+  const u08 *ptr, *last, *vectorEnd;
+
+  if (!fuzzy->len || begin >= end || (u64)(end - begin) < fuzzy->len)
+    return;
+
+  chunks = (fuzzy->len + 15) / 16;
+  half = chunks / 2;
+  for (u32 c = 0; c < chunks; c++) {
+    bytes[c] = _mm_loadu_si128((const __m128i *)(fuzzy->bytes + c * 16));
+    masks[c] = (u32)_mm_movemask_epi8(
+      _mm_loadu_si128((const __m128i *)(fuzzy->mask + c * 16)));
+  }
+
+  // Vectorized while whole chunks are readable, the tail of the range is
+  // done in scalar.
+  last = end - fuzzy->len + 1;
+  vectorEnd = (u64)(end - begin) >= chunks * 16 ? end - chunks * 16 + 1 : begin;
+  for (ptr = begin; ptr < last; ptr++) {
+    head = tail = 0;
+    if (ptr < vectorEnd) {
+      for (u32 c = 0; c < chunks; c++) {
+        u32 eq = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(
+          _mm_loadu_si128((const __m128i *)(ptr + c * 16)),
+          bytes[c]));
+        eq = (u32)__builtin_popcount(eq & masks[c]);
+        if (c < half)
+          head += eq;
+        else
+          tail += eq;
+      }
+    } else {
+      for (u32 i = 0; i < fuzzy->len; i++) {
+        u32 eq = fuzzy->mask[i] && ptr[i] == fuzzy->bytes[i];
+        if (i < half * 16)
+          head += eq;
+        else
+          tail += eq;
+      }
+    }
+
+    if (head + tail > minScore(fuzzy->whole, fuzzy->wholeCount))
+      addCandidate(
+        fuzzy->whole, &fuzzy->wholeCount, ptr, begin, end, head + tail);
+    if (half && tail > minScore(fuzzy->tail, fuzzy->tailCount))
+      addCandidate(
+        fuzzy->tail, &fuzzy->tailCount, ptr, begin, end, tail);
+  }
+}
+
+/**
+ * Check if the instruction of the candidate is mostly equal to the one of
+ * the snapshot. Returns the number of equal stable bytes, or 0.
+ */
+static u32 compareInsn(
+  const SigFuzzy *fuzzy,
+  u32 offA,
+  u32 lenA,
+  const u08 *b,
+  u32 lenB
+) {
+  const u08 *a = fuzzy->bytes + offA
+    , *k = fuzzy->mask + offA;
+  u32 stable = 0, s = 0;
+
+  // Instructions of different lengths never match.
+  if (lenA != lenB)
+    return 0;
+
+  for (u32 x = 0; x < lenA; x++) {
+    stable += !!k[x];
+    s += k[x] && a[x] == b[x];
+  }
+
+  // Otherwise it's another instruction of the same length.
+  return s * 2 >= stable ? s : 0;
+}
+
+/**
+ * Align the instructions decoded from `ptr` with the snapshot. Returns the
+ * number of stable bytes matched in aligned instructions, doubled, plus 1 if
+ * the first instructions are aligned, which prefers the exact start.
+ */
+static u32 alignCandidate(
+  const SigFuzzy *fuzzy,
+  const u08 *ptr,
+  u32 avail,
+  u32 *dp
+) {
+  u08 model[SIGFUZZY_MAX_LEN + SIGFUZZY_MAX_INSN + 1]
+    , buffer[SIGFUZZY_MAX_LEN + SIGFUZZY_SLACK + SIGFUZZY_MAX_INSN + 1]
+    , offA[SIGFUZZY_MAX_LEN], lenA[SIGFUZZY_MAX_LEN]
+    , offB[SIGFUZZY_MAX_LEN + SIGFUZZY_SLACK]
+    , lenB[SIGFUZZY_MAX_LEN + SIGFUZZY_SLACK];
+  u32 n, m, w, s, best, len;
+
+  // Inserted instructions push the rest behind the snapshot length.
+  len = fuzzy->len + SIGFUZZY_SLACK;
+  if (len > avail)
+    len = avail;
+
+  copyPadded(model, fuzzy->bytes, fuzzy->len);
+  copyPadded(buffer, ptr, len);
+  n = splitInsns(model, fuzzy->len, offA, lenA);
+  m = splitInsns(buffer, len, offB, lenB);
+  if (!n || !m)
+    return 0;
+  w = m + 1;
+
+  // Weighted longest common subsequence over instructions.
+  for (u32 j = 0; j <= m; j++)
+    dp[j] = 0;
+  for (u32 i = 1; i <= n; i++) {
+    dp[i * w] = 0;
+    for (u32 j = 1; j <= m; j++) {
+      best = dp[(i - 1) * w + j];
+      if (dp[i * w + j - 1] > best)
+        best = dp[i * w + j - 1];
+      s = compareInsn(
+        fuzzy, offA[i - 1], lenA[i - 1], buffer + offB[j - 1], lenB[j - 1]);
+      if (s && dp[(i - 1) * w + j - 1] + s > best)
+        best = dp[(i - 1) * w + j - 1] + s;
+      dp[i * w + j] = best;
+    }
+  }
+
+  return dp[n * w + m] * 2
+    + !!compareInsn(fuzzy, offA[0], lenA[0], buffer + offB[0], lenB[0]);
+}
+
+/**
+ * Try starts around the estimated one, returns the best aligned start.
+ */
+static const u08 *alignAround(
+  const SigFuzzy *fuzzy,
+  const SigFuzzyCandidate *candidate,
+  i32 slack,
+  u32 *score,
+  u32 *dp
+) {
+  const u08 *best = NULL, *ptr;
+  u32 s;
+
+  *score = 0;
+  // Nearest starts first, so ties keep the nearest one.
+  for (i32 d = 0; d <= 2 * slack; d++) {
+    i32 shift = (d & 1) ? -(d + 1) / 2 : d / 2;
+
+    if (shift < 0 && candidate->ptr - candidate->begin < -shift)
+      continue;
+    ptr = candidate->ptr + shift;
+    if (ptr >= candidate->end)
+      continue;
+
+    s = alignCandidate(fuzzy, ptr, (u32)(candidate->end - ptr) < 0xFFFF
+      ? (u32)(candidate->end - ptr)
+      : 0xFFFF, dp);
+    if (s > *score) {
+      *score = s;
+      best = ptr;
+    }
+  }
+
+  return best;
+}
+
+const u08 *sigFuzzyBest(const SigFuzzy *fuzzy, f32 *confidence) {
+  const u08 *best = NULL, *ptr
+    , *starts[SIGFUZZY_CANDIDATES * 2];
+  u32 scores[SIGFUZZY_CANDIDATES * 2];
+  u32 *dp, count = 0, bestScore = 0, secondScore = 0;
+
+  *confidence = 0;
+  if (!fuzzy->stable || (!fuzzy->wholeCount && !fuzzy->tailCount))
+    return NULL;
+
+  dp = (u32 *)malloc(
+    (SIGFUZZY_MAX_LEN + 1)
+    * (SIGFUZZY_MAX_LEN + SIGFUZZY_SLACK + 1)
+    * sizeof(u32));
+  if (!dp)
+    return NULL;
+
+  // Whole matches start near the estimated start, while tail matches may be
+  // shifted by instructions inserted or removed before the tail.
+  for (u32 i = 0; i < fuzzy->wholeCount; i++) {
+    ptr = alignAround(fuzzy, &fuzzy->whole[i], 1, &scores[count], dp);
+    if (ptr)
+      starts[count++] = ptr;
+  }
+  for (u32 i = 0; i < fuzzy->tailCount; i++) {
+    ptr = alignAround(fuzzy, &fuzzy->tail[i], SIGFUZZY_SLACK, &scores[count], dp);
+    if (ptr)
+      starts[count++] = ptr;
+  }
+  free(dp);
+
+  for (u32 i = 0; i < count; i++)
+    if (scores[i] > bestScore) {
+      bestScore = scores[i];
+      best = starts[i];
+    }
+  if (!best)
+    return NULL;
+  for (u32 i = 0; i < count; i++)
+    if (starts[i] != best && scores[i] / 2 > secondScore)
+      secondScore = scores[i] / 2;
+
+  *confidence = (f32)(bestScore / 2) / (f32)fuzzy->stable;
+  if (secondScore == bestScore / 2)
+    // Ambiguous.
+    *confidence *= 0.5f;
+
+  return best;
+}
+
+i32 sigFuzzyGenerate(const u08 *ptr, u32 len, char *sig, u32 size) {
+  u08 buffer[SIGFUZZY_MAX_LEN + SIGFUZZY_MAX_INSN + 1]
+    , mask[SIGFUZZY_MAX_LEN + SIGFUZZY_MAX_INSN + 1];
+  u32 pos = 0, end;
+  char *q = sig;
+
+  if (len > SIGFUZZY_MAX_LEN)
+    len = SIGFUZZY_MAX_LEN;
+  if (!len || size < len * 3)
+    return 0;
+
+  copyPadded(buffer, ptr, len);
+  memset(mask, 0xFF, len);
+  while (pos < len)
+    pos += maskVolatile(buffer + pos, mask + pos, len - pos);
+
+  // Trailing wildcards match anything, drop them.
+  end = len;
+  while (end > 1 && !mask[end - 1])
+    end--;
+
+  for (u32 i = 0; i < end; i++) {
+    if (mask[i])
+      q += sprintf(q, i ? " %02X" : "%02X", buffer[i]);
+    else
+      q += sprintf(q, i ? " ??" : "??");
+  }
+  *q = 0;
+
+  return 1;
+}
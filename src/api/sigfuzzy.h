@@ -0,0 +1,81 @@
+#ifndef __SIGFUZZY_H__
+#define __SIGFUZZY_H__
+
+#include "aliases.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Max number of bytes compared at a candidate.
+#define SIGFUZZY_MAX_LEN 128
+// Number of candidates kept for instruction alignment, per ranking.
+#define SIGFUZZY_CANDIDATES 32
+// Max distance in bytes between the estimated and the aligned start of a
+// candidate, covers instructions inserted or removed before the tail.
+#define SIGFUZZY_SLACK 16
+
+// Candidate found by masked Hamming similarity.
+typedef struct {
+  // Estimated start of the candidate.
+  const u08 *ptr;
+  // Readable range containing the candidate.
+  const u08 *begin;
+  const u08 *end;
+  u32 score;
+} SigFuzzyCandidate;
+
+// Similarity search of the recorded bytes of a signature.
+typedef struct {
+  // Recorded bytes, and 0xFF in `mask` for the stable bytes. Displacements
+  // and immediates that change with every build are masked out.
+  u08 bytes[SIGFUZZY_MAX_LEN];
+  u08 mask[SIGFUZZY_MAX_LEN];
+  u32 len;
+  // Number of stable bytes.
+  u32 stable;
+  // Best candidates by similarity of the whole snapshot, and by similarity
+  // of its second half only. The latter catches code with instructions
+  // inserted or removed in the first half. Both in descending order.
+  SigFuzzyCandidate whole[SIGFUZZY_CANDIDATES];
+  SigFuzzyCandidate tail[SIGFUZZY_CANDIDATES];
+  u32 wholeCount;
+  u32 tailCount;
+} SigFuzzy;
+
+/**
+ * Prepare the search of the snapshot. `patternMask` is the mask of the
+ * original pattern from the start of the snapshot, its wildcards are also
+ * ignored. Returns 0 if there's nothing to compare.
+ */
+i32 sigFuzzyInit(
+  SigFuzzy *fuzzy, const u08 *snapshot, u32 len,
+  const u08 *patternMask, u32 patternLen);
+
+/**
+ * Collect candidates in [begin, end).
+ */
+void sigFuzzyFeed(
+  SigFuzzy *fuzzy, const u08 *begin, const u08 *end);
+
+/**
+ * Align the instructions of every candidate with the snapshot, and get the
+ * start of the best one. `confidence` is the fraction of stable bytes in
+ * aligned instructions, halved if another candidate is as good.
+ */
+const u08 *sigFuzzyBest(
+  const SigFuzzy *fuzzy, f32 *confidence);
+
+/**
+ * Generate a signature of `len` bytes at `ptr`. Displacements of relative
+ * operands and 32-bit immediates are wildcarded. The caller must ensure
+ * there's at least `len` readable bytes. Returns 0 if `size` is too small.
+ */
+i32 sigFuzzyGenerate(
+  const u08 *ptr, u32 len, char *sig, u32 size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
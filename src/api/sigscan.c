@@ -2,127 +2,592 @@
 // Signature code scanner APIs of HT's Mod Loader.
 // ----------------------------------------------------------------------------
 #include <windows.h>
+#include <stdio.h>
 
 #include "aliases.h"
 #include "htmodloader.h"
+#include "hde/hde64.h"
+#include "api/sigengine.h"
+#include "api/sigcache.h"
+#include "api/sigfuzzy.h"
+#include "api/scanmodule.h"
+#include "logger.h"
+
+// ----------------------------------------------------------------------------
+// [SECTION] Parallel scanning.
+// ----------------------------------------------------------------------------
+
+// Size of the candidate range of each chunk in parallel scans.
+#define SCAN_CHUNK_SIZE (1 << 20)
+// Ranges smaller than this are scanned on the calling thread.
+#define SCAN_PARALLEL_THRESHOLD (8 << 20)
+// Max number of threads taking part in a parallel scan.
+#define SCAN_MAX_WORKERS 16
+// Single pattern scans are run in batches of this many chunks, kept on the
+// stack.
+#define SCAN_BATCH_CHUNKS 256
+
+// A slice of readable memory scanned by one worker at a time.
+typedef struct {
+  // The first candidate address.
+  const u08 *begin;
+  // End of the readable bytes, including the overlap into the next chunk.
+  const u08 *end;
+} ScanChunk;
+
+// Where the next chunk of the selected ranges starts.
+typedef struct {
+  u32 range;
+  const u08 *next;
+} ScanCursor;
+
+// Shared state of a parallel scan.
+typedef struct {
+  ScanChunk *chunks;
+  u32 count;
+  // Index of the next chunk to be taken.
+  volatile LONG next;
+
+  // Single pattern scans.
+  const SigPattern *pattern;
+  // Match of every chunk.
+  const u08 **results;
+  // Lowest chunk with a match.
+  volatile LONG best;
+
+  // Multi-pattern scans.
+  const SigMatcher *matcher;
+  u32 patterns;
+  // Matches of every chunk, `patterns` entries per chunk.
+  const u08 **matrix;
+  // Lowest chunk with a match of every pattern.
+  volatile LONG *bestChunk;
+} ScanJob;
+
+// Placeholder for patterns that are already resolved in an earlier chunk.
+static const u08 gResolved = 0;
 
 /**
- * Convert signature string to byte pattern.
+ * Split the selected ranges into at most `capacity` chunks overlapped by
+ * `overlap` bytes, continuing from `cursor`. Returns the number of chunks.
  */
-static i32 *sigToPattern(const char *sig, u64 *patternLen) {
-  u64 l, i;
-  i32 *pattern;
-  const char *p;
-  char *q;
-
-  l = strlen(sig);
-  if (l <= 1)
-    return NULL;
-  
-  // We can ensure that (l >> 1) is larger than the actual signature array.
-  pattern = (i32 *)malloc(l * sizeof(i32));
-  p = sig;
+static u32 fillChunks(
+  const ScanTarget *target,
+  u64 overlap,
+  ScanCursor *cursor,
+  ScanChunk *chunks,
+  u32 capacity
+) {
+  const u08 *regionEnd;
+  u64 left;
+  u32 count = 0;
 
-  for (i = 0; p < (sig + l); p++) {
-    if (*p == '?') {
-      // Wildcard characters.
-      p++;
-      if (*p == '?')
-        p++;
-      pattern[i] = -1;
-      i++;
-    } else if (*p == ' ')
+  while (count < capacity && cursor->range < target->count) {
+    regionEnd = target->ranges[cursor->range].end;
+    if (cursor->next >= regionEnd) {
+      if (++cursor->range < target->count)
+        cursor->next = target->ranges[cursor->range].begin;
       continue;
-    else {
-      pattern[i] = strtoul(p, &q, 16);
-      p = q;
-      i++;
     }
+    left = (u64)(regionEnd - cursor->next);
+    chunks[count].begin = cursor->next;
+    chunks[count].end = left > SCAN_CHUNK_SIZE + overlap
+      ? cursor->next + SCAN_CHUNK_SIZE + overlap
+      : regionEnd;
+    cursor->next += SCAN_CHUNK_SIZE;
+    count++;
   }
 
-  *patternLen = i;
+  return count;
+}
+
+/**
+ * Split the selected ranges into chunks overlapped by `overlap` bytes.
+ * Returns the total size of the ranges.
+ */
+static u64 buildChunks(
+  const ScanTarget *target,
+  u64 overlap,
+  ScanChunk **chunks,
+  u32 *count
+) {
+  ScanCursor cursor = {0, target->count ? target->ranges[0].begin : NULL};
+  u64 total = 0, size;
+  u32 capacity = 0;
 
-  return pattern;
+  *chunks = NULL;
+  *count = 0;
+
+  for (u32 i = 0; i < target->count; i++) {
+    size = (u64)(target->ranges[i].end - target->ranges[i].begin);
+    total += size;
+    capacity += (u32)((size + SCAN_CHUNK_SIZE - 1) / SCAN_CHUNK_SIZE);
+  }
+  if (!capacity)
+    return total;
+
+  *chunks = (ScanChunk *)malloc(capacity * sizeof(ScanChunk));
+  if (!*chunks)
+    return 0;
+  *count = fillChunks(target, overlap, &cursor, *chunks, capacity);
+
+  return total;
 }
 
 /**
- * Scan the specified signature in given module.
+ * Lower the value of target to value atomically.
  */
-static void *sigScan(const char *moduleName, const char *sig, i32 offset) {
-  HINSTANCE handle;
-  PIMAGE_DOS_HEADER dosHeader;
-  PIMAGE_NT_HEADERS ntHeaders;
-  MEMORY_BASIC_INFORMATION mbi;
-  u64 imageSize, patternLen;
-  i32 *pattern;
-  u08 *image
-    , found;
+static void atomicMin(volatile LONG *target, LONG value) {
+  LONG old = *target, prev;
 
-  handle = GetModuleHandleA(moduleName);
-  if (!handle)
-    return NULL;
+  while (value < old) {
+    prev = InterlockedCompareExchange(target, value, old);
+    if (prev == old)
+      break;
+    old = prev;
+  }
+}
 
-  dosHeader = (PIMAGE_DOS_HEADER)handle;
-  ntHeaders = (PIMAGE_NT_HEADERS)((u08 *)handle + dosHeader->e_lfanew);
-  imageSize = ntHeaders->OptionalHeader.SizeOfImage;
-  image = (u08 *)handle;
+/**
+ * Scan a chunk for the single pattern.
+ */
+static void scanChunkSingle(ScanJob *job, LONG i) {
+  const u08 *found;
 
-  pattern = sigToPattern(sig, &patternLen);
-  if (!pattern || patternLen == 0) {
-    if (pattern)
-      free(pattern);
-    return NULL;
+  found = sigPatternFind(job->pattern, job->chunks[i].begin, job->chunks[i].end);
+  if (found) {
+    job->results[i] = found;
+    atomicMin(&job->best, i);
   }
+}
 
-  u08 *scanStart = image;
-  u08 *scanEnd = image + imageSize;
+/**
+ * Scan a chunk for every pattern not yet resolved in earlier chunks.
+ */
+static void scanChunkMulti(ScanJob *job, LONG i) {
+  const u08 **results = job->matrix + (u64)i * job->patterns;
+  u32 pending = 0;
+
+  for (u32 k = 0; k < job->patterns; k++) {
+    if (job->bestChunk[k] < i)
+      results[k] = &gResolved;
+    else
+      pending++;
+  }
+  if (!pending)
+    return;
+
+  sigMatcherFind(job->matcher, job->chunks[i].begin, job->chunks[i].end, results);
 
-  while (scanStart < scanEnd) {
-    if (!VirtualQuery(scanStart, &mbi, sizeof(mbi)))
+  for (u32 k = 0; k < job->patterns; k++)
+    if (results[k] && results[k] != &gResolved)
+      atomicMin(&job->bestChunk[k], i);
+}
+
+/**
+ * Worker of parallel scans. Chunks are taken in address order, so a worker
+ * can stop once the taken chunk is behind the lowest match.
+ */
+static VOID CALLBACK scanWorker(
+  PTP_CALLBACK_INSTANCE instance,
+  PVOID context,
+  PTP_WORK work
+) {
+  ScanJob *job = (ScanJob *)context;
+  LONG i;
+
+  (void)instance;
+  (void)work;
+
+  while ((i = InterlockedIncrement(&job->next) - 1) < (LONG)job->count) {
+    if (job->matcher)
+      scanChunkMulti(job, i);
+    else if (i < job->best)
+      scanChunkSingle(job, i);
+    else
       break;
+  }
+}
 
-    u08 *blockEnd = (u08 *)mbi.BaseAddress + mbi.RegionSize;
-    if (blockEnd > scanEnd)
-      blockEnd = scanEnd;
+/**
+ * Run the job on the process thread pool, the calling thread also takes
+ * part in it.
+ */
+static void runScanJob(ScanJob *job) {
+  SYSTEM_INFO info;
+  PTP_WORK work;
+  u32 workers;
 
-    if (
-      mbi.State == MEM_COMMIT
-      && (mbi.Protect & (
-        PAGE_READONLY
-        | PAGE_READWRITE
-        | PAGE_EXECUTE_READ
-        | PAGE_EXECUTE_READWRITE
-      ))
-    ) {
-      for (u08 *ptr = (u08 *)mbi.BaseAddress; ptr + patternLen <= blockEnd; ptr++) {
-        found = 1;
-        for (u64 j = 0; j < patternLen; j++) {
-          if (pattern[j] != -1 && ptr[j] != (u08)pattern[j]) {
-            found = 0;
-            break;
-          }
-        }
-        if (found) {
-          free(pattern);
-          return (void *)((char *)(ptr + offset));
-        }
+  GetSystemInfo(&info);
+  workers = info.dwNumberOfProcessors;
+  if (workers > SCAN_MAX_WORKERS)
+    workers = SCAN_MAX_WORKERS;
+  if (workers > job->count)
+    workers = job->count;
+
+  work = workers > 1
+    ? CreateThreadpoolWork(scanWorker, (PVOID)job, NULL)
+    : NULL;
+  if (work)
+    for (u32 w = 1; w < workers; w++)
+      SubmitThreadpoolWork(work);
+
+  scanWorker(NULL, (PVOID)job, NULL);
+
+  if (work) {
+    // All chunks are taken once we return, so workers that haven't started
+    // are cancelled. They may never start if we're called from DllMain.
+    WaitForThreadpoolWorkCallbacks(work, TRUE);
+    CloseThreadpoolWork(work);
+  }
+}
+
+/**
+ * Scan the specified pattern in the selected ranges, large ranges are
+ * sharded across the thread pool.
+ */
+static u08 *sigScan(const SigPattern *pattern, const ScanTarget *target) {
+  ScanChunk chunks[SCAN_BATCH_CHUNKS];
+  const u08 *results[SCAN_BATCH_CHUNKS];
+  const u08 *found = NULL;
+  ScanCursor cursor;
+  ScanJob job = {0};
+  u64 total = 0;
+
+  for (u32 i = 0; i < target->count; i++)
+    total += (u64)(target->ranges[i].end - target->ranges[i].begin);
+
+  if (total < SCAN_PARALLEL_THRESHOLD) {
+    // Small ranges are scanned in place without any allocation.
+    for (u32 i = 0; i < target->count && !found; i++)
+      found = sigPatternFind(
+        pattern, target->ranges[i].begin, target->ranges[i].end);
+    return (u08 *)found;
+  }
+
+  job.chunks = chunks;
+  job.results = results;
+  job.pattern = pattern;
+  cursor.range = 0;
+  cursor.next = target->ranges[0].begin;
+  // Batches are in address order, so the first match found is the lowest.
+  while (!found) {
+    job.count = fillChunks(
+      target, pattern->len - 1, &cursor, chunks, SCAN_BATCH_CHUNKS);
+    if (!job.count)
+      break;
+    job.next = 0;
+    job.best = (LONG)job.count;
+    runScanJob(&job);
+    if (job.best < (LONG)job.count)
+      found = results[job.best];
+  }
+
+  return (u08 *)found;
+}
+
+// Visitor of sigScanEach(), returns 0 to stop the sweep.
+typedef i32 (*PFN_ScanVisitor)(
+  const u08 *found, u32 index, void *context);
+
+/**
+ * Visit every match of the pattern in the selected ranges in address order
+ * with one sweep. Overlapped matches are all visited. Returns the number of
+ * matches visited.
+ */
+static u32 sigScanEach(
+  const SigPattern *pattern,
+  const ScanTarget *target,
+  PFN_ScanVisitor visitor,
+  void *context
+) {
+  const u08 *found, *end;
+  u32 count = 0;
+
+  for (u32 i = 0; i < target->count; i++) {
+    found = target->ranges[i].begin;
+    end = target->ranges[i].end;
+    while ((found = sigPatternFind(pattern, found, end))) {
+      if (!visitor(found, count++, context))
+        return count;
+      found++;
+    }
+  }
+
+  return count;
+}
+
+// Context of nthVisitor().
+typedef struct {
+  u32 nth;
+  const u08 *found;
+} ScanNth;
+
+static i32 nthVisitor(const u08 *found, u32 index, void *context) {
+  ScanNth *nth = (ScanNth *)context;
+
+  if (index < nth->nth)
+    return 1;
+  nth->found = found;
+  return 0;
+}
+
+/**
+ * Scan the `nth` match of the pattern in the selected ranges. The first
+ * match goes through the parallel scanner.
+ */
+static u08 *sigScanNth(
+  const SigPattern *pattern,
+  const ScanTarget *target,
+  u32 nth
+) {
+  ScanNth context = {nth, NULL};
+
+  if (!nth)
+    return sigScan(pattern, target);
+
+  sigScanEach(pattern, target, nthVisitor, &context);
+
+  return (u08 *)context.found;
+}
+
+/**
+ * Resolve every unresolved pattern of the matcher in the selected ranges.
+ * Returns the number of patterns that remain unresolved.
+ */
+static u32 sigScanMulti(
+  const SigMatcher *matcher,
+  const SigPattern *patterns,
+  u32 count,
+  const ScanTarget *target,
+  const u08 **found
+) {
+  ScanJob job = {0};
+  u64 total, maxLen = 1;
+  u32 remaining = 0;
+
+  for (u32 k = 0; k < count; k++) {
+    if (patterns[k].len > maxLen)
+      maxLen = patterns[k].len;
+    if (!found[k])
+      remaining++;
+  }
+
+  total = buildChunks(target, maxLen - 1, &job.chunks, &job.count);
+  if (!job.count)
+    return remaining;
+
+  if (total < SCAN_PARALLEL_THRESHOLD) {
+    // Chunks of the same region overlap, the lowest match is kept since
+    // resolved patterns are skipped.
+    for (u32 i = 0; i < job.count && remaining; i++)
+      remaining = sigMatcherFind(
+        matcher, job.chunks[i].begin, job.chunks[i].end, found);
+  } else {
+    job.matcher = matcher;
+    job.patterns = count;
+    job.matrix = (const u08 **)calloc((u64)job.count * count, sizeof(u08 *));
+    job.bestChunk = (volatile LONG *)malloc(count * sizeof(LONG));
+    if (job.matrix && job.bestChunk) {
+      for (u32 k = 0; k < count; k++)
+        job.bestChunk[k] = found[k] ? -1 : (LONG)job.count;
+      runScanJob(&job);
+      remaining = 0;
+      for (u32 k = 0; k < count; k++) {
+        if (job.bestChunk[k] >= 0 && job.bestChunk[k] < (LONG)job.count)
+          found[k] = job.matrix[(u64)job.bestChunk[k] * count + k];
+        if (!found[k])
+          remaining++;
       }
     }
-    scanStart = blockEnd;
+    free(job.matrix);
+    free((void *)job.bestChunk);
   }
 
-  free(pattern);
+  free(job.chunks);
+
+  return remaining;
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Scan helpers.
+// ----------------------------------------------------------------------------
+
+/**
+ * Check if the cached match of the signature is still valid.
+ */
+static u08 *checkCached(
+  const SigPattern *pattern,
+  u64 key,
+  const ScanTarget *target
+) {
+  u32 rva;
+  u08 *ptr;
+
+  if (!key || !sigCacheLookup(key, &rva))
+    return NULL;
 
+  ptr = target->base + rva;
+  if (
+    scanTargetContains(target, ptr, pattern->len)
+    && sigPatternMatch(pattern, ptr)
+  )
+    return ptr;
+
+  // Outdated entry.
+  sigCacheDrop(key);
   return NULL;
 }
 
 /**
- * Scan a specified signature, and calculate address using E8 or E9 relative
- * jump instructions.
+ * Record the bytes at the match, they're used to find the signature again
+ * once it's broken by a game update.
+ */
+static void recordSnapshot(
+  const SigPattern *pattern,
+  u64 key,
+  const ScanTarget *target,
+  const u08 *found
+) {
+  u64 len = pattern->len;
+
+  if (!key)
+    return;
+
+  // Short signatures are extended to tell similar functions apart.
+  if (len < 32)
+    len = 32;
+  if (len > SIGCACHE_SNAPSHOT_LEN)
+    len = SIGCACHE_SNAPSHOT_LEN;
+  while (len > pattern->len && !scanTargetContains(target, found, len))
+    len--;
+
+  sigCacheStoreSnapshot(key, found, (u32)len);
+}
+
+/**
+ * Scan the `nth` match of the pattern in the selected ranges, with the
+ * persistent cache.
  */
-static void *sigScanE8(const char *moduleName, const char *sig, i32 offset) {
-  u08 *initial = (u08 *)sigScan(moduleName, sig, 0)
-    , *result
+static u08 *sigScanCached(
+  const SigPattern *pattern,
+  const ScanTarget *target,
+  u64 key,
+  u32 nth
+) {
+  u08 *found;
+
+  found = checkCached(pattern, key, target);
+  if (!found) {
+    found = sigScanNth(pattern, target, nth);
+    if (found && key)
+      sigCacheStore(key, (u32)(found - target->base));
+  }
+  if (found)
+    recordSnapshot(pattern, key, target, found);
+
+  return found;
+}
+
+/**
+ * Check if `ptr` is the only match of the pattern in the selected ranges.
+ */
+static i32 isUniqueMatch(
+  const SigPattern *pattern,
+  const ScanTarget *target,
+  const u08 *ptr
+) {
+  const u08 *begin;
+
+  if (sigScan(pattern, target) != ptr)
+    return 0;
+
+  for (u32 i = 0; i < target->count; i++) {
+    if (target->ranges[i].end <= ptr)
+      continue;
+    begin = target->ranges[i].begin > ptr
+      ? target->ranges[i].begin
+      : ptr + 1;
+    if (sigPatternFind(pattern, begin, target->ranges[i].end))
+      return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Find the code most similar to the last known match of the signature.
+ * A signature of the candidate is generated into `sig`, extended until it's
+ * unique if possible.
+ */
+static const u08 *sigScanFuzzy(
+  const SigPattern *pattern,
+  const ScanTarget *target,
+  u64 key,
+  f32 *confidence,
+  char *sig,
+  u32 size
+) {
+  u08 snapshot[SIGCACHE_SNAPSHOT_LEN];
+  const u08 *best;
+  SigPattern generated;
+  SigFuzzy *fuzzy;
+  u32 len, sigLen;
+
+  *confidence = 0;
+  if (!key)
+    return NULL;
+  len = sigCacheLookupSnapshot(key, snapshot);
+  if (!len)
+    return NULL;
+
+  fuzzy = (SigFuzzy *)malloc(sizeof(SigFuzzy));
+  if (!fuzzy)
+    return NULL;
+  if (!sigFuzzyInit(fuzzy, snapshot, len, pattern->mask, (u32)pattern->len)) {
+    free(fuzzy);
+    return NULL;
+  }
+  for (u32 i = 0; i < target->count; i++)
+    sigFuzzyFeed(fuzzy, target->ranges[i].begin, target->ranges[i].end);
+  best = sigFuzzyBest(fuzzy, confidence);
+  free(fuzzy);
+  if (!best)
+    return NULL;
+
+  // A candidate near the end of its range may have fewer bytes behind than
+  // the snapshot.
+  for (u32 i = 0; i < target->count; i++)
+    if (best >= target->ranges[i].begin && best < target->ranges[i].end) {
+      if ((u64)(target->ranges[i].end - best) < len)
+        len = (u32)(target->ranges[i].end - best);
+      break;
+    }
+  sigLen = pattern->len < len ? (u32)pattern->len : len;
+  for (;;) {
+    if (!sigFuzzyGenerate(best, sigLen, sig, size)) {
+      sig[0] = 0;
+      break;
+    }
+    if (sigPatternParse(sig, &generated)) {
+      i32 unique = isUniqueMatch(&generated, target, best);
+      sigPatternFree(&generated);
+      if (unique)
+        break;
+    }
+    if (sigLen >= len)
+      break;
+    sigLen = sigLen + 8 < len ? sigLen + 8 : len;
+  }
+
+  return best;
+}
+
+/**
+ * Calculate address using E8 or E9 relative jump instructions.
+ */
+static void *resolveE8(u08 *initial, i32 offset) {
+  u08 *result
     , opCode;
   i32 rel;
 
@@ -145,12 +610,10 @@ static void *sigScanE8(const char *moduleName, const char *sig, i32 offset) {
 }
 
 /**
- * Scan a specified signature, and calculate address using FF15 or FF25
- * relative jump instructions.
+ * Calculate address using FF15 or FF25 relative jump instructions.
  */
-static void *sigScanFF15(const char *moduleName, const char *sig, i32 offset) {
-  u08 *initial = (u08 *)sigScan(moduleName, sig, 0)
-    , *ptr, *result
+static void *resolveFF15(u08 *initial, i32 offset) {
+  u08 *ptr, *result
     , opCode;
   i32 rel;
   u64 len;
@@ -184,20 +647,379 @@ static void *sigScanFF15(const char *moduleName, const char *sig, i32 offset) {
   return (void *)result;
 }
 
-HTMLAPI void *HTSigScan(const HTSignature *signature) {
-  if (!signature)
+/**
+ * Calculate address using the RIP-relative operand of the instruction.
+ */
+static void *resolveRip(u08 *initial, i32 offset) {
+  u08 *ptr;
+  hde64s hs;
+
+  if (!initial)
+    return NULL;
+
+  ptr = initial + offset;
+  hde64_disasm(ptr, &hs);
+  if (hs.flags & F_ERROR)
+    return NULL;
+
+  // Operands are relative to the next instruction.
+  if (hs.modrm_mod == 0 && hs.modrm_rm == 5 && (hs.flags & F_DISP32))
+    // [rip + disp32] memory operand.
+    return (void *)(ptr + hs.len + (i32)hs.disp.disp32);
+  else if (hs.flags & F_RELATIVE) {
+    // Relative branches, e.g. jcc, jmp and call.
+    if (hs.flags & F_IMM8)
+      return (void *)(ptr + hs.len + (i08)hs.imm.imm8);
+    else if (hs.flags & F_IMM32)
+      return (void *)(ptr + hs.len + (i32)hs.imm.imm32);
+  }
+
+  return NULL;
+}
+
+/**
+ * Dereference the address as a pointer for `count` times.
+ */
+static void *dereference(void *address, u32 count) {
+  u64 len;
+
+  for (u32 i = 0; i < count && address; i++)
+    if (
+      !ReadProcessMemory(
+        GetCurrentProcess(),
+        address,
+        (void *)&address,
+        sizeof(void *),
+        &len)
+      || len != sizeof(void *)
+    )
+      return NULL;
+
+  return address;
+}
+
+/**
+ * Calculate the final address from the start of the matched signature.
+ */
+static void *resolveAddress(const HTSignature *signature, u08 *initial) {
+  if (!initial)
     return NULL;
-  
+
   if (signature->indirect == HT_SCAN_DIRECT)
-    return sigScan("Sky.exe", signature->sig, signature->offset);
+    return (void *)(initial + signature->offset);
   else if (signature->indirect == HT_SCAN_E8)
-    return sigScanE8("Sky.exe", signature->sig, signature->offset);
+    return resolveE8(initial, signature->offset);
   else if (signature->indirect == HT_SCAN_FF15)
-    return sigScanFF15("Sky.exe", signature->sig, signature->offset);
+    return resolveFF15(initial, signature->offset);
+  else if (signature->indirect == HT_SCAN_RIP)
+    return resolveRip(initial, signature->offset);
   else
     return NULL;
 }
 
+/**
+ * Log the most similar code of a signature that's not found, so broken
+ * signatures don't fail silently after game updates.
+ */
+static void reportBroken(
+  const HTSignature *signature,
+  const SigPattern *pattern,
+  u64 key,
+  const ScanTarget *target
+) {
+  char sig[SIGFUZZY_MAX_LEN * 3];
+  const u08 *best;
+  f32 confidence;
+
+  best = sigScanFuzzy(pattern, target, key, &confidence, sig, sizeof(sig));
+  if (!best) {
+    LOGW(
+      "Signature %s not found.\n",
+      signature->name ? signature->name : signature->sig);
+    return;
+  }
+
+  LOGW(
+    "Signature %s not found, the most similar code is at +0x%llX with "
+    "confidence %.2f, regenerated signature: %s\n",
+    signature->name ? signature->name : signature->sig,
+    (u64)(best - target->base),
+    confidence,
+    sig);
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Compiled signatures.
+// ----------------------------------------------------------------------------
+
+struct HTCompiledSignature {
+  // Copy of the signature config, strings are stored behind the struct.
+  HTSignatureEx signature;
+  // Parsed pattern, with bytes and mask packed in one buffer.
+  SigPattern pattern;
+  // Ranges selected by the section filter, or the explicit range.
+  ScanTarget target;
+  // Key of the persistent cache, 0 if the target isn't in Sky.exe.
+  u64 key;
+};
+
+/**
+ * Select the ranges of the module or the explicit range to be scanned.
+ * Returns the scanned module, or NULL if it failed or it's an explicit range.
+ */
+static ScanModule *selectTarget(
+  const HTSignatureEx *signature,
+  ScanTarget *target
+) {
+  ScanModule *module;
+  HMODULE handle = signature->module;
+
+  if (signature->begin) {
+    scanTargetFromRange(signature->begin, signature->end, target);
+    return NULL;
+  }
+
+  if (!handle && signature->moduleName) {
+    handle = GetModuleHandleA(signature->moduleName);
+    if (!handle)
+      return NULL;
+  }
+
+  module = scanModuleGet(handle);
+  if (!module || !scanModuleSelect(module, signature->section, target))
+    return NULL;
+
+  return module;
+}
+
+/**
+ * Copy a string into the string pool of the compiled signature.
+ */
+static const char *copyString(const char *str, char **pool) {
+  char *result = *pool;
+  u64 len;
+
+  if (!str)
+    return NULL;
+  len = strlen(str) + 1;
+  memcpy(result, str, len);
+  *pool += len;
+
+  return result;
+}
+
+HTMLAPI HTCompiledSignature *HTCompileSignature(
+  const HTSignatureEx *signature
+) {
+  HTCompiledSignature *compiled;
+  ScanModule *module;
+  u64 size;
+  char *pool;
+
+  if (!signature || !signature->base.sig)
+    return NULL;
+  if (
+    signature->base.indirect != HT_SCAN_DIRECT
+    && signature->base.indirect != HT_SCAN_E8
+    && signature->base.indirect != HT_SCAN_FF15
+    && signature->base.indirect != HT_SCAN_RIP
+  )
+    return NULL;
+
+  size = sizeof(HTCompiledSignature) + strlen(signature->base.sig) + 1;
+  if (signature->base.name)
+    size += strlen(signature->base.name) + 1;
+  if (signature->section)
+    size += strlen(signature->section) + 1;
+  if (signature->moduleName)
+    size += strlen(signature->moduleName) + 1;
+
+  compiled = (HTCompiledSignature *)calloc(1, size);
+  if (!compiled)
+    return NULL;
+
+  pool = (char *)(compiled + 1);
+  compiled->signature = *signature;
+  compiled->signature.base.sig = copyString(signature->base.sig, &pool);
+  compiled->signature.base.name = copyString(signature->base.name, &pool);
+  compiled->signature.section = copyString(signature->section, &pool);
+  compiled->signature.moduleName = copyString(signature->moduleName, &pool);
+
+  if (!sigPatternParse(compiled->signature.base.sig, &compiled->pattern)) {
+    HTFreeCompiledSignature(compiled);
+    return NULL;
+  }
+  module = selectTarget(&compiled->signature, &compiled->target);
+  if (!compiled->target.count) {
+    HTFreeCompiledSignature(compiled);
+    return NULL;
+  }
+
+  // Only RVAs in Sky.exe are validated by the fingerprint of the cache.
+  if (module && module == scanModuleGetSky())
+    compiled->key = sigCacheKey(
+      &compiled->signature.base,
+      compiled->signature.section,
+      compiled->signature.nth);
+
+  return compiled;
+}
+
+HTMLAPI void *HTSigScanCompiled(const HTCompiledSignature *compiled) {
+  if (!compiled)
+    return NULL;
+
+  return dereference(
+    resolveAddress(
+      &compiled->signature.base,
+      sigScanCached(
+        &compiled->pattern,
+        &compiled->target,
+        compiled->key,
+        compiled->signature.nth)),
+    compiled->signature.deref);
+}
+
+HTMLAPI void HTFreeCompiledSignature(HTCompiledSignature *compiled) {
+  if (!compiled)
+    return;
+  sigPatternFree(&compiled->pattern);
+  free(compiled->target.ranges);
+  free(compiled);
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Scanner APIs.
+// ----------------------------------------------------------------------------
+
+HTMLAPI void *HTSigScan(const HTSignature *signature) {
+  HTSignatureEx signatureEx = {0};
+
+  if (!signature)
+    return NULL;
+
+  signatureEx.base = *signature;
+
+  return HTSigScanEx(&signatureEx);
+}
+
+HTMLAPI void *HTSigScanEx(const HTSignatureEx *signature) {
+  HTCompiledSignature *compiled;
+  void *result;
+
+  compiled = HTCompileSignature(signature);
+  if (!compiled)
+    return NULL;
+  result = HTSigScanCompiled(compiled);
+  HTFreeCompiledSignature(compiled);
+
+  return result;
+}
+
+// Context of allVisitor().
+typedef struct {
+  const HTCompiledSignature *compiled;
+  void **results;
+  u32 maxCount;
+  PFN_HTSigScanCallback callback;
+  void *user;
+} ScanAll;
+
+static i32 allVisitor(const u08 *found, u32 index, void *context) {
+  ScanAll *all = (ScanAll *)context;
+  void *address;
+
+  if (!all->callback && (!all->results || index >= all->maxCount))
+    // Only counted.
+    return 1;
+
+  address = dereference(
+    resolveAddress(&all->compiled->signature.base, (u08 *)found),
+    all->compiled->signature.deref);
+
+  if (all->results && index < all->maxCount)
+    all->results[index] = address;
+  if (all->callback)
+    return all->callback(address, index, all->user);
+
+  return 1;
+}
+
+HTMLAPI u32 HTSigScanAll(
+  const HTSignatureEx *signature,
+  void **results,
+  u32 maxCount,
+  PFN_HTSigScanCallback callback,
+  void *user
+) {
+  HTCompiledSignature *compiled;
+  ScanAll context;
+  u32 count;
+
+  compiled = HTCompileSignature(signature);
+  if (!compiled)
+    return 0;
+
+  context.compiled = compiled;
+  context.results = results;
+  context.maxCount = maxCount;
+  context.callback = callback;
+  context.user = user;
+  count = sigScanEach(
+    &compiled->pattern,
+    &compiled->target,
+    allVisitor,
+    &context);
+  HTFreeCompiledSignature(compiled);
+
+  return count;
+}
+
+HTMLAPI HTStatus HTSigScanFuzzy(
+  const HTSignatureEx *signature,
+  HTFuzzyResult *result
+) {
+  HTCompiledSignature *compiled;
+  const u08 *found;
+
+  if (!result)
+    return HT_FAIL;
+  memset(result, 0, sizeof(HTFuzzyResult));
+
+  compiled = HTCompileSignature(signature);
+  if (!compiled)
+    return HT_FAIL;
+
+  found = sigScanCached(
+    &compiled->pattern,
+    &compiled->target,
+    compiled->key,
+    compiled->signature.nth);
+  if (found) {
+    result->confidence = 1.0f;
+    snprintf(
+      result->signature,
+      sizeof(result->signature),
+      "%s",
+      compiled->signature.base.sig);
+  } else
+    found = sigScanFuzzy(
+      &compiled->pattern,
+      &compiled->target,
+      compiled->key,
+      &result->confidence,
+      result->signature,
+      sizeof(result->signature));
+
+  if (found)
+    result->address = dereference(
+      resolveAddress(&compiled->signature.base, (u08 *)found),
+      compiled->signature.deref);
+  HTFreeCompiledSignature(compiled);
+
+  return result->address ? HT_SUCCESS : HT_FAIL;
+}
+
 HTMLAPI void *HTSigScanFunc(
   const HTSignature *signature,
   HTHookFunction *func
@@ -214,21 +1036,99 @@ HTMLAPI HTStatus HTSigScanFuncEx(
   u32 size
 ) {
   HTStatus result = HT_SUCCESS;
-  const HTSignature *sig;
-  HTHookFunction *f;
+  SigPattern *patterns = NULL;
+  SigMatcher *matcher = NULL;
+  const u08 **found = NULL;
+  u64 *keys = NULL;
+  u32 *index = NULL
+    , count = 0
+    , remaining;
+  ScanModule *module;
+  ScanTarget target = {0};
 
   if (!signature || !func || !size)
     return HT_FAIL;
 
+  patterns = (SigPattern *)calloc(size, sizeof(SigPattern));
+  found = (const u08 **)calloc(size, sizeof(u08 *));
+  index = (u32 *)malloc(size * sizeof(u32));
+  keys = (u64 *)malloc(size * sizeof(u64));
+  if (!patterns || !found || !index || !keys) {
+    result = HT_FAIL;
+    goto RET;
+  }
+
+  // Parse all signatures, and collect them into one matcher.
   for (u32 i = 0; i < size; i++) {
-    sig = signature[i];
-    f = func[i];
-    if (!sig || !f)
+    if (!signature[i] || !func[i])
       continue;
-    if (!HTSigScanFunc(sig, f))
+    func[i]->fn = NULL;
+    if (!sigPatternParse(signature[i]->sig, &patterns[count])) {
       // Marked as failed if failed to scan any of the signature codes.
       result = HT_FAIL;
+      continue;
+    }
+    index[count++] = i;
+  }
+
+  if (!count)
+    goto RET;
+
+  // All HTSignature are scanned in executable sections.
+  module = scanModuleGetSky();
+  if (!module || !scanModuleSelect(module, NULL, &target)) {
+    result = HT_FAIL;
+    goto RET;
   }
 
+  // Fill in cached results first, they're skipped by the matcher.
+  remaining = count;
+  for (u32 i = 0; i < count; i++) {
+    keys[i] = sigCacheKey(signature[index[i]], NULL, 0);
+    found[i] = checkCached(&patterns[i], keys[i], &target);
+    if (found[i])
+      remaining--;
+  }
+
+  if (remaining) {
+    matcher = sigMatcherCreate(patterns, count);
+    if (!matcher) {
+      result = HT_FAIL;
+      goto RET;
+    }
+
+    // Resolve the rest signatures with one sweep over the image.
+    sigScanMulti(matcher, patterns, count, &target, found);
+
+    for (u32 i = 0; i < count; i++)
+      if (found[i])
+        sigCacheStore(keys[i], (u32)(found[i] - target.base));
+  }
+
+  for (u32 i = 0; i < count; i++) {
+    if (found[i])
+      recordSnapshot(&patterns[i], keys[i], &target, found[i]);
+    else
+      reportBroken(signature[index[i]], &patterns[i], keys[i], &target);
+  }
+  sigCacheFlush();
+
+  for (u32 i = 0; i < count; i++) {
+    func[index[i]]->fn = resolveAddress(signature[index[i]], (u08 *)found[i]);
+    if (!func[index[i]]->fn)
+      result = HT_FAIL;
+  }
+
+RET:
+  sigMatcherFree(matcher);
+  if (patterns)
+    for (u32 i = 0; i < count; i++)
+      sigPatternFree(&patterns[i]);
+  free(patterns);
+  free(found);
+  free(index);
+  free(keys);
+  free(target.ranges);
+
   return result;
 }
@@ -0,0 +1,251 @@
+// ----------------------------------------------------------------------------
+// Cross reference index of HT's Mod Loader.
+//
+// Executable sections of Sky.exe are decoded once with hde64, and every
+// near call, near jmp and RIP-relative reference is recorded as a pair of
+// target and site RVAs. Pairs are sorted by target, so a lookup is a binary
+// search followed by a walk over the sites of that target.
+// ----------------------------------------------------------------------------
+#include <windows.h>
+#include <stdlib.h>
+
+#include "aliases.h"
+#include "htmodloader.h"
+#include "hde/hde64.h"
+#include "api/scanmodule.h"
+
+// Max length of an x86-64 instruction.
+#define XREF_MAX_INSN 15
+
+// Build state of the index.
+enum {
+  XREF_IDLE = 0,
+  XREF_QUEUED,
+  XREF_BUILDING,
+  XREF_READY,
+  XREF_FAILED
+};
+
+static INIT_ONCE gInitOnce = INIT_ONCE_STATIC_INIT;
+static volatile LONG gState = XREF_IDLE;
+// Signaled when the build is finished, whether succeeded or not.
+static HANDLE gEventDone = NULL;
+static u08 *gBase = NULL;
+// Sorted pairs, with the target RVA in the high 32 bits and the site RVA in
+// the low 32 bits. Immutable once the index is ready.
+static u64 *gEntries = NULL;
+static u64 gCount = 0;
+
+/**
+ * Decode the instruction at `ptr` and get the target of its near branch or
+ * RIP-relative operand. Returns the kind of the reference, or 0.
+ */
+static u32 decodeRef(
+  const u08 *ptr,
+  const u08 *end,
+  u08 **target,
+  u32 *len
+) {
+  u08 buffer[XREF_MAX_INSN] = {0};
+  const u08 *insn = ptr;
+  hde64s hs;
+
+  if (end - ptr < XREF_MAX_INSN) {
+    // Don't let the decoder read past the range.
+    memcpy(buffer, ptr, end - ptr);
+    insn = buffer;
+  }
+
+  hde64_disasm(insn, &hs);
+  *len = hs.len;
+  if ((hs.flags & F_ERROR) || !hs.len || hs.len > end - ptr) {
+    *len = 1;
+    return 0;
+  }
+
+  if (
+    (hs.flags & F_MODRM)
+    && hs.modrm_mod == 0
+    && hs.modrm_rm == 5
+  ) {
+    // Operands are relative to the next instruction.
+    *target = (u08 *)ptr + hs.len + (i32)hs.disp.disp32;
+    return HT_XREF_DATA;
+  }
+
+  // Short branches stay inside their function, only near ones are indexed.
+  if ((hs.flags & F_RELATIVE) && (hs.flags & F_IMM32)) {
+    *target = (u08 *)ptr + hs.len + (i32)hs.imm.imm32;
+    return hs.opcode == 0xE8 ? HT_XREF_CALL : HT_XREF_JMP;
+  }
+
+  return 0;
+}
+
+static int compareEntry(const void *a, const void *b) {
+  u64 x = *(const u64 *)a
+    , y = *(const u64 *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Decode all executable sections, and collect sorted references.
+ */
+static i32 buildIndex() {
+  ScanModule *module;
+  ScanTarget code = {0};
+  u64 *entries = NULL, *p
+    , count = 0
+    , capacity = 0;
+  u08 *ptr, *end, *target;
+  u32 type, len;
+
+  module = scanModuleGetSky();
+  if (!module || !scanModuleSelect(module, NULL, &code))
+    goto FAIL;
+
+  for (u32 i = 0; i < code.count; i++) {
+    ptr = code.ranges[i].begin;
+    end = code.ranges[i].end;
+    // Linear sweep, padding between functions is decoded as int3 or nop.
+    while (ptr < end) {
+      type = decodeRef(ptr, end, &target, &len);
+      if (
+        // Data references may point to any section.
+        (type == HT_XREF_DATA && target >= module->begin && target < module->end)
+        // Branches must land in the code, otherwise it's decoded from data.
+        || (type && type != HT_XREF_DATA && scanTargetContains(&code, target, 1))
+      ) {
+        if (count == capacity) {
+          capacity = capacity ? capacity * 2 : 65536;
+          p = (u64 *)realloc(entries, capacity * sizeof(u64));
+          if (!p)
+            goto FAIL;
+          entries = p;
+        }
+        entries[count++] = ((u64)(target - module->begin) << 32)
+          | (u32)(ptr - module->begin);
+      }
+      ptr += len;
+    }
+  }
+
+  qsort(entries, count, sizeof(u64), compareEntry);
+
+  gBase = module->begin;
+  gEntries = entries;
+  gCount = count;
+  free(code.ranges);
+  return 1;
+
+FAIL:
+  free(entries);
+  free(code.ranges);
+  return 0;
+}
+
+/**
+ * Build the index if it's not claimed by another thread yet.
+ */
+static void runBuild() {
+  if (
+    InterlockedCompareExchange(&gState, XREF_BUILDING, XREF_QUEUED)
+    != XREF_QUEUED
+  )
+    return;
+
+  InterlockedExchange(&gState, buildIndex() ? XREF_READY : XREF_FAILED);
+  SetEvent(gEventDone);
+}
+
+static VOID CALLBACK buildCallback(
+  PTP_CALLBACK_INSTANCE instance,
+  PVOID context
+) {
+  (void)instance;
+  (void)context;
+  runBuild();
+}
+
+static BOOL CALLBACK initIndex(
+  PINIT_ONCE initOnce,
+  PVOID parameter,
+  PVOID *context
+) {
+  (void)initOnce;
+  (void)parameter;
+  (void)context;
+  gEventDone = CreateEventA(NULL, TRUE, FALSE, NULL);
+  return gEventDone != NULL;
+}
+
+HTMLAPI HTStatus HTXrefBuildIndex(i32 wait) {
+  if (!InitOnceExecuteOnce(&gInitOnce, initIndex, NULL, NULL))
+    return HT_FAIL;
+
+  if (
+    InterlockedCompareExchange(&gState, XREF_QUEUED, XREF_IDLE) == XREF_IDLE
+    && !TrySubmitThreadpoolCallback(buildCallback, NULL, NULL)
+  )
+    runBuild();
+
+  if (wait) {
+    // Claim the build if the worker isn't started yet. Mods usually call us
+    // from DllMain, where new worker threads are blocked by the loader lock.
+    runBuild();
+    WaitForSingleObject(gEventDone, INFINITE);
+  }
+
+  return InterlockedOr(&gState, 0) == XREF_FAILED ? HT_FAIL : HT_SUCCESS;
+}
+
+HTMLAPI u32 HTXrefFind(
+  const void *address,
+  u32 types,
+  void **sites,
+  u32 maxCount
+) {
+  u64 rva, lo, hi, mid;
+  u32 result = 0, type, len;
+  u08 *site, *target;
+
+  if (!address)
+    return 0;
+  if (
+    InterlockedOr(&gState, 0) != XREF_READY
+    && (!HTXrefBuildIndex(1) || InterlockedOr(&gState, 0) != XREF_READY)
+  )
+    return 0;
+
+  if ((const u08 *)address < gBase)
+    return 0;
+  rva = (u64)((const u08 *)address - gBase);
+  if (rva > 0xFFFFFFFFULL)
+    return 0;
+
+  // Lower bound of the target.
+  lo = 0;
+  hi = gCount;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if ((gEntries[mid] >> 32) < rva)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < gCount && (gEntries[lo] >> 32) == rva; lo++) {
+    site = gBase + (u32)gEntries[lo];
+    if ((types & HT_XREF_ALL) != HT_XREF_ALL) {
+      // The kind isn't stored in the index, decode the site again.
+      type = decodeRef(site, site + XREF_MAX_INSN, &target, &len);
+      if (!(type & types))
+        continue;
+    }
+    if (sites && result < maxCount)
+      sites[result] = (void *)site;
+    result++;
+  }
+
+  return result;
+}
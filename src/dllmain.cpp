@@ -234,7 +234,10 @@ BOOL APIENTRY DllMain(
 
     CreateThread(
       nullptr, 0, onAttach, (LPVOID)hModule, 0, nullptr);
+  } else if (dwReason == DLL_THREAD_DETACH) {
+    memThreadDetach();
   } else if (dwReason == DLL_PROCESS_DETACH) {
+    sigCacheFlushOnExit();
     MH_DisableHook(MH_ALL_HOOKS);
     MH_Uninitialize();
     FreeLibrary(hWinHttp);
@@ -9,3 +9,5 @@
 #include "logger.h"
 #include "loader.h"
 #include "proxy/winhttp-proxy.h"
+#include "api/mem.h"
+#include "api/sigcache.h"
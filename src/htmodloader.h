@@ -96,6 +96,10 @@ typedef enum {
   HT_SCAN_E8,
   // The signature represents the FF15 instruction that calls the function.
   HT_SCAN_FF15,
+  // The signature contains an instruction with a RIP-relative operand, e.g.
+  // `lea rcx, [rip + x]` or `mov rax, [rip + x]`, and the target of the
+  // operand is taken. Relative branches are resolved to their destination.
+  HT_SCAN_RIP,
 } HTSigScanType;
 
 // Signature code config.
@@ -106,19 +110,132 @@ typedef struct {
   const char *name;
   // Method for obtaining the final address.
   HTSigScanType indirect;
-  // The byte offset of 0xE8 or 0x15 byte for HT_SCAN_E8 and HT_SCAN_FF15, or
-  // the byte offset to the first instruction for HT_SCAN_DIRECT.
+  // The byte offset of 0xE8 or 0x15 byte for HT_SCAN_E8 and HT_SCAN_FF15,
+  // the byte offset to the first byte of the instruction (including prefixes)
+  // for HT_SCAN_RIP, or the byte offset to the first instruction for
+  // HT_SCAN_DIRECT.
   i32 offset;
 } HTSignature;
 
+// Section name that selects the whole image, including PE headers and data
+// sections.
+#define HT_SECTION_ANY "*"
+
+// Extended signature code config.
+typedef struct {
+  // Basic signature config.
+  HTSignature base;
+  // Name of the PE section to be scanned, e.g. ".rdata". NULL for all
+  // executable sections, or HT_SECTION_ANY for the whole image.
+  const char *section;
+  // Number of times the resolved address is dereferenced as a pointer, e.g.
+  // 1 to get the value of a global pointer located with HT_SCAN_RIP.
+  u32 deref;
+  // Zero-based index of the match to be taken in address order, e.g. 2 for
+  // the 3rd occurrence. 0 takes the first match.
+  u32 nth;
+  // Module to be scanned, e.g. a DLL bundled with the game. NULL for Sky.exe
+  // if `moduleName` is also NULL.
+  HMODULE module;
+  // Name of the module to be scanned, e.g. "fmod.dll". Only used if `module`
+  // is NULL.
+  const char *moduleName;
+  // Explicit range [begin, end) to be scanned instead of a module, e.g. JIT
+  // code or heap blocks. Unreadable pages are skipped, and `section` is
+  // ignored.
+  const void *begin;
+  const void *end;
+} HTSignatureEx;
+
 /**
- * Scan with signature.
+ * Scan with signature. Only executable sections are scanned.
  */
 HTMLAPI void *HTSigScan(
   const HTSignature *signature);
 typedef void *(HTMLAPI *PFN_HTSigScan)(
   const HTSignature *signature);
 
+/**
+ * Scan with extended signature in specified sections, modules or ranges.
+ */
+HTMLAPI void *HTSigScanEx(
+  const HTSignatureEx *signature);
+typedef void *(HTMLAPI *PFN_HTSigScanEx)(
+  const HTSignatureEx *signature);
+
+// Callback of HTSigScanAll(), called with the resolved address and the
+// index of every match in address order. Returns 0 to stop the scan.
+typedef i32 (HTMLAPI *PFN_HTSigScanCallback)(
+  void *address, u32 index, void *user);
+
+/**
+ * Scan all matches of the extended signature with one sweep, `nth` is
+ * ignored. Resolved addresses are written into `results` until `maxCount`
+ * is reached, and passed to `callback` if it's not NULL. Either of them can
+ * be omitted. Returns the number of matches visited.
+ */
+HTMLAPI u32 HTSigScanAll(
+  const HTSignatureEx *signature, void **results, u32 maxCount,
+  PFN_HTSigScanCallback callback, void *user);
+typedef u32 (HTMLAPI *PFN_HTSigScanAll)(
+  const HTSignatureEx *signature, void **results, u32 maxCount,
+  PFN_HTSigScanCallback callback, void *user);
+
+// Size of the signature buffer of HTFuzzyResult.
+#define HT_FUZZY_SIG_SIZE 384
+
+// Result of a fuzzy scan.
+typedef struct {
+  // Address resolved from the best candidate, NULL if not found.
+  void *address;
+  // Similarity between the candidate and the last known match, from 0 to 1.
+  // It's 1 if the signature still matches.
+  f32 confidence;
+  // Signature generated from the candidate, unique if possible.
+  char signature[HT_FUZZY_SIG_SIZE];
+} HTFuzzyResult;
+
+/**
+ * Scan with signature, or find the code most similar to its last known
+ * match if it no longer matches, e.g. after game updates. Bytes at the match
+ * are recorded by every successful scan. The candidate isn't cached, it's up
+ * to the mod whether to accept it by the confidence. Only matches in Sky.exe
+ * are recorded, so other modules and ranges are scanned exactly.
+ */
+HTMLAPI HTStatus HTSigScanFuzzy(
+  const HTSignatureEx *signature, HTFuzzyResult *result);
+typedef HTStatus (HTMLAPI *PFN_HTSigScanFuzzy)(
+  const HTSignatureEx *signature, HTFuzzyResult *result);
+
+// Compiled signature, created with HTCompileSignature(). It's immutable and
+// can be scanned repeatedly without parsing the signature again.
+typedef struct HTCompiledSignature HTCompiledSignature;
+
+/**
+ * Compile the signature into packed byte and mask arrays with selected
+ * anchors. Returns NULL if the signature is invalid.
+ */
+HTMLAPI HTCompiledSignature *HTCompileSignature(
+  const HTSignatureEx *signature);
+typedef HTCompiledSignature *(HTMLAPI *PFN_HTCompileSignature)(
+  const HTSignatureEx *signature);
+
+/**
+ * Scan with compiled signature.
+ */
+HTMLAPI void *HTSigScanCompiled(
+  const HTCompiledSignature *compiled);
+typedef void *(HTMLAPI *PFN_HTSigScanCompiled)(
+  const HTCompiledSignature *compiled);
+
+/**
+ * Free the compiled signature.
+ */
+HTMLAPI void HTFreeCompiledSignature(
+  HTCompiledSignature *compiled);
+typedef void (HTMLAPI *PFN_HTFreeCompiledSignature)(
+  HTCompiledSignature *compiled);
+
 // Function address config.
 typedef struct {
   // The address of the detour function if hooked.
@@ -145,12 +262,45 @@ HTMLAPI HTStatus HTSigScanFuncEx(
 typedef HTStatus (HTMLAPI *PFN_HTSigScanFuncEx)(
   const HTSignature **signature, HTHookFunction **func, u32 size);
 
+// Kinds of cross references, can be combined as flags.
+typedef enum {
+  // E8 call instructions.
+  HT_XREF_CALL = 1 << 0,
+  // E9 jmp and near jcc instructions.
+  HT_XREF_JMP = 1 << 1,
+  // Instructions with RIP-relative memory operands, e.g. lea, mov and cmp.
+  HT_XREF_DATA = 1 << 2,
+  HT_XREF_ALL = HT_XREF_CALL | HT_XREF_JMP | HT_XREF_DATA
+} HTXrefType;
+
+/**
+ * Start building the cross reference index of the executable sections in
+ * background. The index is built only once. If `wait` is non-zero, returns
+ * after the index is ready.
+ */
+HTMLAPI HTStatus HTXrefBuildIndex(
+  i32 wait);
+typedef HTStatus (HTMLAPI *PFN_HTXrefBuildIndex)(
+  i32 wait);
+
+/**
+ * Find all instructions that call, jump to or reference `address`. At most
+ * `maxCount` sites are written into `sites` in address order, and the total
+ * number of sites is returned. The index is built first if not ready.
+ */
+HTMLAPI u32 HTXrefFind(
+  const void *address, u32 types, void **sites, u32 maxCount);
+typedef u32 (HTMLAPI *PFN_HTXrefFind)(
+  const void *address, u32 types, void **sites, u32 maxCount);
+
 // ----------------------------------------------------------------------------
 // [SECTION] HTML inline hook APIs.
 // ----------------------------------------------------------------------------
 
 /**
- * Install hook with MinHook.
+ * Install hook on specified function. Hooks of several mods on the same
+ * function are chained, and `origin` calls the next enabled detour in the
+ * chain, or the original function at the end.
  */
 HTMLAPI HTStatus HTInstallHook(
   void *fn, void *detour, void **origin);
@@ -158,7 +308,93 @@ typedef HTStatus (HTMLAPI *PFN_HTInstallHook)(
   void *fn, void *detour, void **origin);
 
 /**
- * Enable hook on specified function.
+ * Install hook with priority in the chain. Detours of higher priority are
+ * called first, and detours of the same priority in install order.
+ * HTInstallHook() uses priority 0.
+ */
+HTMLAPI HTStatus HTInstallHookPriority(
+  void *fn, void *detour, void **origin, i32 priority);
+typedef HTStatus (HTMLAPI *PFN_HTInstallHookPriority)(
+  void *fn, void *detour, void **origin, i32 priority);
+
+/**
+ * Install hook on a virtual method by swapping `vtable[index]`, so only
+ * objects of that class are intercepted and no code is patched. Hooks on
+ * the same slot are chained as well. Use `&vtable[index]` as the function
+ * for the enable and disable APIs, the original method is restored once no
+ * detour of the slot is enabled.
+ */
+HTMLAPI HTStatus HTInstallVtableHook(
+  void **vtable, u32 index, void *detour, void **origin);
+typedef HTStatus (HTMLAPI *PFN_HTInstallVtableHook)(
+  void **vtable, u32 index, void *detour, void **origin);
+
+/**
+ * Find the import address table entry of `symbol` imported by `module` from
+ * `dll`. NULL selects Sky.exe, the DLL name is case-insensitive and ".dll"
+ * may be omitted, and `symbol` may be an ordinal like in GetProcAddress().
+ * The import directory of each module is parsed only once.
+ */
+HTMLAPI void **HTFindIatEntry(
+  HMODULE module, const char *dll, const char *symbol);
+typedef void **(HTMLAPI *PFN_HTFindIatEntry)(
+  HMODULE module, const char *dll, const char *symbol);
+
+/**
+ * Install hook on an import of `module` by swapping its IAT entry, so only
+ * calls from that module are intercepted and no code is patched. Arguments
+ * are the same as HTFindIatEntry(), whose result is used as the function
+ * for the enable and disable APIs.
+ *
+ * The IAT may be in a read-only or executable section. Its page is only
+ * made writable while the entry is swapped, keeping the execute bit, and
+ * its protection is restored afterwards.
+ */
+HTMLAPI HTStatus HTInstallIatHook(
+  HMODULE module, const char *dll, const char *symbol, void *detour,
+  void **origin);
+typedef HTStatus (HTMLAPI *PFN_HTInstallIatHook)(
+  HMODULE module, const char *dll, const char *symbol, void *detour,
+  void **origin);
+
+// An xmm register.
+typedef union {
+  f32 f[4];
+  f64 d[2];
+  u32 u[4];
+  u64 q[2];
+} HTXmmRegister;
+
+// Registers at a mid-function hook. Changes made by the callback are
+// written back before the hooked code resumes, except rsp.
+typedef struct {
+  HTXmmRegister xmm[6];
+  u64 rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi;
+  u64 r8, r9, r10, r11, r12, r13, r14, r15;
+  u64 rflags;
+} HTRegisterContext;
+
+typedef void (HTMLAPI *PFN_HTMidHookCallback)(
+  HTRegisterContext *context, void *user);
+
+/**
+ * Install hook on an arbitrary instruction. The instructions overwritten by
+ * the jump are relocated, and `callback` is called with the registers every
+ * time `address` is reached. The hook is chained with other hooks on the
+ * same address, and `address` is used for the enable and disable APIs.
+ * `address` must not be in the middle of an instruction, and no jump may
+ * target the 5 bytes after it.
+ */
+HTMLAPI HTStatus HTInstallMidHook(
+  void *address, PFN_HTMidHookCallback callback, void *user);
+typedef HTStatus (HTMLAPI *PFN_HTInstallMidHook)(
+  void *address, PFN_HTMidHookCallback callback, void *user);
+
+/**
+ * Enable hook on specified function. Only detours in the calling mod are
+ * enabled. If the mod owns none of them, detours in generated code owned
+ * by no module are enabled instead, and HT_FAIL is returned if there's
+ * none.
  */
 HTMLAPI HTStatus HTEnableHook(
   void *fn);
@@ -166,7 +402,14 @@ typedef HTStatus (HTMLAPI *PFN_HTEnableHook)(
   void *fn);
 
 /**
- * Disable hook on specified function.
+ * Disable hook on specified function. Only detours in the calling mod are
+ * disabled. If the mod owns none of them, detours in generated code owned
+ * by no module are disabled instead, and HT_FAIL is returned if there's
+ * none.
+ *
+ * The function stays patched and calls the original directly once no
+ * detour is enabled, so enabling and disabling can be called from any
+ * thread without freezing the process again.
  */
 HTMLAPI HTStatus HTDisableHook(
   void *fn);
@@ -182,21 +425,123 @@ typedef HTStatus (HTMLAPI *PFN_HTInstallHookEx)(
   HTHookFunction *func);
 
 /**
- * Enable hook on specified function.
- */ 
+ * Enable the detour of HTHookFunction struct.
+ */
 HTMLAPI HTStatus HTEnableHookEx(
   HTHookFunction *func);
 typedef void (HTMLAPI *PFN_HTEnableHookEx)(
   HTHookFunction *func);
 
 /**
- * Disable hook on specified function.
+ * Disable the detour of HTHookFunction struct.
  */
 HTMLAPI HTStatus HTDisableHookEx(
   HTHookFunction *func);
 typedef void (HTMLAPI *PFN_HTDisableHookEx)(
   HTHookFunction *func);
 
+// Hook transaction, created with HTHookBegin(). Queued hooks are enabled or
+// disabled together on commit, with game threads frozen only once.
+typedef struct HTHookTransaction HTHookTransaction;
+
+/**
+ * Begin a hook transaction. Returns NULL if out of memory.
+ */
+HTMLAPI HTHookTransaction *HTHookBegin(
+  void);
+typedef HTHookTransaction *(HTMLAPI *PFN_HTHookBegin)(
+  void);
+
+/**
+ * Queue an installed hook to be enabled, or disabled if `enable` is 0. Like
+ * HTEnableHook(), only detours in the calling mod are selected. The result
+ * of the hook is written into `status` on commit, it can be NULL.
+ */
+HTMLAPI HTStatus HTHookQueue(
+  HTHookTransaction *transaction, void *fn, i32 enable, HTStatus *status);
+typedef HTStatus (HTMLAPI *PFN_HTHookQueue)(
+  HTHookTransaction *transaction, void *fn, i32 enable, HTStatus *status);
+
+/**
+ * Apply all queued hooks under one thread freeze, and free the transaction.
+ * Returns HT_FAIL if any of the hooks failed.
+ */
+HTMLAPI HTStatus HTHookCommit(
+  HTHookTransaction *transaction);
+typedef HTStatus (HTMLAPI *PFN_HTHookCommit)(
+  HTHookTransaction *transaction);
+
+/**
+ * Free the transaction without applying it.
+ */
+HTMLAPI void HTHookAbort(
+  HTHookTransaction *transaction);
+typedef void (HTMLAPI *PFN_HTHookAbort)(
+  HTHookTransaction *transaction);
+
+/**
+ * Install and enable an array of hooks, e.g. scanned with HTSigScanFuncEx(),
+ * under one thread freeze. Per-hook results are written into `status` if
+ * it's not NULL. Returns HT_FAIL if any of the hooks failed.
+ */
+HTMLAPI HTStatus HTInstallHookBatch(
+  HTHookFunction **func, u32 size, HTStatus *status);
+typedef HTStatus (HTMLAPI *PFN_HTInstallHookBatch)(
+  HTHookFunction **func, u32 size, HTStatus *status);
+
+// Profile of a hook detour, cycles are read with rdtsc.
+typedef struct {
+  // Hooked function.
+  void *fn;
+  // Detour of the mod.
+  void *detour;
+  // Module containing the detour.
+  HMODULE owner;
+  // Number of calls.
+  u64 calls;
+  // Cycles spent in the detour, including the rest of the chain.
+  u64 cycles;
+  // Cycles excluding other profiled detours called inside.
+  u64 selfCycles;
+  // Max cycles of a single call.
+  u64 maxCycles;
+} HTHookProfile;
+
+/**
+ * Enable or disable hook profiling. Detours are wrapped with timing thunks
+ * only while it's enabled, otherwise chains jump to detours directly.
+ */
+HTMLAPI HTStatus HTHookProfilerEnable(
+  i32 enable);
+typedef HTStatus (HTMLAPI *PFN_HTHookProfilerEnable)(
+  i32 enable);
+
+/**
+ * Get the profiles of all detours since the last reset. Returns the number
+ * of profiles written, or the number of detours if `profiles` is NULL.
+ */
+HTMLAPI u32 HTHookProfilerQuery(
+  HTHookProfile *profiles, u32 maxCount);
+typedef u32 (HTMLAPI *PFN_HTHookProfilerQuery)(
+  HTHookProfile *profiles, u32 maxCount);
+
+/**
+ * Clear the profiles of all detours.
+ */
+HTMLAPI void HTHookProfilerReset(
+  void);
+typedef void (HTMLAPI *PFN_HTHookProfilerReset)(
+  void);
+
+/**
+ * Get the estimated number of cycles per second, measured since profiling
+ * is enabled. Returns 0 if it's not measured yet.
+ */
+HTMLAPI u64 HTHookProfilerFrequency(
+  void);
+typedef u64 (HTMLAPI *PFN_HTHookProfilerFrequency)(
+  void);
+
 // ----------------------------------------------------------------------------
 // [SECTION] HTML memory manager APIs.
 // ----------------------------------------------------------------------------
@@ -223,6 +568,100 @@ void *HTMemNew(
 HTStatus HTMemFree(
   void *pointer);
 
+// Memory arena of a mod, created with HTArenaCreate(). Blocks are allocated
+// linearly from a reserved virtual region and released all at once.
+typedef struct HTArena HTArena;
+
+// Memory usage of an arena.
+typedef struct {
+  // Module owning the arena.
+  HMODULE owner;
+  // Size of the reserved region.
+  u64 reserved;
+  // Size of the committed part of the region.
+  u64 committed;
+  // Bytes allocated since the last reset.
+  u64 liveBytes;
+  // Max of live bytes since the arena is created.
+  u64 peakBytes;
+  // Number of blocks allocated since the last reset.
+  u64 allocCount;
+  // Number of blocks allocated since the arena is created.
+  u64 totalAllocs;
+} HTArenaStats;
+
+/**
+ * Create an arena owned by the mod, reserving `reserveSize` bytes of address
+ * space. Pages are committed as they're allocated. A default size is used
+ * if `reserveSize` is 0. Returns NULL on failure.
+ */
+HTMLAPI HTArena *HTArenaCreate(
+  HMODULE hModule, u64 reserveSize);
+typedef HTArena *(HTMLAPI *PFN_HTArenaCreate)(
+  HMODULE hModule, u64 reserveSize);
+
+/**
+ * Allocate a block aligned to 16 bytes from the arena. Blocks can't be freed
+ * individually. Returns NULL when the reserved region is exhausted, or the
+ * arena is destroyed.
+ *
+ * Allocation is thread-safe, a reset waits for allocations in progress.
+ */
+HTMLAPI void *HTArenaAlloc(
+  HTArena *arena, u64 size);
+typedef void *(HTMLAPI *PFN_HTArenaAlloc)(
+  HTArena *arena, u64 size);
+
+/**
+ * Release all blocks of the arena at once. Committed pages are kept for
+ * later allocations.
+ */
+HTMLAPI HTStatus HTArenaReset(
+  HTArena *arena);
+typedef HTStatus (HTMLAPI *PFN_HTArenaReset)(
+  HTArena *arena);
+
+/**
+ * Destroy the arena and release its region. Handles are never reused, so
+ * later calls with a destroyed handle fail instead of crashing.
+ */
+HTMLAPI HTStatus HTArenaDestroy(
+  HTArena *arena);
+typedef HTStatus (HTMLAPI *PFN_HTArenaDestroy)(
+  HTArena *arena);
+
+/**
+ * Get the memory usage of the arena.
+ */
+HTMLAPI HTStatus HTArenaGetStats(
+  HTArena *arena, HTArenaStats *stats);
+typedef HTStatus (HTMLAPI *PFN_HTArenaGetStats)(
+  HTArena *arena, HTArenaStats *stats);
+
+// Number of frame scratch buffers of a thread. A block from HTFrameAlloc()
+// stays valid until this many frames are presented, counting the current.
+#define HT_FRAME_BUFFERS 3
+
+/**
+ * Allocate a block aligned to 16 bytes from the frame scratch buffer of the
+ * calling thread. Blocks are never freed, the buffer is reused by a later
+ * frame. Returns NULL when a thread allocates more than 16MB in a frame.
+ *
+ * Blocks of a thread are released when the thread exits.
+ */
+HTMLAPI void *HTFrameAlloc(
+  u64 size);
+typedef void *(HTMLAPI *PFN_HTFrameAlloc)(
+  u64 size);
+
+/**
+ * Get the number of frames presented, the index of the current frame.
+ */
+HTMLAPI u64 HTFrameGetIndex(
+  void);
+typedef u64 (HTMLAPI *PFN_HTFrameGetIndex)(
+  void);
+
 // ----------------------------------------------------------------------------
 // [SECTION] HTML mod communication APIs.
 // ----------------------------------------------------------------------------
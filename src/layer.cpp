@@ -19,6 +19,7 @@
 
 #include "aliases.h"
 #include "globals.h"
+#include "api/mem.h"
 #include "ui/gui.h"
 
 // ----------------------------------------------------------------------------
@@ -546,6 +547,10 @@ static VkResult renderGui(
     // Wait indefinitely instead of periodically checking.
     vkWaitForFences(g->device, 1, &f->Fence, VK_TRUE, UINT64_MAX);
     vkResetFences(g->device, 1, &f->Fence);
+    // The frame last drawn with the image is done, so is the oldest scratch
+    // buffer.
+    if (i == 0)
+      memFrameAdvance();
 
     {
       vkResetCommandPool(g->device, f->CommandPool, 0);
@@ -842,8 +847,11 @@ static VKAPI_ATTR VkResult VKAPI_CALL HT_vkQueuePresentKHR(
   VkQueue queue,
   const VkPresentInfoKHR *pPresentInfo
 ) {
-  if (!gGameStatus.window)
+  if (!gGameStatus.window) {
+    // No fence of ours to wait for before the GUI is set up.
+    memFrameAdvance();
     return getDeviceDispatchTable(getQueueData(queue)->device->device)->QueuePresentKHR(queue, pPresentInfo);
+  }
   if (!gGuiStatus.isInited) {
     initVulkan();
     HTInitGUI();
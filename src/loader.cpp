@@ -5,6 +5,7 @@
 #include "globals.h"
 #include "aliases.h"
 #include "htmodloader.h"
+#include "api/sigcache.h"
 
 std::unordered_map<std::string, ModManifest> gModDataLoader;
 
@@ -236,6 +237,9 @@ HTStatus HTLoadMods() {
   scanMods();
   loadMods();
 
+  // Save signature scan results of all mods for the next launch.
+  sigCacheFlush();
+
   return HT_SUCCESS;
 }
 
@@ -1,4 +1,5 @@
 #include <windows.h>
+#include <stdio.h>
 #include "imgui.h"
 #include "imgui_impl_win32.h"
 #include "imgui_impl_vulkan.h"
@@ -7,9 +8,11 @@
 #include "ui/input.h"
 #include "ui/gui.h"
 #include "ui/console.h"
+#include "ui/profiler.h"
 
 #include "globals.h"
 #include "loader.h"
+#include "api/mem.h"
 
 static bool gShowMainMenu = true
   , gFirstFrame = true;
@@ -25,11 +28,29 @@ static void HTMenuAbouts() {
   ImGui::Text("<https://www.github.com/HTMonkeyG/HTML-Sky>");
 }
 
+/**
+ * Format a byte count with a binary unit.
+ */
+static void formatBytes(char *buf, u64 size, u64 bytes) {
+  static const char *units[] = {"B", "KB", "MB", "GB"};
+  f64 value = (f64)bytes;
+  u32 unit = 0;
+
+  while (value >= 1024 && unit < 3) {
+    value /= 1024;
+    unit++;
+  }
+  snprintf(buf, size, unit ? "%.1f %s" : "%.0f %s", value, units[unit]);
+}
+
 /**
  * Render mod list tab item.
  */
 static void HTMenuModList() {
   i32 i = 0;
+  HTArenaStats arenas;
+  u32 arenaCount;
+  char live[32], peak[32];
 
   if (!ImGui::BeginChild("##HTModList"))
     return (void)ImGui::EndChild();
@@ -43,6 +64,10 @@ static void HTMenuModList() {
   for (auto it = gModDataLoader.begin(); it != gModDataLoader.end(); ++it, i++) {
     ModManifest &manifest = it->second;
 
+    // One more line for the memory usage of arenas.
+    arenaCount = memArenaUsage(manifest.runtime.handle, &arenas);
+    size.y = ImGui::GetTextLineHeight() * (arenaCount ? 5 : 4);
+
     // Show mod info.
     ImGuiID childId = ImGui::GetID((void *)(u64)i);
     ImGui::BeginChild(childId, size, ImGuiChildFlags_Borders);
@@ -53,6 +78,16 @@ static void HTMenuModList() {
     // Show mod description.
     ImGui::PushStyleColor(ImGuiCol_Text, modDescColor);
     ImGui::TextWrapped("%s", manifest.description.data());
+    if (arenaCount) {
+      formatBytes(live, sizeof(live), arenas.liveBytes);
+      formatBytes(peak, sizeof(peak), arenas.peakBytes);
+      ImGui::Text(
+        "Arenas: %u, live %s, peak %s, %llu allocs",
+        arenaCount,
+        live,
+        peak,
+        arenas.allocCount);
+    }
     ImGui::PopStyleColor();
 
     ImGui::EndChild();
@@ -130,6 +165,10 @@ void HTUpdateGUI() {
       HTMenuModList();
       ImGui::EndTabItem();
     }
+    if (ImGui::BeginTabItem("Profiler")) {
+      HTMenuProfiler();
+      ImGui::EndTabItem();
+    }
     if (ImGui::BeginTabItem("Settings")) {
       ImGui::EndTabItem();
     }
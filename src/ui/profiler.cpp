@@ -0,0 +1,119 @@
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include "imgui.h"
+
+#include "aliases.h"
+#include "htmodloader.h"
+#include "globals.h"
+#include "api/hookprof.h"
+#include "ui/profiler.h"
+
+static ImVector<HTHookProfile> gProfiles;
+
+/**
+ * Format the hooked function as an offset in Sky.exe if possible.
+ */
+static void formatTarget(char *buf, u64 size, void *fn) {
+  u08 *base = (u08 *)gGameStatus.baseAddr;
+  HMODULE module = nullptr;
+
+  if (
+    GetModuleHandleExA(
+      GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS
+      | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+      (LPCSTR)fn,
+      &module)
+    && (u08 *)module == base
+  )
+    snprintf(buf, size, "Sky.exe+0x%llX", (u64)((u08 *)fn - base));
+  else
+    snprintf(buf, size, "0x%p", fn);
+}
+
+/**
+ * Get the file name of the mod owning the detour.
+ */
+static void formatOwner(char *buf, u64 size, HMODULE owner) {
+  char path[MAX_PATH];
+  const char *name;
+
+  if (!owner || !GetModuleFileNameA(owner, path, MAX_PATH)) {
+    snprintf(buf, size, "?");
+    return;
+  }
+  name = strrchr(path, '\\');
+  snprintf(buf, size, "%s", name ? name + 1 : path);
+}
+
+/**
+ * Render hook profiler tab item.
+ */
+void HTMenuProfiler() {
+  bool enabled = hookProfIsEnabled();
+  char target[64], owner[MAX_PATH];
+  u32 count;
+  f64 toMicro;
+  u64 frequency;
+
+  if (ImGui::Checkbox("Enable profiling", &enabled))
+    HTHookProfilerEnable(enabled);
+  ImGui::SameLine();
+  if (ImGui::Button("Reset"))
+    HTHookProfilerReset();
+
+  count = HTHookProfilerQuery(nullptr, 0);
+  gProfiles.resize((int)count);
+  if (count)
+    count = HTHookProfilerQuery(gProfiles.Data, count);
+
+  // Shown in cycles until the frequency is measured.
+  frequency = HTHookProfilerFrequency();
+  toMicro = frequency ? 1e6 / (f64)frequency : 1.0;
+
+  if (!ImGui::BeginTable(
+    "##HTProfiler",
+    6,
+    ImGuiTableFlags_Borders
+      | ImGuiTableFlags_RowBg
+      | ImGuiTableFlags_Resizable
+      | ImGuiTableFlags_ScrollY
+  ))
+    return;
+
+  ImGui::TableSetupScrollFreeze(0, 1);
+  ImGui::TableSetupColumn("Function");
+  ImGui::TableSetupColumn("Mod");
+  ImGui::TableSetupColumn("Calls");
+  ImGui::TableSetupColumn(frequency ? "Avg (us)" : "Avg (cycles)");
+  ImGui::TableSetupColumn(frequency ? "Self (us)" : "Self (cycles)");
+  ImGui::TableSetupColumn(frequency ? "Max (us)" : "Max (cycles)");
+  ImGui::TableHeadersRow();
+
+  for (u32 i = 0; i < count; i++) {
+    HTHookProfile &profile = gProfiles[i];
+
+    formatTarget(target, sizeof(target), profile.fn);
+    formatOwner(owner, sizeof(owner), profile.owner);
+
+    ImGui::TableNextRow();
+    ImGui::TableNextColumn();
+    ImGui::TextUnformatted(target);
+    ImGui::TableNextColumn();
+    ImGui::TextUnformatted(owner);
+    ImGui::TableNextColumn();
+    ImGui::Text("%llu", profile.calls);
+    ImGui::TableNextColumn();
+    ImGui::Text(
+      "%.2f",
+      profile.calls ? profile.cycles * toMicro / profile.calls : 0.0);
+    ImGui::TableNextColumn();
+    ImGui::Text(
+      "%.2f",
+      profile.calls ? profile.selfCycles * toMicro / profile.calls : 0.0);
+    ImGui::TableNextColumn();
+    ImGui::Text("%.2f", profile.maxCycles * toMicro);
+  }
+
+  ImGui::EndTable();
+}
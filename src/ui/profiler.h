@@ -0,0 +1,14 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void HTMenuProfiler();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,588 @@
+// ----------------------------------------------------------------------------
+// Offline benchmark and regression harness of the signature engine.
+//
+// Maps a PE file from disk, or generates a synthetic image, and runs the
+// single and multi-pattern searchers of sigengine.c over its executable
+// sections. Every match is checked against the reference scalar searcher.
+// Runs on any x86-64 host, no Windows or game required.
+//
+// Usage: sigbench [options] <image.exe | --random MB>
+//   -s <section>   Scan the named section instead of executable sections.
+//   -f <file>      Load signatures from file, one per line, optionally as
+//                  `name = signature`. Lines starting with # are ignored.
+//   -g <count>     Number of signatures sampled from the image, default 64.
+//   -n <count>     Number of timed iterations, the best one is reported.
+//   -r <seed>      Random seed.
+// ----------------------------------------------------------------------------
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aliases.h"
+#include "api/sigengine.h"
+
+#define BENCH_MAX_SIGS 4096
+#define BENCH_MAX_RANGES 96
+#define BENCH_SIG_LEN 1024
+
+// PE section flags.
+#define BENCH_SCN_MEM_EXECUTE 0x20000000
+
+// Memory range of the mapped image.
+typedef struct {
+  const u08 *begin;
+  const u08 *end;
+} BenchRange;
+
+// Image mapped to its virtual layout.
+typedef struct {
+  u08 *base;
+  u64 size;
+  BenchRange ranges[BENCH_MAX_RANGES];
+  u32 count;
+} BenchImage;
+
+// Signature of the corpus.
+typedef struct {
+  char name[64];
+  char sig[BENCH_SIG_LEN];
+  SigPattern pattern;
+  // Match of the reference searcher.
+  const u08 *expected;
+} BenchSig;
+
+// Common x86-64 MSVC prologue and idiom signatures, the same shapes mods
+// use for game functions.
+static const char *gBuiltinSigs[][2] = {
+  {"prologue_rbx_rsi", "48 89 5C 24 ?? 48 89 74 24 ?? 57 48 83 EC ??"},
+  {"prologue_rbx_rbp_rsi", "48 89 5C 24 ?? 48 89 6C 24 ?? 48 89 74 24 ?? 57 48 83 EC ??"},
+  {"prologue_r14_r15", "40 53 55 56 57 41 54 41 55 41 56 41 57 48 81 EC ?? ?? ?? ??"},
+  {"prologue_frame", "48 8B C4 48 89 58 ?? 48 89 68 ?? 48 89 70 ?? 48 89 78 ?? 41 56"},
+  {"security_cookie", "48 8B 05 ?? ?? ?? ?? 48 33 C4 48 89 84 24 ?? ?? ?? ??"},
+  {"tls_access", "65 48 8B 04 25 58 00 00 00 48 8B 04 C8"},
+  {"vtable_store", "48 8D 05 ?? ?? ?? ?? 48 89 01 48 8B C1 C3"},
+  {"singleton_get", "48 8B 05 ?? ?? ?? ?? 48 85 C0 75 ?? E8 ?? ?? ?? ?? 48 8B 05"},
+  {"float_compare", "0F 2F C1 76 ?? F3 0F 10 05 ?? ?? ?? ?? C3"},
+  {"memset_loop", "48 8B C1 4C 8B C9 4C 8D 15 ?? ?? ?? ?? 0F B6 D2"},
+  {"long_run", "48 89 5C 24 08 48 89 6C 24 10 48 89 74 24 18 57 41 54 41 55 41 56 41 57 48 83 EC 40 4C 8B F9 48 8B DA 48 8B 0D ?? ?? ?? ?? 45 33 E4 41 8B EC"},
+  {"missing", "DE AD BE EF ?? ?? 13 37 C0 FF EE"}
+};
+
+static BenchImage gImage;
+static BenchSig *gSigs;
+static u32 gSigCount;
+
+/**
+ * Get monotonic time in seconds.
+ */
+static f64 now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (f64)ts.tv_sec + (f64)ts.tv_nsec * 1e-9;
+}
+
+static u32 readU16(const u08 *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static u32 readU32(const u08 *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+/**
+ * Append a range, merging it with the previous one if adjacent, as the
+ * scanner does.
+ */
+static void addRange(BenchImage *image, const u08 *begin, const u08 *end) {
+  BenchRange *last;
+
+  if (begin >= end)
+    return;
+  last = image->count ? &image->ranges[image->count - 1] : NULL;
+  if (last && last->end == begin) {
+    last->end = end;
+    return;
+  }
+  if (image->count == BENCH_MAX_RANGES)
+    return;
+  image->ranges[image->count].begin = begin;
+  image->ranges[image->count].end = end;
+  image->count++;
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Image loading.
+// ----------------------------------------------------------------------------
+
+/**
+ * Read the PE file and map its sections to their virtual addresses.
+ */
+static i32 loadPeImage(const char *path, const char *filter, BenchImage *image) {
+  FILE *fd;
+  u08 *file = NULL, *sectionTable, *header;
+  u64 fileSize;
+  u32 ntOffset, sectionCount, optionalSize, alignment, headerSize
+    , va, virtualSize, rawSize, rawOffset, characteristics, size;
+  char name[9];
+  i32 selected;
+
+  fd = fopen(path, "rb");
+  if (!fd) {
+    fprintf(stderr, "Cannot open %s.\n", path);
+    return 0;
+  }
+  fseek(fd, 0, SEEK_END);
+  fileSize = (u64)ftell(fd);
+  fseek(fd, 0, SEEK_SET);
+  file = (u08 *)malloc(fileSize ? fileSize : 1);
+  if (!file || fread(file, 1, fileSize, fd) != fileSize) {
+    fclose(fd);
+    free(file);
+    fprintf(stderr, "Cannot read %s.\n", path);
+    return 0;
+  }
+  fclose(fd);
+
+  if (fileSize < 0x40 || file[0] != 'M' || file[1] != 'Z')
+    goto INVALID;
+  ntOffset = readU32(file + 0x3C);
+  if ((u64)ntOffset + 24 > fileSize || memcmp(file + ntOffset, "PE\0\0", 4))
+    goto INVALID;
+
+  sectionCount = readU16(file + ntOffset + 6);
+  optionalSize = readU16(file + ntOffset + 20);
+  header = file + ntOffset + 24;
+  if ((u64)ntOffset + 24 + optionalSize + sectionCount * 40ULL > fileSize)
+    goto INVALID;
+  // Same offsets for PE32 and PE32+.
+  alignment = readU32(header + 32);
+  image->size = readU32(header + 56);
+  headerSize = readU32(header + 60);
+  if (!alignment)
+    alignment = 0x1000;
+  if (headerSize > fileSize)
+    headerSize = (u32)fileSize;
+
+  image->base = (u08 *)calloc(1, image->size);
+  if (!image->base)
+    goto INVALID;
+  memcpy(image->base, file, headerSize < image->size ? headerSize : image->size);
+
+  sectionTable = header + optionalSize;
+  for (u32 i = 0; i < sectionCount; i++) {
+    u08 *section = sectionTable + i * 40;
+
+    memcpy(name, section, 8);
+    name[8] = 0;
+    virtualSize = readU32(section + 8);
+    va = readU32(section + 12);
+    rawSize = readU32(section + 16);
+    rawOffset = readU32(section + 20);
+    characteristics = readU32(section + 36);
+    if (va >= image->size)
+      continue;
+
+    // Raw data.
+    size = rawSize;
+    if (virtualSize && size > virtualSize)
+      size = virtualSize;
+    if (size > image->size - va)
+      size = (u32)(image->size - va);
+    if ((u64)rawOffset + size > fileSize)
+      size = rawOffset < fileSize ? (u32)(fileSize - rawOffset) : 0;
+    memcpy(image->base + va, file + rawOffset, size);
+
+    // Mapped size, the same as the scanner sees.
+    size = virtualSize > rawSize ? virtualSize : rawSize;
+    size = (size + alignment - 1) / alignment * alignment;
+    if (size > image->size - va)
+      size = (u32)(image->size - va);
+
+    selected = filter
+      ? !strcmp(name, filter)
+      : !!(characteristics & BENCH_SCN_MEM_EXECUTE);
+    if (selected)
+      addRange(image, image->base + va, image->base + va + size);
+  }
+
+  free(file);
+  return image->count > 0;
+
+INVALID:
+  free(file);
+  fprintf(stderr, "%s is not a valid PE file.\n", path);
+  return 0;
+}
+
+/**
+ * Generate a synthetic image with a byte distribution skewed towards
+ * common opcodes.
+ */
+static i32 loadRandomImage(u64 megabytes, BenchImage *image) {
+  static const u08 common[] = {
+    0x00, 0x48, 0x8B, 0x89, 0xCC, 0xFF, 0x4C, 0x24, 0x0F, 0xE8, 0x8D, 0x85
+  };
+
+  image->size = megabytes << 20;
+  image->base = (u08 *)malloc(image->size);
+  if (!image->base || !image->size)
+    return 0;
+
+  for (u64 i = 0; i < image->size; i++) {
+    u32 r = (u32)rand();
+    image->base[i] = (r & 1)
+      ? common[(r >> 1) % sizeof(common)]
+      : (u08)(r >> 8);
+  }
+  addRange(image, image->base, image->base + image->size);
+
+  return 1;
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Signature corpus.
+// ----------------------------------------------------------------------------
+
+static BenchSig *addSig(const char *name, const char *sig) {
+  BenchSig *s;
+
+  if (gSigCount == BENCH_MAX_SIGS)
+    return NULL;
+  s = &gSigs[gSigCount];
+  snprintf(s->name, sizeof(s->name), "%s", name);
+  snprintf(s->sig, sizeof(s->sig), "%s", sig);
+  if (!sigPatternParse(s->sig, &s->pattern)) {
+    fprintf(stderr, "Invalid signature %s.\n", name);
+    return NULL;
+  }
+  gSigCount++;
+
+  return s;
+}
+
+/**
+ * Load signatures from a text file.
+ */
+static i32 loadSigFile(const char *path) {
+  char line[BENCH_SIG_LEN + 64], name[64], *sig, *eq, *end;
+  u32 lineNo = 0;
+  FILE *fd;
+
+  fd = fopen(path, "r");
+  if (!fd) {
+    fprintf(stderr, "Cannot open %s.\n", path);
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), fd)) {
+    lineNo++;
+    end = line + strlen(line);
+    while (end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' '))
+      *--end = 0;
+    sig = line;
+    while (*sig == ' ' || *sig == '\t')
+      sig++;
+    if (!*sig || *sig == '#')
+      continue;
+
+    eq = strchr(sig, '=');
+    if (eq) {
+      *eq = 0;
+      snprintf(name, sizeof(name), "%s", sig);
+      end = name + strlen(name);
+      while (end > name && end[-1] == ' ')
+        *--end = 0;
+      sig = eq + 1;
+      while (*sig == ' ')
+        sig++;
+    } else
+      snprintf(name, sizeof(name), "line_%u", lineNo);
+
+    addSig(name, sig);
+  }
+  fclose(fd);
+
+  return 1;
+}
+
+/**
+ * Sample signatures from the image. Displacements after call and RIP-relative
+ * opcodes are wildcarded like handwritten signatures. Every 8th one is a long
+ * wildcard-free run instead, like bytes of data tables, to exercise the skip
+ * table searcher.
+ */
+static void sampleSigs(u32 count) {
+  char name[64], sig[BENCH_SIG_LEN], *q;
+  const BenchRange *range;
+  const u08 *p;
+  u64 span;
+  u32 len, wild;
+  i32 isLong;
+
+  for (u32 i = 0; i < count; i++) {
+    range = &gImage.ranges[(u32)rand() % gImage.count];
+    isLong = i % 8 == 7;
+    len = isLong ? 96 + (u32)rand() % 160 : 8 + (u32)rand() % 41;
+    span = (u64)(range->end - range->begin);
+    if (span <= len)
+      continue;
+    p = range->begin + ((u64)rand() * RAND_MAX + rand()) % (span - len);
+
+    q = sig;
+    wild = 0;
+    for (u32 j = 0; j < len; j++) {
+      if (!isLong && (wild || (j && rand() % 10 == 0))) {
+        q += sprintf(q, "?? ");
+        if (wild)
+          wild--;
+        continue;
+      }
+      q += sprintf(q, "%02X ", p[j]);
+      if (!isLong && (p[j] == 0xE8 || p[j] == 0xE9))
+        wild = 4;
+    }
+    q[-1] = 0;
+
+    snprintf(name, sizeof(name), isLong ? "long_%u" : "sample_%u", i);
+    addSig(name, sig);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// [SECTION] Benchmarks.
+// ----------------------------------------------------------------------------
+
+/**
+ * Find the first match in all ranges with the given searcher.
+ */
+static const u08 *findInRanges(PFN_SigPatternFind fn, const SigPattern *pattern) {
+  const u08 *found = NULL;
+
+  for (u32 i = 0; i < gImage.count && !found; i++)
+    found = fn(pattern, gImage.ranges[i].begin, gImage.ranges[i].end);
+
+  return found;
+}
+
+/**
+ * Bytes touched by a search that stops at `found`.
+ */
+static u64 scannedBytes(const u08 *found) {
+  u64 total = 0;
+
+  for (u32 i = 0; i < gImage.count; i++) {
+    if (found >= gImage.ranges[i].begin && found < gImage.ranges[i].end)
+      return total + (u64)(found - gImage.ranges[i].begin);
+    total += (u64)(gImage.ranges[i].end - gImage.ranges[i].begin);
+  }
+
+  return total;
+}
+
+/**
+ * Run every signature alone, and compare with the reference searcher.
+ */
+static u32 benchSingle(u32 iterations) {
+  const u08 *found;
+  f64 t, best, ref, totalBest = 0, totalRef = 0;
+  u64 bytes, totalBytes = 0;
+  u32 bad = 0;
+
+  printf("%-24s %5s %5s %12s %10s %12s %10s  %s\n",
+    "signature", "len", "run", "offset", "us", "MB/s", "ref us", "result");
+
+  for (u32 i = 0; i < gSigCount; i++) {
+    BenchSig *s = &gSigs[i];
+
+    t = now();
+    s->expected = findInRanges(sigPatternFindScalar, &s->pattern);
+    ref = now() - t;
+
+    best = 1e30;
+    found = NULL;
+    for (u32 k = 0; k < iterations; k++) {
+      t = now();
+      found = findInRanges(sigPatternFind, &s->pattern);
+      t = now() - t;
+      if (t < best)
+        best = t;
+    }
+
+    bytes = scannedBytes(s->expected);
+    totalBytes += bytes;
+    totalBest += best;
+    totalRef += ref;
+    if (found != s->expected)
+      bad++;
+
+    printf("%-24s %5llu %5llu %12lld %10.1f %12.1f %10.1f  %s\n",
+      s->name,
+      s->pattern.len,
+      s->pattern.runLen,
+      s->expected ? (i64)(s->expected - gImage.base) : -1LL,
+      best * 1e6,
+      bytes / best / 1048576.0,
+      ref * 1e6,
+      found == s->expected ? (s->expected ? "ok" : "ok (none)") : "MISMATCH");
+  }
+
+  printf("\nSingle: %u signatures, %.1f MB scanned, %.1f MB/s, reference %.1f MB/s\n",
+    gSigCount,
+    totalBytes / 1048576.0,
+    totalBytes / totalBest / 1048576.0,
+    totalBytes / totalRef / 1048576.0);
+
+  return bad;
+}
+
+/**
+ * Resolve all signatures with one sweep of the multi-pattern matcher, as
+ * HTSigScanFuncEx() does.
+ */
+static u32 benchMulti(u32 iterations) {
+  SigPattern *patterns;
+  SigMatcher *matcher;
+  const u08 **found;
+  f64 t, best = 1e30, build;
+  u64 total = 0;
+  u32 bad = 0, remaining;
+
+  patterns = (SigPattern *)malloc(gSigCount * sizeof(SigPattern));
+  found = (const u08 **)malloc(gSigCount * sizeof(u08 *));
+  if (!patterns || !found) {
+    free(patterns);
+    free(found);
+    return 1;
+  }
+  for (u32 i = 0; i < gSigCount; i++)
+    patterns[i] = gSigs[i].pattern;
+
+  t = now();
+  matcher = sigMatcherCreate(patterns, gSigCount);
+  build = now() - t;
+  if (!matcher) {
+    fprintf(stderr, "Failed to create the matcher.\n");
+    free(patterns);
+    free(found);
+    return 1;
+  }
+
+  for (u32 k = 0; k < iterations; k++) {
+    memset(found, 0, gSigCount * sizeof(u08 *));
+    t = now();
+    remaining = gSigCount;
+    for (u32 i = 0; i < gImage.count && remaining; i++)
+      remaining = sigMatcherFind(
+        matcher, gImage.ranges[i].begin, gImage.ranges[i].end, found);
+    t = now() - t;
+    if (t < best)
+      best = t;
+  }
+
+  for (u32 i = 0; i < gSigCount; i++) {
+    if (found[i] != gSigs[i].expected) {
+      printf("Multi mismatch: %s\n", gSigs[i].name);
+      bad++;
+    }
+  }
+  for (u32 i = 0; i < gImage.count; i++)
+    total += (u64)(gImage.ranges[i].end - gImage.ranges[i].begin);
+
+  printf("Multi: %u signatures, build %.1f us, sweep %.1f us, %.1f MB/s, %u mismatches\n",
+    gSigCount,
+    build * 1e6,
+    best * 1e6,
+    total / best / 1048576.0,
+    bad);
+
+  sigMatcherFree(matcher);
+  free(patterns);
+  free(found);
+
+  return bad;
+}
+
+static void usage() {
+  fprintf(stderr,
+    "Usage: sigbench [-s section] [-f sigfile] [-g count] [-n iterations] "
+    "[-r seed] <image.exe | --random MB>\n");
+}
+
+int main(int argc, char **argv) {
+  const char *imagePath = NULL, *section = NULL, *sigFile = NULL;
+  u64 randomMb = 0, total = 0;
+  u32 samples = 64, iterations = 5, seed = 1, bad;
+
+  for (i32 i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      section = argv[++i];
+    else if (!strcmp(argv[i], "-f") && i + 1 < argc)
+      sigFile = argv[++i];
+    else if (!strcmp(argv[i], "-g") && i + 1 < argc)
+      samples = (u32)strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      iterations = (u32)strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      seed = (u32)strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--random") && i + 1 < argc)
+      randomMb = strtoull(argv[++i], NULL, 10);
+    else if (argv[i][0] != '-' && !imagePath)
+      imagePath = argv[i];
+    else {
+      usage();
+      return 2;
+    }
+  }
+  if ((!imagePath && !randomMb) || !iterations) {
+    usage();
+    return 2;
+  }
+
+  srand(seed);
+  if (
+    imagePath
+      ? !loadPeImage(imagePath, section, &gImage)
+      : !loadRandomImage(randomMb, &gImage)
+  )
+    return 2;
+
+  for (u32 i = 0; i < gImage.count; i++)
+    total += (u64)(gImage.ranges[i].end - gImage.ranges[i].begin);
+  printf("Image: %s, %u ranges, %.1f MB selected\n\n",
+    imagePath ? imagePath : "random",
+    gImage.count,
+    total / 1048576.0);
+
+  gSigs = (BenchSig *)calloc(BENCH_MAX_SIGS, sizeof(BenchSig));
+  if (!gSigs)
+    return 2;
+  if (sigFile) {
+    if (!loadSigFile(sigFile))
+      return 2;
+  } else
+    for (u32 i = 0; i < sizeof(gBuiltinSigs) / sizeof(gBuiltinSigs[0]); i++)
+      addSig(gBuiltinSigs[i][0], gBuiltinSigs[i][1]);
+  sampleSigs(samples);
+  if (!gSigCount) {
+    fprintf(stderr, "No signatures to scan.\n");
+    return 2;
+  }
+
+  bad = benchSingle(iterations);
+  bad += benchMulti(iterations);
+
+  for (u32 i = 0; i < gSigCount; i++)
+    sigPatternFree(&gSigs[i].pattern);
+  free(gSigs);
+  free(gImage.base);
+
+  if (bad) {
+    printf("\nFAILED: %u mismatches against the reference searcher.\n", bad);
+    return 1;
+  }
+  printf("\nAll matches agree with the reference searcher.\n");
+
+  return 0;
+}